@@ -21,6 +21,15 @@
 #define UART_TX_IDLE_NUM_DEFAULT   (0)
 #define UART_PATTERN_DET_QLEN_DEFAULT (10)
 #define UART_MIN_WAKEUP_THRESH      (2)
+#define UART_EVENT_QUEUE_SIZE       (40)
+
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+#define UART_RTS_THRESH                 CONFIG_DRIVER_FSOVERBUS_UART_RTS_THRESH
+#define UART_EVENT_QUEUE_HIGH_WATERMARK (UART_EVENT_QUEUE_SIZE * 3 / 4)
+#define UART_EVENT_QUEUE_LOW_WATERMARK  (UART_EVENT_QUEUE_SIZE / 4)
+#else
+#define UART_RTS_THRESH                 (32)
+#endif
 
 uart_config_t uart_config = {
     .baud_rate = CONFIG_DRIVER_FSOVERBUS_UART_BAUD,
@@ -28,7 +37,7 @@ uart_config_t uart_config = {
     .parity = UART_PARITY_DISABLE,
     .stop_bits = UART_STOP_BITS_1,
     .flow_ctrl = UART_HW_FLOWCTRL_RTS,
-    .rx_flow_ctrl_thresh = 32,
+    .rx_flow_ctrl_thresh = UART_RTS_THRESH,
     };
 
 QueueHandle_t uart_queue;
@@ -41,6 +50,36 @@ uint32_t min(uint32_t a, uint32_t b) {
     return a < b ? a : b;
 }
 
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+bool rx_paused = false;
+
+/*
+* Pause reception when the handler falls behind and resume once it caught up again.
+* While paused the rx interrupt is masked, the hardware fifo fills up and the peripheral
+* deasserts RTS by itself once UART_RTS_THRESH bytes are waiting, throttling the sender.
+*/
+void update_flow_control() {
+    size_t buffered = 0;
+    uart_get_buffered_data_len(CONFIG_DRIVER_FSOVERBUS_UART_NUM, &buffered);
+    UBaseType_t pending = uxQueueMessagesWaiting(uart_queue);
+    if(!rx_paused) {
+        if(buffered >= CONFIG_DRIVER_FSOVERBUS_UART_HIGH_WATERMARK || pending >= UART_EVENT_QUEUE_HIGH_WATERMARK) {
+            uart_disable_rx_intr(CONFIG_DRIVER_FSOVERBUS_UART_NUM);
+            rx_paused = true;
+        }
+    } else if(buffered <= CONFIG_DRIVER_FSOVERBUS_UART_LOW_WATERMARK && pending <= UART_EVENT_QUEUE_LOW_WATERMARK) {
+        uart_enable_rx_intr(CONFIG_DRIVER_FSOVERBUS_UART_NUM);
+        rx_paused = false;
+    }
+}
+
+void resume_flow_control() {
+    if(rx_paused) {
+        uart_enable_rx_intr(CONFIG_DRIVER_FSOVERBUS_UART_NUM);
+        rx_paused = false;
+    }
+}
+#else
 void fixcts(bool high) {
     uint32_t data_buf = 0;
     uart_get_buffered_data_len(CONFIG_DRIVER_FSOVERBUS_UART_NUM, &data_buf);
@@ -53,6 +92,7 @@ void fixcts(bool high) {
         uart_set_pin(CONFIG_DRIVER_FSOVERBUS_UART_NUM, CONFIG_DRIVER_FSOVERBUS_UART_TX, CONFIG_DRIVER_FSOVERBUS_UART_RX, CONFIG_DRIVER_FSOVERBUS_UART_CTS, -1); //Change pins
     }
 }
+#endif
 
 void fsoveruartTask(void *pvParameter) {
     uart_event_t event;
@@ -68,7 +108,9 @@ void fsoveruartTask(void *pvParameter) {
         //Waiting for UART event.
         if(xQueueReceive(uart_queue, (void * )&event, (portTickType)portMAX_DELAY)) {
             bzero(dtmp, RD_BUF_SIZE);
+#if !CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
             fixcts(false);
+#endif
             uint32_t bytesread = 0;
             uint32_t bytestoread;
             switch(event.type) {
@@ -87,7 +129,7 @@ void fsoveruartTask(void *pvParameter) {
                             size = *((uint32_t *) &dtmp[2]);
                             verif = *((uint16_t *) &dtmp[6]);
                             message_id = *((uint32_t *) &dtmp[8]);
-                            ESP_LOGI(TAG, "new packet: %d %d %d %d %d", command, size, verif, event.size-PACKET_HEADER_SIZE, message_id);
+                            ESP_LOGD(TAG, "new packet: %d %d %d %d %d", command, size, verif, event.size-PACKET_HEADER_SIZE, message_id);
                             if(verif == 0xADDE) {
                                 receiving = 1;
                                 recv = 0;
@@ -105,10 +147,14 @@ void fsoveruartTask(void *pvParameter) {
                             bytestoread = uart_read_bytes(CONFIG_DRIVER_FSOVERBUS_UART_NUM, dtmp, bytestoread, portMAX_DELAY);
                             recv = recv + bytestoread;
                             bytesread += bytestoread;
-                            ESP_LOGI(TAG, "processing packet: %d %d %d %d %d", command, size, recv, verif, bytestoread);
+                            ESP_LOGV(TAG, "processing packet: %d %d %d %d %d", command, size, recv, verif, bytestoread);
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+                            handleFSCommand(dtmp, command, message_id, size, recv, bytestoread);
+#else
                             fixcts(true);
                             handleFSCommand(dtmp, command, message_id, size, recv, bytestoread);
                             fixcts(false);
+#endif
                             if(recv == size) {
                                 receiving = 0;
                             }
@@ -123,9 +169,19 @@ void fsoveruartTask(void *pvParameter) {
                     // As an example, we directly flush the rx buffer here in order to read more data.
                     uart_flush_input(CONFIG_DRIVER_FSOVERBUS_UART_NUM);
                     xQueueReset(uart_queue);
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+                    resume_flow_control();
+#endif
                     break;
                 //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+                    // The driver keeps the data in the hardware fifo and masks the rx interrupt,
+                    // so RTS throttles the sender. Nothing is lost, the data is picked up once read.
+                    ESP_LOGD(TAG, "ring buffer full");
+                    rx_paused = true;
+                    break;
+#endif
                     ESP_LOGW(TAG, "ring buffer full");
                     // If buffer full happened, you should consider encreasing your buffer size
                     // As an example, we directly flush the rx buffer here in order to read more data.
@@ -158,7 +214,11 @@ void fsoveruartTask(void *pvParameter) {
             } else {
                 fsob_stop_timeout();
             }
+#if CONFIG_DRIVER_FSOVERBUS_UART_WATERMARK_FLOWCTRL
+            update_flow_control();
+#else
             fixcts(false);
+#endif
         }
     }
     free(dtmp);
@@ -170,7 +230,7 @@ void fsoveruartTask(void *pvParameter) {
 void fsob_init() {
     uart_param_config(CONFIG_DRIVER_FSOVERBUS_UART_NUM, &uart_config);   //Configure the uart hardware
     uart_set_pin(CONFIG_DRIVER_FSOVERBUS_UART_NUM, CONFIG_DRIVER_FSOVERBUS_UART_TX, CONFIG_DRIVER_FSOVERBUS_UART_RX, CONFIG_DRIVER_FSOVERBUS_UART_CTS, -1); //Change pins
-    uart_driver_install(CONFIG_DRIVER_FSOVERBUS_UART_NUM, CONFIG_DRIVER_FSOVERBUS_UART_BUFFER_SIZE, CONFIG_DRIVER_FSOVERBUS_UART_BUFFER_SIZE, 40, &uart_queue, 0); //Install driver
+    uart_driver_install(CONFIG_DRIVER_FSOVERBUS_UART_NUM, CONFIG_DRIVER_FSOVERBUS_UART_BUFFER_SIZE, CONFIG_DRIVER_FSOVERBUS_UART_BUFFER_SIZE, UART_EVENT_QUEUE_SIZE, &uart_queue, 0); //Install driver
 
     uart_intr_config_t uart_intr = {
         .intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M
@@ -0,0 +1,59 @@
+#include "app_listing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+typedef struct {
+    installed_app_t* apps;
+    size_t           amount;
+    size_t           index;
+    char             slug[64];  // Of the app in the listing being parsed, empty if not there (yet)
+    int              version;   // -1 if not there (yet)
+} app_listing_parser_t;
+
+static bool app_listing_same_category(const installed_app_t* app, const installed_app_t* other) {
+    return (strcmp(other->type, app->type) == 0) && (strcmp(other->category, app->category) == 0);
+}
+
+void app_listing_mark(installed_app_t* apps, size_t amount, size_t index) {
+    for (size_t other = index; other < amount; other++) {
+        if (app_listing_same_category(&apps[index], &apps[other])) apps[other].listed = true;
+    }
+}
+
+static bool app_listing_callback(void* ctx, json_stream_event_t event, const char* key, const char* value, size_t depth) {
+    app_listing_parser_t* parser = (app_listing_parser_t*) ctx;
+
+    // Elements of arrays have no name, apps are objects
+    if ((depth == 2) && (key == NULL)) return true;
+    // The listing is an array of apps, their members are at depth 2
+    if ((event == JSON_STREAM_OBJECT_START) && (depth == 1)) {
+        parser->slug[0] = '\0';
+        parser->version = -1;
+    } else if ((event == JSON_STREAM_STRING) && (depth == 2) && (strcmp(key, "slug") == 0)) {
+        // Longer than any slug of an installed app, can't match one
+        if (strlen(value) >= sizeof(parser->slug)) return true;
+        strcpy(parser->slug, value);
+    } else if ((event == JSON_STREAM_NUMBER) && (depth == 2) && (strcmp(key, "version") == 0)) {
+        parser->version = atoi(value);
+    } else if ((event == JSON_STREAM_OBJECT_END) && (depth == 1) && (parser->slug[0] != '\0') && (parser->version >= 0)) {
+        installed_app_t* app = &parser->apps[parser->index];
+        for (size_t other = parser->index; other < parser->amount; other++) {
+            if (app_listing_same_category(app, &parser->apps[other]) && (strcmp(parser->apps[other].slug, parser->slug) == 0)) {
+                parser->apps[other].available_version = parser->version;
+            }
+        }
+    }
+    return true;
+}
+
+bool app_listing_apply(installed_app_t* apps, size_t amount, size_t index, const char* data, size_t size) {
+    app_listing_parser_t parser = {.apps = apps, .amount = amount, .index = index, .slug = "", .version = -1};
+    json_stream_t        stream;
+    json_stream_init(&stream, app_listing_callback, &parser);
+    bool success = json_stream_feed(&stream, data, size) && json_stream_finish(&stream);
+    json_stream_free(&stream);
+    return success;
+}
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "app_management.h"
 #include "appfs_wrapper.h"
 #include "bootscreen.h"
 #include "cJSON.h"
@@ -17,6 +19,7 @@
 #include "hardware.h"
 #include "http_download.h"
 #include "menu.h"
+#include "mbedtls/sha256.h"
 #include "metadata.h"
 #include "pax_codecs.h"
 #include "pax_gfx.h"
@@ -32,6 +35,149 @@ static const char* esp32_type       = "esp32";
 static const char* esp32_bin_fn     = "main.bin";
 static const char* metadata_json_fn = "metadata.json";
 
+typedef struct {
+    const char*          name;     // AppFS file name
+    const char*          title;    // AppFS file title
+    uint16_t             version;  // AppFS file version
+    size_t               size;     // Size from the app metadata, used when the server doesn't send a content length
+    appfs_writer_t       appfs;    // Writer for the AppFS file, created when the first data arrives
+    bool                 created;  // AppFS file has been created
+    bool                 update;   // Replaces an installed app, only written to the copy, which goes to AppFS once complete and verified
+    size_t               written;  // Bytes received so far
+    FILE*                copy;     // Copy of the binary on the SD card, or staged update (optional)
+    const volatile bool* cancel;   // Stops the download when set (optional)
+} esp32_binary_stream_t;
+
+static bool install_esp32_binary_data(void* ctx, size_t size, size_t offset, const uint8_t* data, size_t length) {
+    esp32_binary_stream_t* stream = (esp32_binary_stream_t*) ctx;
+
+    if ((stream->cancel != NULL) && *stream->cancel) return false;
+
+    if (offset == 0) {
+        // First block of the download (again, when retrying), (re)create the AppFS file
+        if (size == 0) size = stream->size;
+        if (size == 0) {
+            ESP_LOGE(TAG, "Size of the ESP32 binary is unknown");
+            return false;
+        }
+        // Creating the AppFS file erases the installed app, which has to keep working if the download of an update fails
+        if (!stream->update) {
+            if (appfs_writer_create(&stream->appfs, stream->name, stream->title, stream->version, size) != ESP_OK) return false;
+            stream->created = true;
+        }
+        stream->written = 0;
+        if (stream->copy != NULL) {
+            fseek(stream->copy, 0, SEEK_SET);
+            ftruncate(fileno(stream->copy), 0);
+        }
+    } else if ((!stream->created && !stream->update) || (offset != stream->written)) {
+        ESP_LOGE(TAG, "Download of the ESP32 binary resumed at the wrong position");
+        return false;
+    }
+
+    if ((!stream->update) && (appfs_writer_write(&stream->appfs, data, length) != ESP_OK)) return false;
+    stream->written += length;
+
+    if ((stream->copy != NULL) && (fwrite(data, 1, length, stream->copy) != length)) {
+        ESP_LOGE(TAG, "Failed to write the copy of the ESP32 binary");
+        return false;
+    }
+
+    return true;
+}
+
+static bool install_esp32_binary_file(esp32_binary_stream_t* stream, const char* path) {
+    // Feeds a local copy of the binary through the same path as a download
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL) return false;
+    fseek(fd, 0, SEEK_END);
+    size_t size = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    uint8_t* buffer  = malloc(4096);
+    size_t   offset  = 0;
+    bool     success = (buffer != NULL) && (size > 0);
+    while (success && (offset < size)) {
+        size_t length = fread(buffer, 1, 4096, fd);
+        success       = (length > 0) && install_esp32_binary_data(stream, size, offset, buffer, length);
+        offset += length;
+    }
+    free(buffer);
+    fclose(fd);
+    return success;
+}
+
+static bool file_has_sha256(const char* path, const char* sha256) {
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL) return false;
+    uint8_t* buffer = malloc(4096);
+    if (buffer == NULL) {
+        fclose(fd);
+        return false;
+    }
+    mbedtls_sha256_context hash;
+    mbedtls_sha256_init(&hash);
+    mbedtls_sha256_starts_ret(&hash, 0);
+    size_t length;
+    while ((length = fread(buffer, 1, 4096, fd)) > 0) mbedtls_sha256_update_ret(&hash, buffer, length);
+    uint8_t digest[32];
+    mbedtls_sha256_finish_ret(&hash, digest);
+    mbedtls_sha256_free(&hash);
+    free(buffer);
+    fclose(fd);
+
+    char hex[sizeof(digest) * 2 + 1];
+    for (size_t index = 0; index < sizeof(digest); index++) sprintf(&hex[index * 2], "%02x", digest[index]);
+    return strcasecmp(hex, sha256) == 0;
+}
+
+typedef struct {
+    xQueueHandle         button_queue;  // Wait for a button press after showing the result (optional)
+    install_progress_t   progress;      // Progress callback, used instead of messages on the display (optional)
+    void*                ctx;
+    const volatile bool* cancel;        // Stops the installation when set (optional)
+    size_t               completed;     // Files of the app installed so far
+    size_t               total;
+} install_context_t;
+
+static void install_message(install_context_t* install, const char* message) {
+    // Installations in the background leave the display to the menus
+    if (install->progress != NULL) {
+        ESP_LOGI(TAG, "%s", message);
+        return;
+    }
+    render_message(message);
+    display_flush();
+}
+
+static void install_report(install_context_t* install, install_stage_t stage) {
+    if (install->progress != NULL) install->progress(install->ctx, stage, install->completed, install->total);
+}
+
+static bool install_cancelled(install_context_t* install) { return (install->cancel != NULL) && *install->cancel; }
+
+typedef struct {
+    install_context_t* install;
+    const char*        app_name;
+    bool               failed;
+} download_progress_ctx_t;
+
+static bool install_app_progress(void* ctx, const download_job_t* job, size_t completed, size_t total) {
+    download_progress_ctx_t* progress = (download_progress_ctx_t*) ctx;
+    install_context_t*       install  = progress->install;
+    if (job->success) install->completed++;
+    install_report(install, INSTALL_STAGE_DOWNLOADING);
+    if (progress->failed) return false;  // Keep the failure message on screen
+    char buffer[257];
+    if (job->success) {
+        snprintf(buffer, sizeof(buffer), "Installing %s:\nDownloaded %u of %u files\n'%s'", progress->app_name, completed, total, job->name);
+    } else {
+        snprintf(buffer, sizeof(buffer), "Failed to download file\n'%s'", job->name);
+        progress->failed = true;
+    }
+    install_message(install, buffer);
+    return !install_cancelled(install);
+}
+
 bool create_dir(const char* path) {
     struct stat st = {0};
     if (stat(path, &st) == 0) {
@@ -40,7 +186,8 @@ bool create_dir(const char* path) {
     return mkdir(path, 0777) == 0;
 }
 
-bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info, cJSON* json_app_info) {
+static bool _install_app(install_context_t* install, const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info,
+                         cJSON* json_app_info) {
     cJSON* slug_obj = cJSON_GetObjectItem(json_app_info, "slug");
     cJSON* name_obj = cJSON_GetObjectItem(json_app_info, "name");
     // cJSON* author_obj      = cJSON_GetObjectItem(json_app_info, "author");
@@ -54,17 +201,15 @@ bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_ca
 
     // Create folders
     snprintf(buffer, sizeof(buffer) - 1, "Installing %s:\nCreating folders...", name_obj->valuestring);
-    render_message(buffer);
-    display_flush();
+    install_message(install, buffer);
 
     snprintf(buffer, sizeof(buffer) - 1, "%s/apps", to_sd_card ? sdcard_path : internal_path);
     printf("Creating dir: %s\r\n", buffer);
     if (!create_dir(buffer)) {
         // Failed to create app directory
         ESP_LOGI(TAG, "Failed to create %s", buffer);
-        render_message("Failed create folder");
-        display_flush();
-        if (button_queue != NULL) wait_for_button();
+        install_message(install, "Failed create folder");
+        if (install->button_queue != NULL) wait_for_button();
         return false;
     }
 
@@ -73,9 +218,8 @@ bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_ca
     if (!create_dir(buffer)) {
         // failed to create app type directory
         ESP_LOGI(TAG, "Failed to create %s", buffer);
-        render_message("Failed create folder");
-        display_flush();
-        if (button_queue != NULL) wait_for_button();
+        install_message(install, "Failed create folder");
+        if (install->button_queue != NULL) wait_for_button();
         return false;
     }
 
@@ -84,96 +228,179 @@ bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_ca
     if (!create_dir(buffer)) {
         // failed to create app directory
         ESP_LOGI(TAG, "Failed to create %s", buffer);
-        render_message("Failed create folder");
-        display_flush();
-        if (button_queue != NULL) wait_for_button();
+        install_message(install, "Failed create folder");
+        if (install->button_queue != NULL) wait_for_button();
         return false;
     }
 
-    // Download files
+    // Download files, the ESP32 binary goes to AppFS right away, the others are downloaded in parallel afterwards
+    int             files_amount = cJSON_GetArraySize(files_obj);
+    download_job_t* jobs         = calloc(files_amount > 0 ? files_amount : 1, sizeof(download_job_t));
+    char**          job_paths    = calloc(files_amount > 0 ? files_amount : 1, sizeof(char*));
+    size_t          jobs_amount  = 0;
+    bool            files_ok     = (jobs != NULL) && (job_paths != NULL);
+    install->total               = files_amount;
+    if (!files_ok) {
+        ESP_LOGE(TAG, "Failed to allocate download list");
+        install_message(install, "Failed to download file");
+    }
+
     cJSON* file_obj;
     cJSON_ArrayForEach(file_obj, files_obj) {
+        if (!files_ok) break;
+        if (install_cancelled(install)) {
+            install_message(install, "Installation cancelled");
+            files_ok = false;
+            break;
+        }
         cJSON* name_obj = cJSON_GetObjectItem(file_obj, "name");
         cJSON* url_obj  = cJSON_GetObjectItem(file_obj, "url");
-        // cJSON* size_obj = cJSON_GetObjectItem(file_obj, "size");
+        cJSON* size_obj = cJSON_GetObjectItem(file_obj, "size");
+        cJSON* hash_obj = cJSON_GetObjectItem(file_obj, "sha256");
+        // Files are verified against the hash in the app metadata if it has one
+        const char* sha256 = cJSON_IsString(hash_obj) ? hash_obj->valuestring : NULL;
         if ((strcmp(type_slug, esp32_type) == 0) && (strcmp(name_obj->valuestring, esp32_bin_fn) == 0)) {
             snprintf(buffer, sizeof(buffer) - 1, "Installing %s:\nDownloading '%s' to AppFS", name_obj->valuestring, name_obj->valuestring);
-            render_message(buffer);
-            display_flush();
+            install_message(install, buffer);
             snprintf(buffer, sizeof(buffer) - 1, "%s/apps/%s/%s/%s", to_sd_card ? sdcard_path : internal_path, type_slug, slug_obj->valuestring,
                      name_obj->valuestring);
-            uint8_t* esp32_binary_data;
-            size_t   esp32_binary_size;
-            bool     success = download_ram(url_obj->valuestring, (uint8_t**) &esp32_binary_data, &esp32_binary_size);
-            if (!success) {
-                ESP_LOGI(TAG, "Failed to download %s to RAM", url_obj->valuestring);
-                render_message("Failed to download file");
-                display_flush();
-                if (button_queue != NULL) wait_for_button();
-                return false;
+            // Stream the binary into AppFS as it is downloaded, storing the copy on the SD card along the way
+            appfs_handle_t installed = appfsOpen(slug_obj->valuestring);
+            if (installed != APPFS_INVALID_FD) appfsClose(installed);
+            esp32_binary_stream_t stream = {
+                .name    = slug_obj->valuestring,
+                .title   = name_obj->valuestring,
+                .version = version_obj->valueint,
+                .size    = cJSON_IsNumber(size_obj) ? size_obj->valueint : 0,
+                .created = false,
+                .update  = false,
+                .copy    = NULL,
+                .cancel  = install->cancel,
+            };
+            if (to_sd_card && (sha256 != NULL)) install_report(install, INSTALL_STAGE_VERIFYING);
+            if (to_sd_card && (sha256 != NULL) && file_has_sha256(buffer, sha256)) {
+                // Unchanged since the installed version, (re)install to AppFS from the copy on the SD card
+                printf("Installing unchanged binary from %s\r\n", buffer);
+                if (!install_esp32_binary_file(&stream, buffer)) {
+                    if (stream.created) appfsDeleteFile(stream.name);
+                    ESP_LOGI(TAG, "Failed to install %s to AppFS", buffer);
+                    install_message(install, "Failed to install app to AppFS");
+                    files_ok = false;
+                }
+                install->completed++;
+                continue;
             }
-            if (esp32_binary_data != NULL) {  // Ignore 0 bytes files
-                esp_err_t res = appfs_store_in_memory_app(button_queue, slug_obj->valuestring, name_obj->valuestring, version_obj->valueint, esp32_binary_size,
-                                                          esp32_binary_data);
-                if (res != ESP_OK) {
-                    free(esp32_binary_data);
-                    ESP_LOGI(TAG, "Failed to store ESP32 binary");
-                    render_message("Failed to install app to AppFS");
-                    display_flush();
-                    if (button_queue != NULL) wait_for_button();
-                    return false;
+            // An update is downloaded to a file next to the installed copy first and goes to AppFS from there once it is verified
+            char staging[sizeof(buffer) + 4];
+            stream.update = installed != APPFS_INVALID_FD;
+            snprintf(staging, sizeof(staging), "%s%s", buffer, stream.update ? ".new" : "");
+            if (to_sd_card || stream.update) {
+                printf("Creating file: %s\r\n", staging);
+                stream.copy = fopen(staging, "w");
+                if (stream.copy == NULL) {
+                    ESP_LOGI(TAG, "Failed to install ESP32 binary to %s", staging);
+                    install_message(install, to_sd_card ? "Failed to install app to SD card" : "Failed to store app update");
+                    files_ok = false;
+                    break;
                 }
-                if (to_sd_card) {
-                    render_message("Storing a copy of the ESP32\nbinary to the SD card...");
-                    display_flush();
-                    printf("Creating file: %s\r\n", buffer);
-                    FILE* binary_fd = fopen(buffer, "w");
-                    if (binary_fd == NULL) {
-                        free(esp32_binary_data);
-                        ESP_LOGI(TAG, "Failed to install ESP32 binary to %s", buffer);
-                        render_message("Failed to install app to SD card");
-                        display_flush();
-                        if (button_queue != NULL) wait_for_button();
-                        return false;
-                    }
-                    fwrite(esp32_binary_data, 1, esp32_binary_size, binary_fd);
-                    fclose(binary_fd);
+            }
+            install_report(install, INSTALL_STAGE_DOWNLOADING);
+            bool success = download_stream_verified(url_obj->valuestring, install_esp32_binary_data, &stream, sha256, install->cancel);
+            bool staged  = stream.copy != NULL;
+            if (stream.copy != NULL) fclose(stream.copy);
+            stream.copy = NULL;
+            if (success && stream.update) {
+                // Complete and verified, the installed app is replaced now and that isn't interrupted any more
+                stream.update = false;
+                stream.cancel = NULL;
+                success       = install_esp32_binary_file(&stream, staging);
+                if (success && to_sd_card) {
+                    remove(buffer);
+                    if (rename(staging, buffer) != 0) ESP_LOGW(TAG, "Failed to replace the copy of the ESP32 binary at %s", buffer);
                 }
-                free(esp32_binary_data);
+            }
+            if (staged && ((!success) || (strcmp(staging, buffer) != 0))) remove(staging);
+            if (!success) {
+                if (stream.created) appfsDeleteFile(stream.name);
+                ESP_LOGI(TAG, "Failed to download %s to AppFS", url_obj->valuestring);
+                install_message(install, stream.created ? "Failed to install app to AppFS" : "Failed to download file");
+                files_ok = false;
+            } else {
+                install->completed++;
             }
         } else {
-            snprintf(buffer, sizeof(buffer) - 1, "Installing %s:\nDownloading '%s'...", name_obj->valuestring, name_obj->valuestring);
-            render_message(buffer);
-            display_flush();
             snprintf(buffer, sizeof(buffer) - 1, "%s/apps/%s/%s/%s", to_sd_card ? sdcard_path : internal_path, type_slug, slug_obj->valuestring,
                      name_obj->valuestring);
-            printf("Downloading file: %s\r\n", buffer);
-            if (!download_file(url_obj->valuestring, buffer)) {
-                ESP_LOGI(TAG, "Failed to download %s to %s", url_obj->valuestring, buffer);
-                render_message("Failed to download file");
-                display_flush();
-                if (button_queue != NULL) wait_for_button();
-                return false;
+            if (sha256 != NULL) install_report(install, INSTALL_STAGE_VERIFYING);
+            if ((sha256 != NULL) && file_has_sha256(buffer, sha256)) {
+                printf("Unchanged, not downloading: %s\r\n", buffer);
+                install->completed++;
+                continue;
+            }
+            job_paths[jobs_amount] = strdup(buffer);
+            if (job_paths[jobs_amount] == NULL) {
+                install_message(install, "Failed to download file");
+                files_ok = false;
+                break;
             }
+            jobs[jobs_amount].url    = url_obj->valuestring;
+            jobs[jobs_amount].path   = job_paths[jobs_amount];
+            jobs[jobs_amount].name   = name_obj->valuestring;
+            jobs[jobs_amount].sha256 = sha256;
+            jobs_amount++;
+        }
+    }
+
+    if (files_ok && (jobs_amount > 0)) {
+        snprintf(buffer, sizeof(buffer) - 1, "Installing %s:\nDownloading %u files...", name_obj->valuestring, jobs_amount);
+        install_message(install, buffer);
+        install_report(install, INSTALL_STAGE_DOWNLOADING);
+        download_progress_ctx_t progress = {.install = install, .app_name = name_obj->valuestring, .failed = false};
+        files_ok                         = download_files(jobs, jobs_amount, install_app_progress, &progress, install->cancel);
+        if ((!files_ok) && (!progress.failed)) {
+            install_message(install, install_cancelled(install) ? "Installation cancelled" : "Failed to download file");
         }
     }
 
-    // Install metadata.json
+    for (size_t index = 0; index < jobs_amount; index++) free(job_paths[index]);
+    free(job_paths);
+    free(jobs);
+
+    if (!files_ok) {
+        if (install->button_queue != NULL) wait_for_button();
+        return false;
+    }
+
+    // Install metadata.json, the app shows up in the launcher from here on
+    install_report(install, INSTALL_STAGE_VERIFYING);
     snprintf(buffer, sizeof(buffer) - 1, "%s/apps/%s/%s/%s", to_sd_card ? sdcard_path : internal_path, type_slug, slug_obj->valuestring, metadata_json_fn);
     FILE* metadata_fd = fopen(buffer, "w");
     if (metadata_fd == NULL) {
         ESP_LOGI(TAG, "Failed to install metadata to %s", buffer);
-        render_message("Failed to install metadata");
-        display_flush();
-        if (button_queue != NULL) wait_for_button();
+        install_message(install, "Failed to install metadata");
+        if (install->button_queue != NULL) wait_for_button();
         return false;
     }
     fwrite(data_app_info, 1, size_app_info, metadata_fd);
     fclose(metadata_fd);
 
     ESP_LOGI(TAG, "App installed!");
-    render_message("App has been installed!");
-    display_flush();
-    if (button_queue != NULL) wait_for_button();
+    install_message(install, "App has been installed!");
+    if (install->button_queue != NULL) wait_for_button();
     return true;
 }
+
+bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info, cJSON* json_app_info) {
+    install_context_t install = {.button_queue = button_queue};
+    return _install_app(&install, type_slug, to_sd_card, data_app_info, size_app_info, json_app_info);
+}
+
+bool install_app_background(const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info, install_progress_t progress, void* ctx,
+                            const volatile bool* cancel) {
+    cJSON* json_app_info = cJSON_ParseWithLength(data_app_info, size_app_info);
+    if (json_app_info == NULL) return false;
+    install_context_t install = {.progress = progress, .ctx = ctx, .cancel = cancel};
+    bool              success = _install_app(&install, type_slug, to_sd_card, data_app_info, size_app_info, json_app_info);
+    cJSON_Delete(json_app_info);
+    return success;
+}
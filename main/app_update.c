@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "app_listing.h"
 #include "app_management.h"
 #include "appfs.h"
 #include "appfs_wrapper.h"
@@ -21,6 +22,7 @@
 #include "gui_element_header.h"
 #include "hardware.h"
 #include "http_download.h"
+#include "install_queue.h"
 #include "launcher.h"
 #include "menu.h"
 #include "metadata.h"
@@ -29,18 +31,19 @@
 #include "rp2040.h"
 #include "rtc_memory.h"
 #include "system_wrapper.h"
-#include "wifi_connect.h"
 
 static const char* TAG = "Updater";
 
 typedef struct _update_apps_callback_args {
-    xQueueHandle button_queue;
-    bool         sdcard;
+    xQueueHandle     button_queue;
+    bool             sdcard;
+    installed_app_t* apps;      // Installed apps found so far
+    size_t           amount;
+    size_t           capacity;
 } update_apps_callback_args_t;
 
 static bool connect_to_wifi(xQueueHandle button_queue) {
-    if (!wifi_connect_to_stored()) {
-        wifi_disconnect_and_disable();
+    if (!install_queue_take_network()) {
         render_message("Unable to connect to\nthe WiFi network");
         display_flush();
         wait_for_button();
@@ -122,13 +125,11 @@ static void callback(const char* path, const char* entity, void* user) {
     metadata_path[sizeof(metadata_path) - 1] = '\0';
     snprintf(metadata_path, sizeof(metadata_path) - 1, "%s/%s/metadata.json", path, entity);
 
-    char* device            = NULL;
     char* type              = NULL;
     char* category          = NULL;
     char* slug              = NULL;
-    char* name              = NULL;
     int   installed_version = 0;
-    parse_metadata(metadata_path, &device, &type, &category, &slug, &name, NULL, NULL, &installed_version, NULL);
+    parse_metadata(metadata_path, NULL, &type, &category, &slug, NULL, NULL, NULL, &installed_version, NULL);
 
     if ((slug == NULL) || (strcmp(slug, entity) != 0)) {
         snprintf(string_buffer, sizeof(string_buffer) - 1, "%s/%s: no metadata", path, entity);
@@ -146,7 +147,74 @@ static void callback(const char* path, const char* entity, void* user) {
         goto end;
     }
 
-    if (!load_app_info(type, category, slug)) {
+    if (args->amount == args->capacity) {
+        size_t           capacity = (args->capacity > 0) ? args->capacity * 2 : 16;
+        installed_app_t* apps     = realloc(args->apps, capacity * sizeof(installed_app_t));
+        if (apps == NULL) {
+            snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: out of memory", slug);
+            ESP_LOGE(TAG, "%s", string_buffer);
+            terminal_add(strdup(string_buffer));
+            terminal_render();
+            goto end;
+        }
+        args->apps     = apps;
+        args->capacity = capacity;
+    }
+
+    // The list takes over the strings
+    args->apps[args->amount++] = (installed_app_t){.type              = type,
+                                                   .category          = category,
+                                                   .slug              = slug,
+                                                   .installed_version = installed_version,
+                                                   .available_version = -1,
+                                                   .listed            = false,
+                                                   .sdcard            = args->sdcard};
+    type                       = NULL;
+    category                   = NULL;
+    slug                       = NULL;
+
+end:
+    if (type != NULL) free(type);
+    if (slug != NULL) free(slug);
+    if (category != NULL) free(category);
+}
+
+static void check_category(installed_app_t* apps, size_t amount, size_t index) {
+    // A single request for the listing of a category gives the versions of all installed apps in it
+    installed_app_t* app = &apps[index];
+    app_listing_mark(apps, amount, index);
+
+    char url[128];
+    snprintf(url, sizeof(url) - 1, "https://mch2022.badge.team/v2/mch2022/%s/%s", app->type, app->category);
+    char*  data_apps = NULL;
+    size_t size_apps = 0;
+    // Shares the cache with the hatchery, revalidated every time
+    if ((!download_ram_cached(url, (uint8_t**) &data_apps, &size_apps, 0)) || (data_apps == NULL)) {
+        ESP_LOGW(TAG, "Failed to fetch the apps in %s/%s, checking them one by one", app->type, app->category);
+        return;
+    }
+
+    if (!app_listing_apply(apps, amount, index, data_apps, size_apps)) {
+        ESP_LOGW(TAG, "Failed to parse the apps in %s/%s", app->type, app->category);
+    }
+    free(data_apps);
+}
+
+static void update_app(installed_app_t* app) {
+    char string_buffer[128];
+    string_buffer[sizeof(string_buffer) - 1] = '\0';
+    const char* slug                         = app->slug;
+
+    // Known from the category listing, no need to fetch the metadata of the app
+    if ((app->available_version >= 0) && (app->installed_version >= app->available_version)) {
+        snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: up to date", slug);
+        ESP_LOGW(TAG, "%s", string_buffer);
+        terminal_add(strdup(string_buffer));
+        terminal_render();
+        return;
+    }
+
+    if (!load_app_info(app->type, app->category, slug)) {
         snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: fetching metadata failed", slug);
         ESP_LOGW(TAG, "%s", string_buffer);
         terminal_add(strdup(string_buffer));
@@ -164,7 +232,7 @@ static void callback(const char* path, const char* entity, void* user) {
         goto end;
     }
 
-    if (installed_version >= version_obj->valueint) {
+    if (app->installed_version >= version_obj->valueint) {
         snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: up to date", slug);
         ESP_LOGW(TAG, "%s", string_buffer);
         terminal_add(strdup(string_buffer));
@@ -172,12 +240,12 @@ static void callback(const char* path, const char* entity, void* user) {
         goto end;
     }
 
-    snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: r%d to r%d", slug, installed_version, version_obj->valueint);
+    snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: r%d to r%d", slug, app->installed_version, version_obj->valueint);
     ESP_LOGI(TAG, "%s", string_buffer);
     terminal_add(strdup(string_buffer));
     terminal_render();
 
-    if (install_app(NULL, type, args->sdcard, data_app_info, size_app_info, json_app_info)) {
+    if (install_app(NULL, app->type, app->sdcard, data_app_info, size_app_info, json_app_info)) {
         snprintf(string_buffer, sizeof(string_buffer) - 1, "%s: installed r%d", slug, version_obj->valueint);
         ESP_LOGI(TAG, "%s", string_buffer);
     } else {
@@ -190,14 +258,17 @@ static void callback(const char* path, const char* entity, void* user) {
 
 end:
     free_app_info();
-    if (device != NULL) free(device);
-    if (type != NULL) free(type);
-    if (slug != NULL) free(slug);
-    if (category != NULL) free(category);
-    if (name != NULL) free(name);
 }
 
 void update_apps(xQueueHandle button_queue) {
+    if (install_queue_busy()) {
+        // Updates would install into the same folders and AppFS entries as the installations running in the background
+        render_message("Apps are being installed\n\nPlease wait until the\ninstallations are done");
+        display_flush();
+        wait_for_button();
+        return;
+    }
+
     size_t ram_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
     terminal_add(strdup("Connecting to WiFi..."));
     terminal_render();
@@ -212,9 +283,9 @@ void update_apps(xQueueHandle button_queue) {
     terminal_add(strdup("Connected to WiFi"));
     terminal_render();
 
-    update_apps_callback_args_t args;
-    args.button_queue = button_queue;
-    args.sdcard       = false;
+    update_apps_callback_args_t args = {0};
+    args.button_queue                = button_queue;
+    args.sdcard                      = false;
 
     for_entity_in_path("/internal/apps/esp32", true, &callback, &args);
     for_entity_in_path("/internal/apps/python", true, &callback, &args);
@@ -224,8 +295,21 @@ void update_apps(xQueueHandle button_queue) {
     for_entity_in_path("/sd/apps/python", true, &callback, &args);
     for_entity_in_path("/sd/apps/ice40", true, &callback, &args);
 
+    // Versions come from the category listings, only apps that are outdated (or missing from their listing) need a request of their own
+    for (size_t index = 0; index < args.amount; index++) {
+        if (!args.apps[index].listed) check_category(args.apps, args.amount, index);
+        update_app(&args.apps[index]);
+    }
+
+    for (size_t index = 0; index < args.amount; index++) {
+        free(args.apps[index].type);
+        free(args.apps[index].category);
+        free(args.apps[index].slug);
+    }
+    free(args.apps);
+
     terminal_free();
-    wifi_disconnect_and_disable();
+    install_queue_release_network();
     size_t ram_after = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
     printf("Leak: %d (%u to %u)\r\n", ram_before - ram_after, ram_before, ram_after);
 }
@@ -109,3 +109,41 @@ esp_err_t appfs_store_in_memory_app(xQueueHandle button_queue, const char* name,
     ESP_LOGI(TAG, "Application is now stored in AppFS");
     return res;
 }
+
+#define APPFS_WRITER_ERASE_BLOCK SPI_FLASH_MMU_PAGE_SIZE
+
+esp_err_t appfs_writer_create(appfs_writer_t* writer, const char* name, const char* title, uint16_t version, size_t size) {
+    writer->size    = size;
+    writer->erased  = 0;
+    writer->written = 0;
+    esp_err_t res   = appfsCreateFileExt(name, title, version, size, &writer->handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create file on AppFS (%d)", res);
+    }
+    return res;
+}
+
+esp_err_t appfs_writer_write(appfs_writer_t* writer, const uint8_t* data, size_t length) {
+    if (writer->written + length > writer->size) {
+        ESP_LOGE(TAG, "Writing past the end of the file on AppFS");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Erase the blocks this write lands in, one at a time so that erasing and writing are interleaved with the download
+    while (writer->erased < writer->written + length) {
+        esp_err_t res = appfsErase(writer->handle, writer->erased, APPFS_WRITER_ERASE_BLOCK);
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase file on AppFS (%d)", res);
+            return res;
+        }
+        writer->erased += APPFS_WRITER_ERASE_BLOCK;
+    }
+
+    esp_err_t res = appfsWrite(writer->handle, writer->written, (uint8_t*) data, length);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write to file on AppFS (%d)", res);
+        return res;
+    }
+    writer->written += length;
+    return ESP_OK;
+}
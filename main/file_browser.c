@@ -14,6 +14,7 @@
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
 #include "fpga_download.h"
+#include "fpga_loader.h"
 #include "fpga_util.h"
 #include "hardware.h"
 #include "ice40.h"
@@ -132,6 +133,7 @@ static bool is_bitstream(FILE* fd) {
     uint8_t file_contents[sizeof(expected_value)];
     fread(file_contents, sizeof(expected_value), 1, fd);
     fseek(fd, 0, SEEK_SET);
+    if (memcmp(FPGA_LOADER_Z_MAGIC, file_contents, 4) == 0) return true;  // Compressed bitstream
     return (memcmp(expected_value, file_contents, sizeof(expected_value)) == 0);
 }
 
@@ -185,20 +187,20 @@ static void file_browser_open_file(xQueueHandle button_queue, const char* filena
         pax_draw_text(pax_buffer, 0xFF000000, font, 18, 0, 0, "FPGA bitstream\n\nPress A to run\nPress B to go back");
         display_flush();
         if (wait_for_button()) {
-            size_t   bitstream_length = get_file_size(fd);
-            uint8_t* bitstream        = load_file_to_ram(fd);
-            ICE40*   ice40            = get_ice40();
-            ILI9341* ili9341          = get_ili9341();
+            ICE40*   ice40   = get_ice40();
+            ILI9341* ili9341 = get_ili9341();
             ili9341_deinit(ili9341);
             ili9341_select(ili9341, false);
             vTaskDelay(200 / portTICK_PERIOD_MS);
             ili9341_select(ili9341, true);
-            esp_err_t res = ice40_load_bitstream(ice40, bitstream, bitstream_length);
-            free(bitstream);
+            esp_err_t res = fpga_loader_load_file(ice40, fd);
             fclose(fd);
             if (res == ESP_OK) {
                 fpga_irq_setup(ice40);
+                fpga_req_setup();
+                fpga_btn_reset();
                 fpga_host(button_queue, ice40, false, path);
+                fpga_req_cleanup();
                 fpga_irq_cleanup(ice40);
                 ice40_disable(ice40);
                 ili9341_init(ili9341);
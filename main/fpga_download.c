@@ -11,6 +11,7 @@
 
 #include "driver/uart.h"
 #include "esp32/rom/crc.h"
+#include "fpga_loader.h"
 #include "fpga_util.h"
 #include "graphics_wrapper.h"
 #include "hardware.h"
@@ -19,9 +20,14 @@
 #include "pax_gfx.h"
 #include "system_wrapper.h"
 
+// The bitstream payload is streamed straight into the FPGA, so the receive
+// buffer has to absorb what arrives during the ~200 ms display handover
+// that happens between its header and the start of configuration.
+#define FPGA_UART_RX_BUFFER_SIZE (32 * 1024)
+
 static void fpga_install_uart() {
     fflush(stdout);
-    ESP_ERROR_CHECK(uart_driver_install(0, 2048, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(0, FPGA_UART_RX_BUFFER_SIZE, 0, 0, NULL, 0));
     uart_config_t uart_config = {
         .baud_rate  = 921600,
         .data_bits  = UART_DATA_8_BITS,
@@ -82,7 +88,56 @@ static bool fpga_uart_sync(void) {
     return false;
 }
 
-static bool fpga_uart_load(uint8_t* buffer, uint32_t length) { return fpga_read_stdin(buffer, length, 1000); }
+#define FPGA_UART_CHUNK_SIZE 1024
+
+// Reads in chunks, updating the CRC as data comes in
+static bool fpga_uart_load(uint8_t* buffer, uint32_t length, uint32_t* crc) {
+    while (length) {
+        uint32_t chunk = (length < FPGA_UART_CHUNK_SIZE) ? length : FPGA_UART_CHUNK_SIZE;
+        if (!fpga_read_stdin(buffer, chunk, 1000)) return false;
+        *crc = crc32_le(*crc, buffer, chunk);
+        buffer += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+typedef struct {
+    uint32_t remaining;
+    uint32_t crc;
+    uint32_t expected_crc;
+    bool     timeout;
+} fpga_uart_stream_t;
+
+// Bitstream source for the loader, the payload goes to the FPGA as it arrives
+static int fpga_uart_read_bitstream(void* ctx, uint8_t* buffer, size_t length) {
+    fpga_uart_stream_t* stream = (fpga_uart_stream_t*) ctx;
+
+    if (stream->remaining == 0) return (stream->crc == stream->expected_crc) ? 0 : -1;
+
+    if (length > stream->remaining) length = stream->remaining;
+    int read = uart_read_bytes(0, buffer, length, 1000 / portTICK_PERIOD_MS);
+    if (read <= 0) {
+        stream->timeout = true;
+        return -1;
+    }
+
+    stream->crc = crc32_le(stream->crc, buffer, read);
+    stream->remaining -= read;
+    return read;
+}
+
+// Receives what the loader didn't ask for, it can be done before the payload is (a compressed stream ends before the padding after it), and
+// checks the CRC of the whole payload
+static esp_err_t fpga_uart_finish_bitstream(fpga_uart_stream_t* stream) {
+    uint8_t buffer[256];
+
+    while (stream->remaining) {
+        if (fpga_uart_read_bitstream(stream, buffer, sizeof(buffer)) < 0) return ESP_ERR_TIMEOUT;
+    }
+
+    return (stream->crc == stream->expected_crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
 
 static void fpga_uart_mess(const char* fmt, ...) {
     char    message[64];
@@ -94,10 +149,30 @@ static void fpga_uart_mess(const char* fmt, ...) {
     l = vsnprintf(message, sizeof(message), fmt, va);
     va_end(va);
 
+    // vsnprintf returns the untruncated length
+    if (l < 0) return;
+    if (l >= (int) sizeof(message)) l = sizeof(message) - 1;
+
     // Send message
     uart_write_bytes(0, message, l);
 }
 
+// Report what the previous bitstream did over SPI
+static void fpga_uart_stats(void) {
+    struct fpga_stats st;
+
+    fpga_stats_get(&st);
+
+    if (st.wb_exec) {
+        fpga_uart_mess("stats: wb %u cmdbufs, %u reads\n", st.wb_exec, st.wb_reads);
+        fpga_uart_mess("stats: wb %llu bytes in %llu us\n", st.wb_bytes, st.wb_us);
+    }
+    if (st.btn_events) fpga_uart_mess("stats: btn %u events in %u messages\n", st.btn_events, st.btn_msgs);
+    if (st.fread) fpga_uart_mess("stats: fread %u (%u read-ahead), %llu bytes\n", st.fread, st.fread_prefetched, st.fread_bytes);
+    if (st.fwrite) fpga_uart_mess("stats: fwrite %u, %llu bytes\n", st.fwrite, st.fwrite_bytes);
+    if (st.fread || st.fwrite) fpga_uart_mess("stats: requests served in %llu us\n", st.req_us);
+}
+
 static void fpga_display_message(uint32_t bg, uint32_t fg, const char* fmt, ...) {
     pax_buf_t* pax_buffer = get_pax_buffer();
     char       message[256];
@@ -144,7 +219,6 @@ static void fpga_display_message(uint32_t bg, uint32_t fg, const char* fmt, ...)
 static bool fpga_uart_download(ICE40* ice40) {
     TickType_t timeout = 1000 / portTICK_PERIOD_MS;
     uint8_t*   buffer  = NULL;
-    bool       done    = false;
     struct {
         uint8_t  type;
         uint32_t fid;
@@ -152,7 +226,7 @@ static bool fpga_uart_download(ICE40* ice40) {
         uint32_t crc;
     } __attribute__((packed)) header;
 
-    while (!done) {
+    while (true) {
         // Header
         uart_read_bytes(0, &header, sizeof(header), timeout);
 
@@ -160,6 +234,13 @@ static bool fpga_uart_download(ICE40* ice40) {
         fpga_uart_mess("hdr: type=%d, fid=%08x, len=%08x, crc=%08x\n", header.type, header.fid, header.len, header.crc);
 #endif
 
+        // Bitstream payload is streamed into the FPGA below, what the
+        // previous one looked up on storage is stale by then
+        if (header.type == 'B') {
+            fpga_req_new_bitstream();
+            break;
+        }
+
         // Payload
         if (header.len) {
             // Alloc zone to store content
@@ -170,14 +251,16 @@ static bool fpga_uart_download(ICE40* ice40) {
             }
 
             // Read data in
-            if (!fpga_uart_load(buffer, header.len)) {
+            uint32_t checkCrc = 0;
+            if (!fpga_uart_load(buffer, header.len, &checkCrc)) {
+                free(buffer);
                 fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nTimeout while loading");
                 return false;
             }
 
             // Validate CRC
-            uint32_t checkCrc = crc32_le(0, buffer, header.len);
             if (checkCrc != header.crc) {
+                free(buffer);
                 fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nCRC incorrect\nProvided CRC:   %08X\nCalculated CRC: %08X", header.crc,
                                      checkCrc);
                 return false;
@@ -209,18 +292,13 @@ static bool fpga_uart_download(ICE40* ice40) {
                     break;
                 }
 
-            case 'B':
-                {  // Bitstream
-                    done = true;
-                    break;
-                }
-
             default:
+                free(buffer);
                 fpga_display_message(0xa85a32, 0xFFFFFFFF, "Invalid packet type");
                 return false;
         }
 
-        if (!done) free(buffer);
+        free(buffer);
     }
 
     // Bitstream ready, load it
@@ -230,12 +308,26 @@ static bool fpga_uart_download(ICE40* ice40) {
     vTaskDelay(200 / portTICK_PERIOD_MS);
     ili9341_select(ili9341, true);
 
-    esp_err_t res = ice40_load_bitstream(ice40, buffer, header.len);
-    free(buffer);
+    fpga_uart_stream_t stream = {
+        .remaining    = header.len,
+        .crc          = 0,
+        .expected_crc = header.crc,
+        .timeout      = false,
+    };
+
+    esp_err_t res = fpga_loader_load(ice40, fpga_uart_read_bitstream, &stream);
+    if (res == ESP_OK) res = fpga_uart_finish_bitstream(&stream);
     if (res != ESP_OK) {
         ice40_disable(ice40);
         ili9341_init(ili9341);
-        fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nUpload failed: %d", res);
+        if (stream.timeout) {
+            fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nTimeout while loading");
+        } else if (stream.remaining == 0 && stream.crc != stream.expected_crc) {
+            fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nCRC incorrect\nProvided CRC:   %08X\nCalculated CRC: %08X", stream.expected_crc,
+                                 stream.crc);
+        } else {
+            fpga_display_message(0xa85a32, 0xFFFFFFFF, "FPGA download mode\nUpload failed: %d", res);
+        }
         fpga_uart_mess("uploading bitstream failed with %d\n", res);
         return false;
     }
@@ -309,8 +401,10 @@ void fpga_download(xQueueHandle buttonQueue, ICE40* ice40) {
         if (!fpga_uart_download(ice40)) goto error;
 
         // Waiting for next download and sending key strokes to FPGA
+        fpga_stats_reset();
         bool uart_triggered = fpga_host(buttonQueue, ice40, true, "/sd");
         if (!uart_triggered) goto error;
+        fpga_uart_stats();
         ice40_disable(ice40);
         ili9341_init(ili9341);
     }
@@ -0,0 +1,373 @@
+/*
+ * fpga_loader.c
+ *
+ * Loads bitstreams into the iCE40 without ever holding the whole
+ * bitstream in RAM. A reader task fills one of two DMA capable chunk
+ * buffers from the source while the other one is being clocked out over
+ * the configuration SPI.
+ *
+ * Bitstreams wrapped in the compressed container (see fpga_loader.h) are
+ * detected and inflated on the fly using the miniz inflater in ROM.
+ */
+
+#include "fpga_loader.h"
+
+#include <driver/gpio.h>
+#include <esp32/rom/miniz.h>
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ice40.h"
+
+#define LOADER_CHUNK_SIZE 4096
+#define LOADER_CHUNK_NUM  2
+#define LOADER_Z_IN_SIZE  1024
+
+struct loader_chunk {
+    uint8_t *buf;
+    int      len;
+};
+
+struct loader_src {
+    fpga_loader_read_t read;
+    void              *ctx;
+
+    // Container header, replayed as data if it isn't one
+    uint8_t hdr[FPGA_LOADER_Z_HDR_LEN];
+    size_t  hdr_len;
+    size_t  hdr_pos;
+
+    // Inflate state (compressed bitstreams only)
+    tinfl_decompressor *z;
+    tinfl_status        z_status;
+    size_t              z_total;
+    size_t              z_expected;
+    uint8_t            *z_in;
+    size_t              z_in_pos;
+    size_t              z_in_len;
+    bool                z_in_eof;
+    uint8_t            *z_dict;
+    size_t              z_dict_size;
+    size_t              z_dict_pos;
+    size_t              z_out_pos;
+    size_t              z_out_len;
+};
+
+struct loader_ctx {
+    struct loader_src src;
+    QueueHandle_t     q_free;
+    QueueHandle_t     q_full;
+    volatile bool     abort;
+};
+
+/* ---------------------------------------------------------------------------
+ * Configuration sequence
+ * ------------------------------------------------------------------------ */
+
+static esp_err_t _fpga_loader_begin(ICE40 *ice40) {
+    esp_err_t res;
+
+    // Hold the FPGA in reset
+    res = ice40_disable(ice40);
+    if (res != ESP_OK) return res;
+
+    // Chip select low while coming out of reset selects SPI slave configuration
+    gpio_set_level(ice40->pin_cs, 0);
+
+    res = ice40_enable(ice40);
+    if (res != ESP_OK) return res;
+
+    // Let the FPGA clear its configuration memory
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+
+    return ESP_OK;
+}
+
+static esp_err_t _fpga_loader_end(ICE40 *ice40) {
+    uint8_t   dummy[16] __attribute__((aligned(4)));
+    bool      done = false;
+    esp_err_t res;
+
+    // The FPGA needs at least 49 more clocks to wake up
+    memset(dummy, 0x00, sizeof(dummy));
+    res = ice40_send_turbo(ice40, dummy, sizeof(dummy));
+    gpio_set_level(ice40->pin_cs, 1);
+    if (res != ESP_OK) return res;
+
+    res = ice40_get_done(ice40, &done);
+    if (res != ESP_OK) return res;
+
+    return done ? ESP_OK : ESP_FAIL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Source handling & decompression
+ * ------------------------------------------------------------------------ */
+
+static int _fpga_loader_src_fill(struct loader_src *src, uint8_t *buf, size_t len) {
+    size_t l = 0;
+
+    // Read until we have it all or the source ran dry
+    while (l < len) {
+        int r = src->read(src->ctx, buf + l, len - l);
+        if (r < 0) return r;
+        if (r == 0) break;
+        l += r;
+    }
+
+    return l;
+}
+
+static int _fpga_loader_src_open(struct loader_src *src) {
+    int r;
+
+    // Probe for the container header
+    r = _fpga_loader_src_fill(src, src->hdr, FPGA_LOADER_Z_HDR_LEN);
+    if (r < 0) return r;
+
+    src->hdr_len = r;
+    src->hdr_pos = 0;
+
+    if ((r < FPGA_LOADER_Z_HDR_LEN) || memcmp(src->hdr, FPGA_LOADER_Z_MAGIC, 4)) return 0;
+
+    // Compressed: header is consumed, grab the first input block to size the dictionary
+    src->hdr_pos    = src->hdr_len;
+    src->z_expected = src->hdr[4] | (src->hdr[5] << 8) | (src->hdr[6] << 16) | (src->hdr[7] << 24);
+
+    src->z_in = malloc(LOADER_Z_IN_SIZE);
+    src->z    = malloc(sizeof(tinfl_decompressor));
+    if (!src->z_in || !src->z) return -1;
+
+    r = _fpga_loader_src_fill(src, src->z_in, LOADER_Z_IN_SIZE);
+    if (r < 2) return -1;
+
+    src->z_in_len = r;
+    src->z_in_eof = (r < LOADER_Z_IN_SIZE);
+
+    // zlib header: deflate, window size in the upper nibble of CMF
+    if ((src->z_in[0] & 0x0f) != 8) return -1;
+    src->z_dict_size = 1 << ((src->z_in[0] >> 4) + 8);
+    if (src->z_dict_size > 32768) return -1;
+
+    src->z_dict = malloc(src->z_dict_size);
+    if (!src->z_dict) return -1;
+
+    tinfl_init(src->z);
+    src->z_status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+    return 0;
+}
+
+static void _fpga_loader_src_close(struct loader_src *src) {
+    free(src->z);
+    free(src->z_in);
+    free(src->z_dict);
+}
+
+static int _fpga_loader_src_inflate(struct loader_src *src, uint8_t *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        // Hand out what's pending in the dictionary first
+        if (src->z_out_len) {
+            size_t l = (src->z_out_len < (len - done)) ? src->z_out_len : (len - done);
+            memcpy(buf + done, src->z_dict + src->z_out_pos, l);
+            src->z_out_pos += l;
+            src->z_out_len -= l;
+            done += l;
+            continue;
+        }
+
+        if (src->z_status == TINFL_STATUS_DONE) {
+            if (src->z_total != src->z_expected) return -1;
+            break;
+        }
+
+        // Refill input
+        if ((src->z_in_pos == src->z_in_len) && !src->z_in_eof) {
+            int r = src->read(src->ctx, src->z_in, LOADER_Z_IN_SIZE);
+            if (r < 0) return r;
+            src->z_in_pos = 0;
+            src->z_in_len = r;
+            src->z_in_eof = (r == 0);
+        }
+
+        // Inflate into the (wrapping) dictionary
+        size_t in_len  = src->z_in_len - src->z_in_pos;
+        size_t out_len = src->z_dict_size - src->z_dict_pos;
+
+        src->z_status = tinfl_decompress(src->z, src->z_in + src->z_in_pos, &in_len, src->z_dict, src->z_dict + src->z_dict_pos, &out_len,
+                                         TINFL_FLAG_PARSE_ZLIB_HEADER | (src->z_in_eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+
+        src->z_in_pos += in_len;
+        src->z_out_pos  = src->z_dict_pos;
+        src->z_out_len  = out_len;
+        src->z_dict_pos = (src->z_dict_pos + out_len) & (src->z_dict_size - 1);
+        src->z_total += out_len;
+
+        if (src->z_status < 0) return -1;
+        if ((src->z_status == TINFL_STATUS_NEEDS_MORE_INPUT) && src->z_in_eof) return -1;
+    }
+
+    return done;
+}
+
+static int _fpga_loader_src_read(struct loader_src *src, uint8_t *buf, size_t len) {
+    // Compressed ?
+    if (src->z) return _fpga_loader_src_inflate(src, buf, len);
+
+    // Replay the probed header
+    if (src->hdr_pos < src->hdr_len) {
+        size_t l = src->hdr_len - src->hdr_pos;
+        if (l > len) l = len;
+        memcpy(buf, src->hdr + src->hdr_pos, l);
+        src->hdr_pos += l;
+        return l;
+    }
+
+    return src->read(src->ctx, buf, len);
+}
+
+/* ---------------------------------------------------------------------------
+ * Streaming
+ * ------------------------------------------------------------------------ */
+
+static void _fpga_loader_reader_task(void *arg) {
+    struct loader_ctx  *lc = arg;
+    struct loader_chunk chunk;
+    bool                ok;
+
+    ok = _fpga_loader_src_open(&lc->src) == 0;
+
+    while (true) {
+        // Wait for an empty buffer
+        xQueueReceive(lc->q_free, &chunk.buf, portMAX_DELAY);
+
+        // Fill it
+        chunk.len = (!ok || lc->abort) ? -1 : _fpga_loader_src_read(&lc->src, chunk.buf, LOADER_CHUNK_SIZE);
+
+        // End of stream or error, wrap up before handing over the last
+        // chunk: the context is gone once the loader gets it
+        if (chunk.len <= 0) {
+            _fpga_loader_src_close(&lc->src);
+            xQueueSend(lc->q_full, &chunk, portMAX_DELAY);
+            break;
+        }
+
+        // Hand it over
+        xQueueSend(lc->q_full, &chunk, portMAX_DELAY);
+    }
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t fpga_loader_load(ICE40 *ice40, fpga_loader_read_t read, void *ctx) {
+    struct loader_ctx   lc                     = {.src = {.read = read, .ctx = ctx}, .abort = false};
+    struct loader_chunk chunk                  = {0};
+    uint8_t            *bufs[LOADER_CHUNK_NUM] = {NULL};
+    size_t              total                  = 0;
+    esp_err_t           res;
+
+    // Alloc queues and chunk buffers
+    lc.q_free = xQueueCreate(LOADER_CHUNK_NUM, sizeof(uint8_t *));
+    lc.q_full = xQueueCreate(LOADER_CHUNK_NUM, sizeof(struct loader_chunk));
+    if (!lc.q_free || !lc.q_full) {
+        res = ESP_ERR_NO_MEM;
+        goto done;
+    }
+
+    for (int i = 0; i < LOADER_CHUNK_NUM; i++) {
+        bufs[i] = heap_caps_malloc(LOADER_CHUNK_SIZE, MALLOC_CAP_DMA);
+        if (!bufs[i]) {
+            res = ESP_ERR_NO_MEM;
+            goto done;
+        }
+        xQueueSend(lc.q_free, &bufs[i], 0);
+    }
+
+    // Put the FPGA in configuration mode
+    res = _fpga_loader_begin(ice40);
+    if (res != ESP_OK) goto done;
+
+    // Start reading
+    if (xTaskCreate(_fpga_loader_reader_task, "fpga_loader", 4096, &lc, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        res = ESP_ERR_NO_MEM;
+        goto done;
+    }
+
+    // Send chunks as they come in. Even on error, keep going until the
+    // reader signals the end so it's done with our buffers.
+    while (true) {
+        xQueueReceive(lc.q_full, &chunk, portMAX_DELAY);
+
+        if ((chunk.len < 0) && (res == ESP_OK)) res = ESP_FAIL;
+        if (chunk.len <= 0) break;
+
+        if (res == ESP_OK) {
+            res = ice40_send_turbo(ice40, chunk.buf, chunk.len);
+            total += chunk.len;
+            if (res != ESP_OK) lc.abort = true;
+        }
+
+        xQueueSend(lc.q_free, &chunk.buf, portMAX_DELAY);
+    }
+
+    // Finish up
+    if (res == ESP_OK) {
+        res = total ? _fpga_loader_end(ice40) : ESP_ERR_INVALID_SIZE;
+    }
+
+done:
+    if (res != ESP_OK) gpio_set_level(ice40->pin_cs, 1);
+
+    for (int i = 0; i < LOADER_CHUNK_NUM; i++) heap_caps_free(bufs[i]);
+    if (lc.q_free) vQueueDelete(lc.q_free);
+    if (lc.q_full) vQueueDelete(lc.q_full);
+
+    return res;
+}
+
+/* ---------------------------------------------------------------------------
+ * Sources
+ * ------------------------------------------------------------------------ */
+
+static int _fpga_loader_read_file(void *ctx, uint8_t *buf, size_t len) {
+    FILE  *fd = ctx;
+    size_t l  = fread(buf, 1, len, fd);
+
+    if (!l && ferror(fd)) return -1;
+    return l;
+}
+
+esp_err_t fpga_loader_load_file(ICE40 *ice40, FILE *fd) {
+    fseek(fd, 0, SEEK_SET);
+    return fpga_loader_load(ice40, _fpga_loader_read_file, fd);
+}
+
+struct loader_mem {
+    const uint8_t *data;
+    size_t         len;
+};
+
+static int _fpga_loader_read_mem(void *ctx, uint8_t *buf, size_t len) {
+    struct loader_mem *mem = ctx;
+
+    if (len > mem->len) len = mem->len;
+    memcpy(buf, mem->data, len);
+    mem->data += len;
+    mem->len -= len;
+
+    return len;
+}
+
+esp_err_t fpga_loader_load_memory(ICE40 *ice40, const uint8_t *data, size_t len) {
+    struct loader_mem mem = {.data = data, .len = len};
+    return fpga_loader_load(ice40, _fpga_loader_read_mem, &mem);
+}
@@ -13,15 +13,23 @@
 
 #include <driver/gpio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "appfs.h"
 #include "ice40.h"
 #include "rp2040.h"
 
@@ -75,16 +83,34 @@ void fpga_irq_cleanup(ICE40 *ice40) {
     // Remove handler
     gpio_isr_handler_remove(ice40->pin_int);
 
+    // The bitstream is going away, so is anything executing on it
+    fpga_wb_async_stop();
+
     // Release semaphore
     vSemaphoreDelete(g_irq_trig);
 }
 
 bool fpga_irq_wait(TickType_t wait) { return xSemaphoreTake(g_irq_trig, wait) == pdTRUE; }
 
+/* ---------------------------------------------------------------------------
+ * Statistics
+ * ------------------------------------------------------------------------ */
+
+static struct fpga_stats g_stats;
+
+void fpga_stats_get(struct fpga_stats *stats) { *stats = g_stats; }
+
+void fpga_stats_reset(void) { memset(&g_stats, 0x00, sizeof(g_stats)); }
+
 /* ---------------------------------------------------------------------------
  * Wishbone bridge
  * ------------------------------------------------------------------------ */
 
+#define WB_STATE_IDLE   0
+#define WB_STATE_QUEUED 1
+#define WB_STATE_OK     2
+#define WB_STATE_FAILED 3
+
 struct fpga_wb_cmdbuf {
     bool       done;
     uint8_t   *buf;
@@ -92,6 +118,12 @@ struct fpga_wb_cmdbuf {
     int        used;
     int        rd_cnt;
     uint32_t **rd_ptr;
+
+    // Asynchronous execution
+    volatile int      state;
+    fpga_wb_done_cb_t done_cb;
+    void             *done_arg;
+    TaskHandle_t      waiter;
 };
 
 struct fpga_wb_cmdbuf *fpga_wb_alloc(int n) {
@@ -100,12 +132,18 @@ struct fpga_wb_cmdbuf *fpga_wb_alloc(int n) {
     if (n > 511) return NULL;
 
     cb = calloc(1, sizeof(struct fpga_wb_cmdbuf));
+    if (!cb) return NULL;
 
     cb->len = 1 + (n * 8 * sizeof(uint32_t));
 
-    cb->buf    = malloc(cb->len);
+    cb->buf    = heap_caps_malloc(cb->len, MALLOC_CAP_DMA);
     cb->rd_ptr = malloc(64 * sizeof(uint32_t *));
 
+    if (!cb->buf || !cb->rd_ptr) {
+        fpga_wb_free(cb);
+        return NULL;
+    }
+
     cb->buf[0] = SPI_CMD_WISHBONE;
     cb->used   = 1;
 
@@ -120,6 +158,13 @@ void fpga_wb_free(struct fpga_wb_cmdbuf *cb) {
     free(cb);
 }
 
+void fpga_wb_reset(struct fpga_wb_cmdbuf *cb) {
+    cb->buf[0] = SPI_CMD_WISHBONE;
+    cb->used   = 1;
+    cb->rd_cnt = 0;
+    cb->done   = false;
+}
+
 bool fpga_wb_queue_write(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr, uint32_t val) {
     // Limits
     if (cb->done) return false;
@@ -225,6 +270,7 @@ bool fpga_wb_queue_read_burst(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr,
 }
 
 bool fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40 *ice40) {
+    int64_t   t = esp_timer_get_time();
     esp_err_t res;
     int       l;
 
@@ -232,8 +278,11 @@ bool fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40 *ice40) {
     res = ice40_send(ice40, cb->buf, cb->used);
     if (res != ESP_OK) return false;
 
+    g_stats.wb_exec++;
+    g_stats.wb_bytes += cb->used;
+
     // If there was no read, nothing else to do
-    if (!cb->rd_cnt) return true;
+    if (!cb->rd_cnt) goto done;
 
     // Execute a half duplex transaction to get the read data back
     l          = 2 + (cb->rd_cnt * 4);
@@ -242,14 +291,224 @@ bool fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40 *ice40) {
     res = ice40_transaction(ice40, cb->buf, l, cb->buf, l);
     if (res != ESP_OK) return false;
 
+    g_stats.wb_reads += cb->rd_cnt;
+    g_stats.wb_bytes += l;
+
     // Fill data to requester
     for (int i = 0; i < cb->rd_cnt; i++) {
         *(cb->rd_ptr[i]) = ((cb->buf[4 * i + 2] << 24) | (cb->buf[4 * i + 3] << 16) | (cb->buf[4 * i + 4] << 8) | (cb->buf[4 * i + 5]));
     }
 
+done:
+    g_stats.wb_us += esp_timer_get_time() - t;
     return true;
 }
 
+/* ---------------------------------------------------------------------------
+ * Wishbone asynchronous execution
+ * ------------------------------------------------------------------------ */
+
+#define WB_ASYNC_QUEUE_LEN 16
+
+static struct {
+    ICE40            *ice40;
+    QueueHandle_t     queue;
+    TaskHandle_t      task;
+    SemaphoreHandle_t stopped;
+} g_wb_async;
+
+static void _fpga_wb_async_task(void *arg) {
+    struct fpga_wb_cmdbuf *cb;
+
+    while (true) {
+        xQueueReceive(g_wb_async.queue, &cb, portMAX_DELAY);
+
+        // NULL means stop
+        if (!cb) break;
+
+        bool ok = fpga_wb_exec(cb, g_wb_async.ice40);
+
+        if (cb->done_cb) {
+            // The callback owns the buffer from here on, don't touch it after
+            cb->state = ok ? WB_STATE_OK : WB_STATE_FAILED;
+            cb->done_cb(cb, ok, cb->done_arg);
+        } else {
+            TaskHandle_t waiter = cb->waiter;
+            cb->state           = ok ? WB_STATE_OK : WB_STATE_FAILED;
+            if (waiter) xTaskNotifyGive(waiter);
+        }
+    }
+
+    xSemaphoreGive(g_wb_async.stopped);
+    vTaskDelete(NULL);
+}
+
+esp_err_t fpga_wb_async_start(ICE40 *ice40) {
+    // Already running ?
+    if (g_wb_async.task) return (g_wb_async.ice40 == ice40) ? ESP_OK : ESP_ERR_INVALID_STATE;
+
+    g_wb_async.ice40   = ice40;
+    g_wb_async.queue   = xQueueCreate(WB_ASYNC_QUEUE_LEN, sizeof(struct fpga_wb_cmdbuf *));
+    g_wb_async.stopped = xSemaphoreCreateBinary();
+    if (!g_wb_async.queue || !g_wb_async.stopped) goto error;
+
+    if (xTaskCreate(_fpga_wb_async_task, "fpga_wb", 2048, NULL, uxTaskPriorityGet(NULL), &g_wb_async.task) != pdPASS) goto error;
+
+    return ESP_OK;
+
+error:
+    if (g_wb_async.queue) vQueueDelete(g_wb_async.queue);
+    if (g_wb_async.stopped) vSemaphoreDelete(g_wb_async.stopped);
+    memset(&g_wb_async, 0x00, sizeof(g_wb_async));
+    return ESP_ERR_NO_MEM;
+}
+
+void fpga_wb_async_stop(void) {
+    struct fpga_wb_cmdbuf *cb = NULL;
+
+    if (!g_wb_async.task) return;
+
+    // Everything already queued is executed first
+    xQueueSend(g_wb_async.queue, &cb, portMAX_DELAY);
+    xSemaphoreTake(g_wb_async.stopped, portMAX_DELAY);
+
+    vQueueDelete(g_wb_async.queue);
+    vSemaphoreDelete(g_wb_async.stopped);
+    memset(&g_wb_async, 0x00, sizeof(g_wb_async));
+}
+
+bool fpga_wb_submit(struct fpga_wb_cmdbuf *cb, fpga_wb_done_cb_t done_cb, void *arg) {
+    if (!g_wb_async.task) return false;
+    if (cb->state == WB_STATE_QUEUED) return false;
+
+    cb->done_cb  = done_cb;
+    cb->done_arg = arg;
+    cb->waiter   = done_cb ? NULL : xTaskGetCurrentTaskHandle();
+    cb->state    = WB_STATE_QUEUED;
+
+    if (xQueueSend(g_wb_async.queue, &cb, portMAX_DELAY) != pdTRUE) {
+        cb->state = WB_STATE_IDLE;
+        return false;
+    }
+
+    return true;
+}
+
+bool fpga_wb_wait(struct fpga_wb_cmdbuf *cb, TickType_t wait) {
+    TickType_t start = xTaskGetTickCount();
+
+    while (cb->state == WB_STATE_QUEUED) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+
+        if (wait != portMAX_DELAY) {
+            if (elapsed >= wait) return false;
+            ulTaskNotifyTake(pdTRUE, wait - elapsed);
+        } else {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+
+    return cb->state == WB_STATE_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * Wishbone bulk transfers
+ * ------------------------------------------------------------------------ */
+
+// Words per command buffer. Reads are limited by the read slots.
+#define WB_BULK_WR_WORDS 256
+#define WB_BULK_RD_WORDS 64
+
+struct wb_bulk {
+    QueueHandle_t q_free;
+    volatile bool ok;
+};
+
+static void _fpga_wb_bulk_done(struct fpga_wb_cmdbuf *cb, bool ok, void *arg) {
+    struct wb_bulk *wb = arg;
+
+    if (!ok) wb->ok = false;
+    xQueueSend(wb->q_free, &cb, portMAX_DELAY);
+}
+
+static bool _fpga_wb_bulk_queue(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr, uint32_t *val, int n, bool inc, bool write) {
+    fpga_wb_reset(cb);
+
+    if (write) return fpga_wb_queue_write_burst(cb, dev, addr, val, n, inc);
+
+    return fpga_wb_queue_read_burst(cb, dev, addr, val, n, inc);
+}
+
+static bool _fpga_wb_bulk(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, size_t n, bool inc, bool write) {
+    struct wb_bulk         wb        = {.q_free = NULL, .ok = true};
+    struct fpga_wb_cmdbuf *cbs[2]    = {NULL, NULL};
+    struct fpga_wb_cmdbuf *cb;
+    size_t                 chunk     = write ? WB_BULK_WR_WORDS : WB_BULK_RD_WORDS;
+    int                    idle      = 0;
+    int                    in_flight = 0;
+    size_t                 ofs;
+
+    // Even a single chunk goes through the execution task, so it stays in
+    // order with any buffer submitted before
+    if (fpga_wb_async_start(ice40) != ESP_OK) return false;
+
+    // Executed buffers come back through this queue
+    wb.q_free = xQueueCreate(2, sizeof(struct fpga_wb_cmdbuf *));
+    if (!wb.q_free) return false;
+
+    // Size command buffers for a full chunk (alloc unit is 32 bytes). Two
+    // of them if there is more than one chunk: one is built while the
+    // other one is executed.
+    for (int i = 0; i < ((n > chunk) ? 2 : 1); i++) {
+        cbs[i] = fpga_wb_alloc((4 * (chunk + 1) + 31) / 32);
+        if (!cbs[i]) {
+            wb.ok = false;
+            goto done;
+        }
+        idle++;
+    }
+
+    for (ofs = 0; ofs < n; ofs += chunk) {
+        size_t l = ((n - ofs) < chunk) ? (n - ofs) : chunk;
+
+        // Get a free buffer, waiting for one to be executed if needed
+        if (idle) {
+            cb = cbs[--idle];
+        } else {
+            xQueueReceive(wb.q_free, &cb, portMAX_DELAY);
+            in_flight--;
+        }
+
+        // Stop at the first failure
+        if (!wb.ok) break;
+
+        // Fill and submit it
+        if (!_fpga_wb_bulk_queue(cb, dev, addr + (inc ? (4 * ofs) : 0), val + ofs, l, inc, write) || !fpga_wb_submit(cb, _fpga_wb_bulk_done, &wb)) {
+            wb.ok = false;
+            break;
+        }
+        in_flight++;
+    }
+
+    // Wait for what was submitted to come back
+    while (in_flight--) xQueueReceive(wb.q_free, &cb, portMAX_DELAY);
+
+done:
+    vQueueDelete(wb.q_free);
+    fpga_wb_free(cbs[0]);
+    fpga_wb_free(cbs[1]);
+
+    return wb.ok;
+}
+
+bool fpga_wb_bulk_write(ICE40 *ice40, int dev, uint32_t addr, const uint32_t *val, size_t n, bool inc) {
+    return _fpga_wb_bulk(ice40, dev, addr, (uint32_t *) val, n, inc, true);
+}
+
+bool fpga_wb_bulk_read(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, size_t n, bool inc) {
+    return _fpga_wb_bulk(ice40, dev, addr, val, n, inc, false);
+}
+
 /* ---------------------------------------------------------------------------
  * Button reports
  * ------------------------------------------------------------------------ */
@@ -258,74 +517,88 @@ static uint16_t g_btn_state = 0;
 
 void fpga_btn_reset(void) { g_btn_state = 0; }
 
+static int _fpga_btn_index(uint8_t pin) {
+    switch (pin) {
+        case RP2040_INPUT_JOYSTICK_DOWN:
+            return 0;
+        case RP2040_INPUT_JOYSTICK_UP:
+            return 1;
+        case RP2040_INPUT_JOYSTICK_LEFT:
+            return 2;
+        case RP2040_INPUT_JOYSTICK_RIGHT:
+            return 3;
+        case RP2040_INPUT_JOYSTICK_PRESS:
+            return 4;
+        case RP2040_INPUT_BUTTON_HOME:
+            return 5;
+        case RP2040_INPUT_BUTTON_MENU:
+            return 6;
+        case RP2040_INPUT_BUTTON_SELECT:
+            return 7;
+        case RP2040_INPUT_BUTTON_START:
+            return 8;
+        case RP2040_INPUT_BUTTON_ACCEPT:
+            return 9;
+        case RP2040_INPUT_BUTTON_BACK:
+            return 10;
+        default:
+            return -1;
+    }
+}
+
+static esp_err_t _fpga_btn_send_report(ICE40 *ice40, uint16_t state, uint16_t mask) {
+    uint8_t spi_message[5] = {
+        SPI_CMD_BUTTON_REPORT, state >> 8, state & 0xff, mask >> 8, mask & 0xff,
+    };
+
+    g_stats.btn_msgs++;
+
+    return ice40_send(ice40, spi_message, 5);
+}
+
 bool fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err) {
     rp2040_input_message_t buttonMessage;
-    bool                   work_done = false;
+    uint16_t               report_state = g_btn_state;
+    uint16_t               report_mask  = 0;
+    bool                   work_done    = false;
+    esp_err_t              res          = ESP_OK;
 
     if (err) *err = ESP_OK;
 
+    // Drain the queue, sending as few messages as possible
     while (xQueueReceive(buttonQueue, &buttonMessage, 0) == pdTRUE) {
-        uint8_t  pin      = buttonMessage.input;
-        bool     value    = buttonMessage.state;
-        uint16_t btn_mask = 0;
-
-        switch (pin) {
-            case RP2040_INPUT_JOYSTICK_DOWN:
-                btn_mask = 1 << 0;
-                break;
-            case RP2040_INPUT_JOYSTICK_UP:
-                btn_mask = 1 << 1;
-                break;
-            case RP2040_INPUT_JOYSTICK_LEFT:
-                btn_mask = 1 << 2;
-                break;
-            case RP2040_INPUT_JOYSTICK_RIGHT:
-                btn_mask = 1 << 3;
-                break;
-            case RP2040_INPUT_JOYSTICK_PRESS:
-                btn_mask = 1 << 4;
-                break;
-            case RP2040_INPUT_BUTTON_HOME:
-                btn_mask = 1 << 5;
-                break;
-            case RP2040_INPUT_BUTTON_MENU:
-                btn_mask = 1 << 6;
-                break;
-            case RP2040_INPUT_BUTTON_SELECT:
-                btn_mask = 1 << 7;
-                break;
-            case RP2040_INPUT_BUTTON_START:
-                btn_mask = 1 << 8;
-                break;
-            case RP2040_INPUT_BUTTON_ACCEPT:
-                btn_mask = 1 << 9;
-                break;
-            case RP2040_INPUT_BUTTON_BACK:
-                btn_mask = 1 << 10;
-            default:
-                break;
+        int btn = _fpga_btn_index(buttonMessage.input);
+        if (btn < 0) continue;
+
+        uint16_t btn_mask = 1 << btn;
+        work_done         = true;
+        g_stats.btn_events++;
+
+        if (report_mask & btn_mask) {
+            // Same button changed twice, report what we have so far so
+            // no transition gets lost
+            res = _fpga_btn_send_report(ice40, report_state, report_mask);
+            if (res != ESP_OK) goto error;
+            report_mask = 0;
         }
 
-        if (btn_mask != 0) {
-            work_done = true;
+        // Update state
+        if (buttonMessage.state)
+            g_btn_state |= btn_mask;
+        else
+            g_btn_state &= ~btn_mask;
 
-            if (value)
-                g_btn_state |= btn_mask;
-            else
-                g_btn_state &= ~btn_mask;
-
-            uint8_t spi_message[5] = {
-                SPI_CMD_BUTTON_REPORT, g_btn_state >> 8, g_btn_state & 0xff, btn_mask >> 8, btn_mask & 0xff,
-            };
+        report_state = g_btn_state;
+        report_mask |= btn_mask;
+    }
 
-            esp_err_t res = ice40_send(ice40, spi_message, 5);
-            if (res != ESP_OK) {
-                if (err) *err = res;
-                return work_done;
-            }
-        }
+    // Final report
+    if (report_mask) {
+        res = _fpga_btn_send_report(ice40, report_state, report_mask);
     }
 
+error:
+    if (err) *err = res;
     return work_done;
 }
 
@@ -333,6 +606,12 @@ bool fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *
  * Request processing
  * ------------------------------------------------------------------------ */
 
+#define REQ_HASH_BITS   5
+#define REQ_HASH_SIZE   (1 << REQ_HASH_BITS)
+#define REQ_CACHE_BLOCK 4096
+#define REQ_WBUF_SIZE   16384
+#define REQ_FLUSH_IDLE  (200 / portTICK_PERIOD_MS)
+
 struct req_entry {
     struct req_entry *next;
 
@@ -341,16 +620,116 @@ struct req_entry {
     void    *data;
     size_t   len;
     size_t   ofs;
+
+    // Registered by the host (fpga_req_add_file_*) rather than looked up
+    // on demand, kept when a new bitstream is loaded
+    bool alias;
+
+    // Read cache (files only)
+    uint8_t *cache;
+    size_t   cache_ofs;
+    size_t   cache_len;
+
+    // Write buffer (files only). Files are opened read-only until the
+    // FPGA first writes to them.
+    char    *path;
+    bool     writable;
+    bool     read_only;
+    bool     dirty;
+    uint8_t *wbuf;
+    size_t   wbuf_ofs;
+    size_t   wbuf_len;
+
+    // Flash mapping backing `data` (flash aliases only)
+    bool                    mapped;
+    spi_flash_mmap_handle_t mmap;
 };
 
-struct req_entry *g_req_entries;
+// Entries with neither fh nor data are negative entries: the fid was
+// looked up on storage and not found, don't retry on every request. They
+// only live as long as the bitstream that caused the lookup.
+static struct req_entry *g_req_table[REQ_HASH_SIZE];
+
+// Response buffers, kept around between requests and DMA capable so the
+// SPI driver doesn't have to bounce them. Two of them so the predicted
+// next block can be read while the current one is being sent.
+static uint8_t *g_req_buf[2];
+static size_t   g_req_buf_len[2];
+
+// Last request served, used to detect sequential streams
+static struct {
+    uint32_t fid;
+    size_t   ofs;
+    size_t   len;
+} g_req_last;
+
+// Pending writes
+static enum fpga_req_flush_policy g_req_flush_policy = FPGA_REQ_FLUSH_IDLE;
+static bool                       g_req_dirty;
+static TickType_t                 g_req_wlast;
+
+// Read-ahead worker
+static struct {
+    TaskHandle_t      task;
+    SemaphoreHandle_t done;
+    bool              pending;
+    const char       *prefix;
+    uint32_t          fid;
+    size_t            ofs;
+    size_t            len;
+    int               slot;
+} g_req_pf;
+
+static inline struct req_entry **_fpga_req_bucket(uint32_t fid) { return &g_req_table[(fid * 0x9e3779b1) >> (32 - REQ_HASH_BITS)]; }
+
+// Position after a write, a read has to seek first (stdio wants a
+// positioning call between the two)
+#define REQ_OFS_UNKNOWN SIZE_MAX
+
+static void _fpga_req_flush_entry(struct req_entry *re, bool sync) {
+    // Write out buffered data
+    if (re->wbuf_len) {
+        fseek(re->fh, re->wbuf_ofs, SEEK_SET);
+        fwrite(re->wbuf, 1, re->wbuf_len, re->fh);
+        re->ofs      = REQ_OFS_UNKNOWN;
+        re->wbuf_len = 0;
+        re->dirty    = true;
+    }
+
+    // Commit to storage, only for files that were actually written to
+    if (sync && re->dirty) {
+        fsync(fileno(re->fh));
+        re->dirty = false;
+    }
+}
+
+static void _fpga_req_flush_all(void) {
+    struct req_entry *re;
+
+    for (int i = 0; i < REQ_HASH_SIZE; i++)
+        for (re = g_req_table[i]; re; re = re->next)
+            if (re->fh) _fpga_req_flush_entry(re, true);
+
+    g_req_dirty = false;
+}
+
+static void _fpga_req_free_entry(struct req_entry *re) {
+    if (re->fh) {
+        _fpga_req_flush_entry(re, true);
+        fclose(re->fh);
+    }
+    if (re->mapped) spi_flash_munmap(re->mmap);
+    free(re->cache);
+    free(re->wbuf);
+    free(re);
+}
 
 static void _fpga_req_delete_entry(uint32_t fid) {
     struct req_entry **re_ptr;
     struct req_entry  *re;
 
     // Scan entries for a matching one
-    re_ptr = &g_req_entries;
+    re_ptr = _fpga_req_bucket(fid);
     re     = *re_ptr;
 
     while (re) {
@@ -360,8 +739,7 @@ static void _fpga_req_delete_entry(uint32_t fid) {
             *re_ptr = re->next;
 
             // Release
-            if (re->fh) fclose(re->fh);
-            free(re);
+            _fpga_req_free_entry(re);
 
             // Done
             return;
@@ -373,26 +751,69 @@ static void _fpga_req_delete_entry(uint32_t fid) {
     }
 }
 
-static struct req_entry *_fpga_req_open_file(uint32_t fid, const char *path) {
+static struct req_entry *_fpga_req_new_entry(uint32_t fid, size_t extra) {
+    struct req_entry **bucket = _fpga_req_bucket(fid);
+    struct req_entry  *re;
+
+    // Alloc new entry
+    re = calloc(1, sizeof(struct req_entry) + extra);
+    if (!re) return NULL;
+
+    // Add it to list
+    re->next = *bucket;
+    *bucket  = re;
+
+    re->fid = fid;
+
+    return re;
+}
+
+static FILE *_fpga_req_fopen(const char *path, bool write) {
+    FILE *fh;
+
+    if (write) {
+        // Created if needed but never truncated, it may have appeared
+        // since it was looked up
+        int fd = open(path, O_RDWR | O_CREAT, 0666);
+        if (fd < 0) return NULL;
+
+        fh = fdopen(fd, "r+b");
+        if (!fh) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        fh = fopen(path, "rb");
+        if (!fh) return NULL;
+    }
+
+    // We do our own block caching, stdio buffering would only add a copy
+    setvbuf(fh, NULL, _IONBF, 0);
+
+    return fh;
+}
+
+static struct req_entry *_fpga_req_open_file(uint32_t fid, const char *path, bool write) {
     struct req_entry *re;
     FILE             *fh;
 
     // Open file
-    fh = fopen(path, "rb");
+    fh = _fpga_req_fopen(path, write);
     if (!fh) return NULL;
 
-    // Alloc new entry
-    re = calloc(1, sizeof(struct req_entry));
-    if (!re) return NULL;
-
-    // Add it to list
-    re->next      = g_req_entries;
-    g_req_entries = re;
+    // Alloc new entry, with room for the path
+    re = _fpga_req_new_entry(fid, strlen(path) + 1);
+    if (!re) {
+        fclose(fh);
+        return NULL;
+    }
 
     // Init fields
-    re->fid = fid;
-    re->fh  = fh;
-    re->ofs = 0;
+    re->fh       = fh;
+    re->ofs      = 0;
+    re->path     = (char *) re + sizeof(struct req_entry);
+    re->writable = write;
+    strcpy(re->path, path);
 
     fseek(fh, 0, SEEK_END);
     re->len = ftell(fh);
@@ -402,18 +823,133 @@ static struct req_entry *_fpga_req_open_file(uint32_t fid, const char *path) {
     return re;
 }
 
+static bool _fpga_req_make_writable(struct req_entry *re) {
+    FILE *fh;
+
+    if (re->writable) return true;
+    if (re->read_only) return false;
+
+    // Reopen for writing, don't retry on every write if that fails
+    fh = _fpga_req_fopen(re->path, true);
+    if (!fh) {
+        printf("FPGA can't write file '%s'\n", re->path);
+        re->read_only = true;
+        return false;
+    }
+
+    fclose(re->fh);
+    re->fh       = fh;
+    re->ofs      = 0;
+    re->writable = true;
+
+    return true;
+}
+
+static struct req_entry *_fpga_req_map_flash(uint32_t fid, const char *spec) {
+    struct req_entry       *re;
+    const void             *ptr;
+    spi_flash_mmap_handle_t handle;
+    esp_err_t               res;
+    size_t                  len;
+
+    if (!strncmp(spec, "appfs:", 6)) {
+        // AppFS entry
+        appfs_handle_t fd = appfsOpen(spec + 6);
+        int            size;
+
+        if (fd == APPFS_INVALID_FD) return NULL;
+        appfsEntryInfo(fd, NULL, &size);
+
+        len = size;
+        res = appfsMmap(fd, 0, len, &ptr, SPI_FLASH_MMAP_DATA, &handle);
+    } else if (!strncmp(spec, "partition:", 10)) {
+        // Raw data partition
+        const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, spec + 10);
+
+        if (!part) return NULL;
+
+        len = part->size;
+        res = esp_partition_mmap(part, 0, len, SPI_FLASH_MMAP_DATA, &ptr, &handle);
+    } else {
+        return NULL;
+    }
+
+    if (res != ESP_OK) return NULL;
+
+    // Alloc new entry
+    re = _fpga_req_new_entry(fid, 0);
+    if (!re) {
+        spi_flash_munmap(handle);
+        return NULL;
+    }
+
+    // Served like a raw data block, straight out of the flash cache
+    re->data   = (void *) ptr;
+    re->len    = len;
+    re->mapped = true;
+    re->mmap   = handle;
+
+    return re;
+}
+
 static struct req_entry *_fpga_req_get_file(const char *prefix, uint32_t fid) {
     struct req_entry *re;
     char              path[128];
 
     // Scan entries for a matching one
-    for (re = g_req_entries; re; re = re->next)
-        if (re->fid == fid) return re;
+    for (re = *_fpga_req_bucket(fid); re; re = re->next)
+        if (re->fid == fid) return (re->fh || re->data) ? re : NULL;
 
     // Nothing found, try to open file
     snprintf(path, sizeof(path), "%s/fpga_%08x.dat", prefix, fid);
     printf("FPGA read file '%s'\n", path);
-    return _fpga_req_open_file(fid, path);
+    re = _fpga_req_open_file(fid, path, false);
+
+    // Remember misses
+    if (!re) _fpga_req_new_entry(fid, 0);
+
+    return re;
+}
+
+static size_t _fpga_req_fread_file(struct req_entry *re, uint8_t *buf, size_t nbyte, size_t ofs) {
+    size_t done = 0;
+
+    // Make sure we read back what was written
+    if (re->wbuf_len) _fpga_req_flush_entry(re, false);
+
+    while (nbyte) {
+        // Serve what we can from the cache
+        if ((ofs >= re->cache_ofs) && (ofs < (re->cache_ofs + re->cache_len))) {
+            size_t l = re->cache_ofs + re->cache_len - ofs;
+            if (l > nbyte) l = nbyte;
+            memcpy(buf, re->cache + (ofs - re->cache_ofs), l);
+            buf += l;
+            ofs += l;
+            done += l;
+            nbyte -= l;
+            continue;
+        }
+
+        // Seek ? (always needed after a write)
+        if (ofs != re->ofs) fseek(re->fh, ofs, SEEK_SET);
+
+        // Large requests go straight to the caller's buffer
+        if ((nbyte >= REQ_CACHE_BLOCK) || (!re->cache && !(re->cache = malloc(REQ_CACHE_BLOCK)))) {
+            size_t l = fread(buf, 1, nbyte, re->fh);
+            re->ofs  = ofs + l;
+            done += l;
+            break;
+        }
+
+        // Refill the cache from the requested offset, reading ahead for
+        // the sequential requests that usually follow
+        re->cache_ofs = ofs;
+        re->cache_len = fread(re->cache, 1, REQ_CACHE_BLOCK, re->fh);
+        re->ofs       = ofs + re->cache_len;
+        if (!re->cache_len) break;
+    }
+
+    return done;
 }
 
 static ssize_t _fpga_req_fread(const char *prefix, uint32_t fid, void *buf, size_t nbyte, size_t ofs) {
@@ -441,13 +977,9 @@ static ssize_t _fpga_req_fread(const char *prefix, uint32_t fid, void *buf, size
 
     // Is it a file
     if (re->fh) {
-        // Seek ?
-        if (ofs != re->ofs) fseek(re->fh, ofs, SEEK_SET);
-
-        re->ofs = ofs + nbyte;
-
-        // Read data
-        nbyte = fread(buf, 1, nbyte, re->fh);
+        size_t l = _fpga_req_fread_file(re, buf, nbyte, ofs);
+        if (l < nbyte) memset(buf + l, 0x00, nbyte - l);
+        nbyte = l;
     }
 
     // Or a raw data block
@@ -458,58 +990,215 @@ static ssize_t _fpga_req_fread(const char *prefix, uint32_t fid, void *buf, size
     return nbyte;
 }
 
-void fpga_req_setup(void) { g_req_entries = NULL; }
+static ssize_t _fpga_req_fwrite(const char *prefix, uint32_t fid, const uint8_t *buf, size_t nbyte, size_t ofs) {
+    struct req_entry *re;
+    char              path[128];
+
+    // Get entry, creating the file if it wasn't found
+    re = _fpga_req_get_file(prefix, fid);
+    if (!re) {
+        _fpga_req_delete_entry(fid);
+        snprintf(path, sizeof(path), "%s/fpga_%08x.dat", prefix, fid);
+        printf("FPGA write file '%s'\n", path);
+        re = _fpga_req_open_file(fid, path, true);
+        if (!re) {
+            _fpga_req_new_entry(fid, 0);
+            return -1;
+        }
+    }
+
+#if 0
+    printf("wr: %08x %p %6d %6d\n", fid, re, nbyte, ofs);
+#endif
+
+    // Raw data block: update in place, can't grow
+    if (re->data) {
+        if (re->mapped || (ofs >= re->len)) return -1;
+        if ((ofs + nbyte) > re->len) nbyte = re->len - ofs;
+        memcpy(re->data + ofs, buf, nbyte);
+        return nbyte;
+    }
+
+    // File
+    if (!_fpga_req_make_writable(re)) return -1;
+
+    // Drop overlapping read cache
+    if ((ofs < (re->cache_ofs + re->cache_len)) && ((ofs + nbyte) > re->cache_ofs)) re->cache_len = 0;
+
+    // Append to the pending data if contiguous and if there is room
+    if (!re->wbuf_len || (ofs != (re->wbuf_ofs + re->wbuf_len)) || ((re->wbuf_len + nbyte) > REQ_WBUF_SIZE)) {
+        _fpga_req_flush_entry(re, false);
+
+        // Large writes go straight to the file
+        if ((nbyte >= REQ_WBUF_SIZE) || (!re->wbuf && !(re->wbuf = malloc(REQ_WBUF_SIZE)))) {
+            fseek(re->fh, ofs, SEEK_SET);
+            nbyte     = fwrite(buf, 1, nbyte, re->fh);
+            re->ofs   = REQ_OFS_UNKNOWN;
+            re->dirty = true;
+            goto done;
+        }
+
+        re->wbuf_ofs = ofs;
+    }
+
+    memcpy(re->wbuf + re->wbuf_len, buf, nbyte);
+    re->wbuf_len += nbyte;
+
+done:
+    if ((ofs + nbyte) > re->len) re->len = ofs + nbyte;
+
+    if (g_req_flush_policy == FPGA_REQ_FLUSH_EACH) _fpga_req_flush_entry(re, true);
+
+    g_req_dirty = true;
+    g_req_wlast = xTaskGetTickCount();
+
+    return nbyte;
+}
+
+static uint8_t *_fpga_req_get_buf(int slot, size_t len) {
+    // Round up to 32-bit
+    len = (len + 3) & ~3;
+
+    if (len > g_req_buf_len[slot]) {
+        heap_caps_free(g_req_buf[slot]);
+        g_req_buf[slot]     = heap_caps_malloc(len, MALLOC_CAP_DMA);
+        g_req_buf_len[slot] = g_req_buf[slot] ? len : 0;
+    }
+
+    return g_req_buf[slot];
+}
+
+static void _fpga_req_prefetch_task(void *arg) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // No prefix means we're asked to exit
+        if (!g_req_pf.prefix) break;
+
+        _fpga_req_fread(g_req_pf.prefix, g_req_pf.fid, &g_req_buf[g_req_pf.slot][1], g_req_pf.len, g_req_pf.ofs);
+        xSemaphoreGive(g_req_pf.done);
+    }
+
+    xSemaphoreGive(g_req_pf.done);
+    vTaskDelete(NULL);
+}
+
+static void _fpga_req_prefetch_start(const char *prefix, uint32_t fid, size_t ofs, size_t len, int slot) {
+    if (!g_req_pf.task) return;
+    if (!_fpga_req_get_buf(slot, len + 1)) return;
+
+    g_req_pf.prefix  = prefix;
+    g_req_pf.fid     = fid;
+    g_req_pf.ofs     = ofs;
+    g_req_pf.len     = len;
+    g_req_pf.slot    = slot;
+    g_req_pf.pending = true;
+
+    xTaskNotifyGive(g_req_pf.task);
+}
+
+// Wait for an outstanding read-ahead to complete. Must be called before
+// touching the file table since the worker uses it too.
+static bool _fpga_req_prefetch_wait(void) {
+    if (!g_req_pf.pending) return false;
+
+    xSemaphoreTake(g_req_pf.done, portMAX_DELAY);
+    g_req_pf.pending = false;
+
+    return true;
+}
+
+void fpga_req_setup(void) {
+    memset(g_req_table, 0x00, sizeof(g_req_table));
+    memset(g_req_buf, 0x00, sizeof(g_req_buf));
+    memset(g_req_buf_len, 0x00, sizeof(g_req_buf_len));
+    memset(&g_req_last, 0x00, sizeof(g_req_last));
+    memset(&g_req_pf, 0x00, sizeof(g_req_pf));
+    g_req_dirty = false;
+
+    // Start read-ahead worker, we just run without it if this fails
+    g_req_pf.done = xSemaphoreCreateBinary();
+    if (!g_req_pf.done) return;
+
+    if (xTaskCreate(_fpga_req_prefetch_task, "fpga_req_pf", 4096, NULL, uxTaskPriorityGet(NULL), &g_req_pf.task) != pdPASS) {
+        vSemaphoreDelete(g_req_pf.done);
+        g_req_pf.done = NULL;
+        g_req_pf.task = NULL;
+    }
+}
 
 void fpga_req_cleanup(void) {
     struct req_entry *re_cur, *re_nxt;
 
-    re_cur = g_req_entries;
+    // Let submitted Wishbone buffers finish and stop their task
+    fpga_wb_async_stop();
+
+    // Stop read-ahead worker
+    if (g_req_pf.task) {
+        _fpga_req_prefetch_wait();
+        g_req_pf.prefix = NULL;
+        xTaskNotifyGive(g_req_pf.task);
+        xSemaphoreTake(g_req_pf.done, portMAX_DELAY);
+        vSemaphoreDelete(g_req_pf.done);
+        g_req_pf.task = NULL;
+        g_req_pf.done = NULL;
+    }
 
-    while (re_cur) {
-        re_nxt = re_cur->next;
-        if (re_cur->fh) fclose(re_cur->fh);
-        free(re_cur);
-        re_cur = re_nxt;
+    for (int i = 0; i < REQ_HASH_SIZE; i++) {
+        re_cur = g_req_table[i];
+
+        while (re_cur) {
+            re_nxt = re_cur->next;
+            _fpga_req_free_entry(re_cur);
+            re_cur = re_nxt;
+        }
+
+        g_req_table[i] = NULL;
     }
 
-    g_req_entries = NULL;
+    g_req_dirty = false;
+
+    for (int i = 0; i < 2; i++) {
+        heap_caps_free(g_req_buf[i]);
+        g_req_buf[i]     = NULL;
+        g_req_buf_len[i] = 0;
+    }
 }
 
 int fpga_req_add_file_alias(uint32_t fid, const char *path) {
     struct req_entry *re;
 
     // Remove any previous entries
+    _fpga_req_prefetch_wait();
     _fpga_req_delete_entry(fid);
 
     // Open new one
-    re = _fpga_req_open_file(fid, path);
+    if (!strncmp(path, "appfs:", 6) || !strncmp(path, "partition:", 10))
+        re = _fpga_req_map_flash(fid, path);
+    else
+        re = _fpga_req_open_file(fid, path, false);
     if (!re) return -ENOENT;
 
+    re->alias = true;
+
     return 0;
 }
 
 int fpga_req_add_file_data(uint32_t fid, void *data, size_t len) {
     struct req_entry *re;
-    void             *buf;
 
     // Remove any previous entries
+    _fpga_req_prefetch_wait();
     _fpga_req_delete_entry(fid);
 
     // Alloc new entry
-    buf = malloc(sizeof(struct req_entry) + len);
-    if (!buf) return -ENOMEM;
-
-    re = buf;
-    memset(re, 0x00, sizeof(struct req_entry));
-
-    // Add it to list
-    re->next      = g_req_entries;
-    g_req_entries = re;
+    re = _fpga_req_new_entry(fid, len);
+    if (!re) return -ENOMEM;
 
     // Init fields
-    re->fid  = fid;
-    re->data = buf + sizeof(struct req_entry);
-    re->len  = len;
+    re->data  = (uint8_t *) re + sizeof(struct req_entry);
+    re->len   = len;
+    re->alias = true;
 
     // Copy actual data
     memcpy(re->data, data, len);
@@ -518,18 +1207,69 @@ int fpga_req_add_file_data(uint32_t fid, void *data, size_t len) {
     return 0;
 }
 
-void fpga_req_del_file(uint32_t fid) { _fpga_req_delete_entry(fid); }
+void fpga_req_new_bitstream(void) {
+    struct req_entry **re_ptr;
+    struct req_entry  *re;
+
+    _fpga_req_prefetch_wait();
+
+    // Drop whatever the previous bitstream looked up, misses included:
+    // files may have appeared or changed since
+    for (int i = 0; i < REQ_HASH_SIZE; i++) {
+        re_ptr = &g_req_table[i];
+
+        while ((re = *re_ptr)) {
+            if (re->alias) {
+                re_ptr = &re->next;
+                continue;
+            }
+
+            *re_ptr = re->next;
+            _fpga_req_free_entry(re);
+        }
+    }
+
+    // Commit what was written to the aliases
+    _fpga_req_flush_all();
+
+    memset(&g_req_last, 0x00, sizeof(g_req_last));
+}
+
+void fpga_req_del_file(uint32_t fid) {
+    _fpga_req_prefetch_wait();
+    _fpga_req_delete_entry(fid);
+}
+
+void fpga_req_set_flush_policy(enum fpga_req_flush_policy policy) {
+    g_req_flush_policy = policy;
+    fpga_req_flush();
+}
+
+void fpga_req_flush(void) {
+    _fpga_req_prefetch_wait();
+    _fpga_req_flush_all();
+}
 
 bool fpga_req_process(const char *prefix, ICE40 *ice40, TickType_t wait, esp_err_t *err) {
     esp_err_t res;
     uint8_t   buf[12] __attribute__((aligned(4)));
     uint8_t   req;
+    int64_t   t;
 
     // Default is no error
     *err = ESP_OK;
 
     // If the FPGA isn't requesting anything ... we have nothing to do !
-    if (!fpga_irq_wait(wait)) return false;
+    if (!fpga_irq_wait(wait)) {
+        // Good time to commit writes once the FPGA stopped sending them
+        if (g_req_dirty && (g_req_flush_policy == FPGA_REQ_FLUSH_IDLE) && ((xTaskGetTickCount() - g_req_wlast) >= REQ_FLUSH_IDLE)) {
+            _fpga_req_prefetch_wait();
+            _fpga_req_flush_all();
+        }
+        return false;
+    }
+
+    t = esp_timer_get_time();
 
     // Poll status byte to see what's up
     buf[0] = SPI_CMD_NOP2;
@@ -544,6 +1284,7 @@ bool fpga_req_process(const char *prefix, ICE40 *ice40, TickType_t wait, esp_err
         uint32_t req_offset;
         uint16_t req_length;
         uint8_t *buf_req;
+        int      slot;
 
         // Get file request: Command
         buf[0] = SPI_CMD_FREAD_GET;
@@ -559,24 +1300,93 @@ bool fpga_req_process(const char *prefix, ICE40 *ice40, TickType_t wait, esp_err
         req_offset  = (buf[6] << 24) | (buf[7] << 16) | (buf[8] << 8) | buf[9];
         req_length  = ((buf[10] << 8) | buf[11]) + 1;
 
-        // Get buffer
-        buf_req = malloc(req_length + 1 + ((req_length + 1) % 4));  // Allocate a 32-bit aligned amount
+        // Did the read-ahead guess right ?
+        if (_fpga_req_prefetch_wait() && (g_req_pf.fid == req_file_id) && (g_req_pf.ofs == req_offset) && (g_req_pf.len == req_length)) {
+            slot    = g_req_pf.slot;
+            buf_req = g_req_buf[slot];
+            g_stats.fread_prefetched++;
+        } else {
+            // Get buffer
+            slot    = 0;
+            buf_req = _fpga_req_get_buf(slot, req_length + 1);
+            if (!buf_req) {
+                res = ESP_ERR_NO_MEM;
+                goto error;
+            }
+
+            // Load data from file
+            _fpga_req_fread(prefix, req_file_id, &buf_req[1], req_length, req_offset);
+        }
 
-        // Load data from file
-        _fpga_req_fread(prefix, req_file_id, &buf_req[1], req_length, req_offset);
+        // Sequential stream ? Read the next block while this one is sent
+        if ((req_file_id == g_req_last.fid) && (req_offset == (g_req_last.ofs + g_req_last.len))) {
+            struct req_entry *re = _fpga_req_get_file(prefix, req_file_id);
+            if (re && ((req_offset + req_length) < re->len)) _fpga_req_prefetch_start(prefix, req_file_id, req_offset + req_length, req_length, slot ^ 1);
+        }
+
+        g_req_last.fid = req_file_id;
+        g_req_last.ofs = req_offset;
+        g_req_last.len = req_length;
 
         // Send data
         buf_req[0] = SPI_CMD_FREAD_PUT;
         res        = ice40_send(ice40, buf_req, req_length + 1);
-        if (res != ESP_OK) {
-            free(buf_req);
+        if (res != ESP_OK) goto error;
+
+        g_stats.fread++;
+        g_stats.fread_bytes += req_length;
+    }
+
+    // File writes
+    if (req & SPI_REQ_FWRITE) {
+        uint32_t req_file_id;
+        uint32_t req_offset;
+        uint16_t req_length;
+        uint8_t *buf_req;
+
+        // Get write request: Command
+        buf[0] = SPI_CMD_FWRITE_GET;
+        res    = ice40_send(ice40, buf, 1);
+        if (res != ESP_OK) goto error;
+
+        // Get write request: Response
+        buf[0] = SPI_CMD_RESP_ACK;
+        res    = ice40_transaction(ice40, buf, 12, buf, 12);
+        if (res != ESP_OK) goto error;
+
+        req_file_id = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
+        req_offset  = (buf[6] << 24) | (buf[7] << 16) | (buf[8] << 8) | buf[9];
+        req_length  = ((buf[10] << 8) | buf[11]) + 1;
+
+        // The file table and buffers are about to change, any read-ahead
+        // data may be stale
+        _fpga_req_prefetch_wait();
+
+        buf_req = _fpga_req_get_buf(0, req_length + 2);
+        if (!buf_req) {
+            res = ESP_ERR_NO_MEM;
             goto error;
         }
 
-        // Done with buffer
-        free(buf_req);
+        // Get write data: Command
+        buf[0] = SPI_CMD_FWRITE_DATA;
+        res    = ice40_send(ice40, buf, 1);
+        if (res != ESP_OK) goto error;
+
+        // Get write data: Response
+        buf_req[0] = SPI_CMD_RESP_ACK;
+        res        = ice40_transaction(ice40, buf_req, req_length + 2, buf_req, req_length + 2);
+        if (res != ESP_OK) goto error;
+
+        // Store it, failures are not reported to the FPGA
+        _fpga_req_fwrite(prefix, req_file_id, &buf_req[2], req_length, req_offset);
+
+        g_stats.fwrite++;
+        g_stats.fwrite_bytes += req_length;
     }
 
+    g_stats.req_us += esp_timer_get_time() - t;
+
     // Done !
     return true;
 
@@ -1,38 +1,223 @@
+#include "dirent.h"
+#include "esp32/rom/crc.h"
+#include "esp32/rom/miniz.h"
 #include "esp_event.h"
+#include "esp_heap_caps.h"
 #include "esp_http_client.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "hardware.h"
+#include "http_download.h"
+#include "mbedtls/sha256.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "pax_codecs.h"
 #include "pax_gfx.h"
 #include "soc/rtc.h"
 #include "soc/rtc_cntl_reg.h"
+#include "sys/stat.h"
+#include "unistd.h"
 #include "wifi_connect.h"
 #include "wifi_connection.h"
 
 static const char* TAG = "HTTP download";
 
+// Downloads to RAM without a content-length (chunked or compressed responses) start with a small buffer that doubles in size when full
+#define DOWNLOAD_RAM_INITIAL_SIZE (4 * 1024)
+#define DOWNLOAD_RAM_MAX_SIZE     (1024 * 1024)
+
+// Downloads to RAM ask for gzip compression, the response is inflated while it comes in
+typedef enum { GZIP_HEADER, GZIP_EXTRA_LEN, GZIP_EXTRA, GZIP_NAME, GZIP_COMMENT, GZIP_HCRC, GZIP_DATA, GZIP_TRAILER, GZIP_DONE } download_gzip_state_t;
+
+typedef struct {
+    download_gzip_state_t state;
+    uint8_t               header[10];  // Fixed part of the header, later the trailer (CRC-32 and size)
+    size_t                count;       // Bytes of the current header field received
+    size_t                skip;        // Bytes of extra field left to skip
+    uint32_t              crc;         // CRC-32 of the inflated data
+    tinfl_decompressor    inflator;
+} download_gzip_t;
+
 typedef struct {
-    FILE*     fd;                // For downloading directly to file on filesystem
-    uint8_t** buffer;            // Dynamically allocated buffer for downloading to RAM (malloced in event handler, used if fd is not set)
-    size_t    size;              // File size as indicated by content-length header (set in event handler)
-    size_t    received;          // Amount of data received (set in event handler)
-    bool      error;             // Indication that an error event happened (set in event handler)
-    bool      connected;         // Indication that the HTTP client has connected to the server (set in event handler)
-    bool      finished;          // Indication that the operation has completed (set in event handler)
-    bool      disconnected;      // Indication that the HTTP client has disconnected from the server (set in event handler)
-    bool      out_of_memory;     // Indication that malloc failed
-    bool      out_of_allocated;  // Indication that the server sent more data than indicated with the content-length header
+    FILE*                   fd;                // For downloading directly to file on filesystem
+    uint8_t**               buffer;            // Dynamically allocated buffer for downloading to RAM (malloced in event handler, used if fd is not set)
+    size_t                  capacity;          // Size of the buffer
+    size_t                  used;              // Amount of data in the buffer
+    download_gzip_t*        gzip;              // Inflater state if the response is gzip compressed (allocated in event handler)
+    download_callback_t     callback;          // For handing the data to the caller as it comes in (used if fd and buffer are not set)
+    void*                   callback_ctx;      // Context for the callback
+    size_t                  size;              // File size as indicated by content-length header (set in event handler)
+    bool                    size_known;        // Response had a content-length header (set in event handler)
+    bool                    complete;          // The HTTP client received the whole response (chunked responses have no size to check against)
+    size_t                  received;          // Amount of data received (set in event handler)
+    bool                    error;             // Indication that an error event happened (set in event handler)
+    bool                    connected;         // Indication that the HTTP client has connected to the server (set in event handler)
+    bool                    finished;          // Indication that the operation has completed (set in event handler)
+    bool                    disconnected;      // Indication that the HTTP client has disconnected from the server (set in event handler)
+    bool                    out_of_memory;     // Indication that malloc failed
+    bool                    out_of_allocated;  // Indication that the server sent more data than indicated with the content-length header
+    int                     status;            // HTTP status code of the response
+    const char*             if_none_match;     // Validators to send for a conditional request (optional)
+    const char*             if_modified_since;
+    char                    etag[64];          // Validators received with the response (set in event handler)
+    char                    last_modified[40];
+    size_t                  offset;            // Resume the download from this position (optional, data before it is already there)
+    const char*             if_range;          // Validator the data before offset was received with
+    size_t                  range_start;       // Start of the data as indicated by the content-range header (set in event handler)
+    mbedtls_sha256_context* hash;              // Hash of the data, updated as it comes in (optional)
+    const volatile bool*    cancel;            // Stops the download when set (optional)
 } http_download_info_t;
 
+// Progress of an interrupted download, to resume it where it stopped
+typedef struct {
+    size_t                  offset;         // Amount of data that was received
+    char                    validator[64];  // ETag or Last-Modified of the data received
+    mbedtls_sha256_context* hash;           // Hash of the data received (optional)
+} http_download_resume_t;
+
+// Connections are kept open after a request and reused for the next request to the same server, saving the TCP connect and TLS handshake
+#define HTTP_POOL_SIZE 3
+
+typedef struct {
+    esp_http_client_handle_t client;      // HTTP client, holds the (keep-alive) connection
+    char                     origin[64];  // Scheme, host and port the connection is for
+    bool                     in_use;      // Connection is used by a request
+    bool                     pooled;      // Connection is part of the pool (not allocated because the pool was exhausted)
+    http_download_info_t*    info;        // State of the request using the connection
+} http_connection_t;
+
+static http_connection_t http_pool[HTTP_POOL_SIZE];
+static portMUX_TYPE      http_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool download_ram_reserve(http_download_info_t* info, size_t needed) {
+    if (needed <= info->capacity) return true;
+    // The content-length is exact unless the response is compressed and gets allocated as is, only buffers growing without a known size are limited
+    bool   exact    = info->size_known && (info->size > 0) && (info->gzip == NULL);
+    size_t capacity = info->capacity;
+    if (capacity == 0) capacity = exact ? info->size : DOWNLOAD_RAM_INITIAL_SIZE;
+    while (capacity < needed) capacity *= 2;
+    if ((!exact) && (capacity > DOWNLOAD_RAM_MAX_SIZE)) capacity = DOWNLOAD_RAM_MAX_SIZE;
+    if (needed > capacity) {
+        printf("Download does not fit in RAM (%u bytes)\r\n", needed);
+        info->out_of_allocated = true;
+        return false;
+    }
+    uint8_t* buffer = realloc(*info->buffer, capacity);
+    if (buffer == NULL) {
+        info->out_of_memory = true;
+        return false;
+    }
+    *info->buffer  = buffer;
+    info->capacity = capacity;
+    return true;
+}
+
+static void download_ram_finish(http_download_info_t* info) {
+    // Give back what the last doubling of the buffer didn't use
+    if ((*info->buffer != NULL) && (info->used > 0) && (info->used < info->capacity)) {
+        uint8_t* buffer = realloc(*info->buffer, info->used);
+        if (buffer != NULL) *info->buffer = buffer;
+    }
+    free(info->gzip);
+    info->gzip = NULL;
+}
+
+static void download_gzip_next(download_gzip_t* gzip) {
+    // Move on to the next header field present in the stream
+    uint8_t flags = gzip->header[3];
+    do {
+        gzip->state++;
+        gzip->count = 0;
+    } while (((gzip->state == GZIP_EXTRA_LEN) && !(flags & 0x04)) || ((gzip->state == GZIP_EXTRA) && (gzip->skip == 0)) ||
+             ((gzip->state == GZIP_NAME) && !(flags & 0x08)) || ((gzip->state == GZIP_COMMENT) && !(flags & 0x10)) ||
+             ((gzip->state == GZIP_HCRC) && !(flags & 0x02)));
+}
+
+static bool download_ram_inflate(http_download_info_t* info, const uint8_t* data, size_t length) {
+    download_gzip_t* gzip     = info->gzip;
+    size_t           position = 0;
+    while ((position < length) && (gzip->state != GZIP_DONE)) {
+        if (gzip->state == GZIP_DATA) {
+            // Inflate straight into the buffer, growing it until the input is used up
+            tinfl_status status;
+            do {
+                if (!download_ram_reserve(info, info->used + 1)) return false;
+                size_t   in_len  = length - position;
+                size_t   out_len = info->capacity - info->used;
+                uint8_t* out     = *info->buffer + info->used;
+                status = tinfl_decompress(&gzip->inflator, data + position, &in_len, *info->buffer, out, &out_len,
+                                          TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+                gzip->crc = crc32_le(gzip->crc, out, out_len);
+                position += in_len;
+                info->used += out_len;
+            } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+            if (status < 0) {
+                printf("Failed to inflate response (%d)\r\n", status);
+                info->error = true;
+                return false;
+            }
+            if (status == TINFL_STATUS_DONE) download_gzip_next(gzip);
+            continue;
+        }
+
+        uint8_t byte = data[position++];
+        switch (gzip->state) {
+            case GZIP_HEADER:
+                gzip->header[gzip->count++] = byte;
+                if (gzip->count < 10) break;
+                // Magic and the deflate method
+                if ((gzip->header[0] != 0x1f) || (gzip->header[1] != 0x8b) || (gzip->header[2] != 8)) {
+                    printf("Invalid gzip header\r\n");
+                    info->error = true;
+                    return false;
+                }
+                download_gzip_next(gzip);
+                break;
+            case GZIP_EXTRA_LEN:
+                gzip->skip |= byte << (8 * gzip->count++);
+                if (gzip->count == 2) download_gzip_next(gzip);
+                break;
+            case GZIP_EXTRA:
+                if (--gzip->skip == 0) download_gzip_next(gzip);
+                break;
+            case GZIP_NAME:
+            case GZIP_COMMENT:
+                if (byte == 0) download_gzip_next(gzip);
+                break;
+            case GZIP_HCRC:
+                if (++gzip->count == 2) download_gzip_next(gzip);
+                break;
+            case GZIP_TRAILER:
+                gzip->header[gzip->count++] = byte;
+                if (gzip->count < 8) break;
+                // CRC-32 and size of the inflated data, little endian
+                uint32_t crc  = gzip->header[0] | (gzip->header[1] << 8) | (gzip->header[2] << 16) | ((uint32_t) gzip->header[3] << 24);
+                uint32_t size = gzip->header[4] | (gzip->header[5] << 8) | (gzip->header[6] << 16) | ((uint32_t) gzip->header[7] << 24);
+                if ((crc != gzip->crc) || (size != (uint32_t) info->used)) {
+                    printf("Inflated response is corrupt\r\n");
+                    info->error = true;
+                    return false;
+                }
+                gzip->state = GZIP_DONE;
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static void download_hash_start(http_download_info_t* info) {
+    if (info->hash != NULL) mbedtls_sha256_starts_ret(info->hash, 0);
+}
+
 static esp_err_t _event_handler(esp_http_client_event_t* evt) {
-    http_download_info_t* info = (http_download_info_t*) evt->user_data;
+    http_download_info_t* info = ((http_connection_t*) evt->user_data)->info;
     switch (evt->event_id) {
         case HTTP_EVENT_ERROR:
             info->error = true;
@@ -48,38 +233,86 @@ static esp_err_t _event_handler(esp_http_client_event_t* evt) {
                 if ((strlen(evt->header_key) == strlen(content_length_key)) &&
                     (strncasecmp(content_length_key, evt->header_key, strlen(content_length_key)) == 0)) {
                     // Header value is content length
-                    info->size = atoi(evt->header_value);
+                    info->size       = atoi(evt->header_value);
+                    info->size_known = true;
                     printf("SIZE KNOWN: %u bytes\r\n", info->size);
-                    if ((info->size > 0) && (info->buffer != NULL)) {  // Buffer poiner is set, buffer pointer points to NULL
-                        *info->buffer = malloc(info->size);
-                        printf("BUFFER MALLOC'ED (%u bytes)\r\n", info->size);
-                        if (*info->buffer == NULL) {
-                            info->out_of_memory = true;
-                            return ESP_ERR_NO_MEM;
-                        }
+                } else if ((strcasecmp(evt->header_key, "Content-Encoding") == 0) && (strcasecmp(evt->header_value, "gzip") == 0) &&
+                           (info->buffer != NULL) && (info->gzip == NULL)) {
+                    // Only asked for when downloading to RAM
+                    info->gzip = calloc(1, sizeof(download_gzip_t));
+                    if (info->gzip == NULL) {
+                        info->out_of_memory = true;
+                        return ESP_ERR_NO_MEM;
                     }
+                    tinfl_init(&info->gzip->inflator);
+                } else if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+                    // "bytes <start>-<end>/<total>"
+                    unsigned int start = 0;
+                    if (sscanf(evt->header_value, "bytes %u-", &start) == 1) info->range_start = start;
+                } else if (strcasecmp(evt->header_key, "ETag") == 0) {
+                    snprintf(info->etag, sizeof(info->etag), "%s", evt->header_value);
+                } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+                    snprintf(info->last_modified, sizeof(info->last_modified), "%s", evt->header_value);
                 } else {
                     // printf("HTTP_EVENT_ON_HEADER, key=%s, value=%s\r\n", evt->header_key, evt->header_value);
                 }
                 break;
             }
         case HTTP_EVENT_ON_DATA:
+            if ((info->cancel != NULL) && *info->cancel) {
+                info->error = true;
+                return ESP_FAIL;
+            }
+            if (info->received == 0) {
+                // Don't store error pages
+                int status = esp_http_client_get_status_code(evt->client);
+                if ((status != 200) && (status != 206)) {
+                    info->error = true;
+                    return ESP_FAIL;
+                }
+                if ((status == 206) && (info->range_start != info->offset)) {
+                    printf("Server resumed at %u instead of %u\r\n", info->range_start, info->offset);
+                    info->error = true;
+                    return ESP_FAIL;
+                }
+                if ((status == 200) && (info->offset > 0)) {
+                    // Server sent the whole file instead (changed since, or no range support), start over
+                    printf("Can't resume, downloading from the start\r\n");
+                    info->offset = 0;
+                    download_hash_start(info);
+                    if (info->fd != NULL) {
+                        fflush(info->fd);
+                        ftruncate(fileno(info->fd), 0);
+                        fseek(info->fd, 0, SEEK_SET);
+                    }
+                }
+            }
+            if (info->error) return ESP_FAIL;
             if (info->fd != NULL) {  // Write directly to file on filesystem
                 printf("Writing to FILE @ %p (%u bytes): %u of %u bytes.\r\n", info->fd, evt->data_len, info->received + evt->data_len, info->size);
                 fwrite(evt->data, 1, evt->data_len, info->fd);
-            } else if (info->buffer != NULL && *info->buffer != NULL) {
-                if (info->received + evt->data_len <= info->size) {
-                    uint8_t* dest = &((*info->buffer)[info->received]);
-                    printf("Writing to RAM @ %p (%u bytes): %u of %u bytes.\r\n", dest, evt->data_len, info->received + evt->data_len, info->size);
-                    memcpy(dest, evt->data, evt->data_len);
-                } else {
+            } else if (info->buffer != NULL) {  // Buffer pointer is set, buffer is (re)allocated as the data comes in
+                if (info->gzip != NULL) {
+                    if (!download_ram_inflate(info, evt->data, evt->data_len)) return info->error ? ESP_FAIL : ESP_ERR_NO_MEM;
+                } else if (info->size_known && (info->received + evt->data_len > info->size)) {
                     printf("Downloaded too much? %u with %u in content-length header\r\n", info->received + evt->data_len, info->size);
                     info->out_of_allocated = true;
                     return ESP_ERR_NO_MEM;
+                } else {
+                    if (!download_ram_reserve(info, info->used + evt->data_len)) return ESP_ERR_NO_MEM;
+                    memcpy(*info->buffer + info->used, evt->data, evt->data_len);
+                    info->used += evt->data_len;
+                }
+            } else if (info->callback != NULL) {
+                size_t total = (info->size > 0) ? info->offset + info->size : 0;
+                if (!info->callback(info->callback_ctx, total, info->offset + info->received, evt->data, evt->data_len)) {
+                    info->error = true;
+                    return ESP_FAIL;
                 }
             } else {
                 return ESP_FAIL;
             }
+            if (info->hash != NULL) mbedtls_sha256_update_ret(info->hash, evt->data, evt->data_len);
             info->received += evt->data_len;
             break;
         case HTTP_EVENT_ON_FINISH:
@@ -93,58 +326,665 @@ static esp_err_t _event_handler(esp_http_client_event_t* evt) {
 }
 
 static bool download_success(esp_err_t err, http_download_info_t* info) {
-    return (err == ESP_OK) && (!(info->error || info->out_of_allocated || info->out_of_memory)) && info->finished && (info->received == info->size);
+    if ((err != ESP_OK) || info->error || info->out_of_allocated || info->out_of_memory || (!info->finished)) return false;
+    // Without a content-length (chunked response) the client knows whether the terminating chunk arrived
+    if (info->size_known ? (info->received != info->size) : (!info->complete)) return false;
+    return (info->gzip == NULL) || (info->gzip->state == GZIP_DONE);
 }
 
-static bool _download_file(const char* url, const char* path) {
-    FILE* fd = fopen(path, "w");
-    if (fd == NULL) {
-        ESP_LOGE(TAG, "Failed to open file");
-        return false;
+static void http_origin(const char* url, char* origin, size_t size) {
+    // Everything up to the path: "https://host:port"
+    const char* start = strstr(url, "://");
+    start             = (start != NULL) ? start + 3 : url;
+    const char* end   = strchr(start, '/');
+    size_t      len   = (end != NULL) ? (size_t) (end - url) : strlen(url);
+    if (len >= size) len = size - 1;
+    memcpy(origin, url, len);
+    origin[len] = '\0';
+}
+
+static http_connection_t* http_connection_acquire(const char* url, bool* reused) {
+    http_connection_t* conn = NULL;
+    char               origin[sizeof(conn->origin)];
+    http_origin(url, origin, sizeof(origin));
+
+    // Prefer an idle connection to the same server, then an empty slot, then any idle connection
+    taskENTER_CRITICAL(&http_pool_lock);
+    for (int i = 0; (conn == NULL) && (i < HTTP_POOL_SIZE); i++) {
+        if ((!http_pool[i].in_use) && (http_pool[i].client != NULL) && (strcmp(http_pool[i].origin, origin) == 0)) conn = &http_pool[i];
     }
+    for (int i = 0; (conn == NULL) && (i < HTTP_POOL_SIZE); i++) {
+        if ((!http_pool[i].in_use) && (http_pool[i].client == NULL)) conn = &http_pool[i];
+    }
+    for (int i = 0; (conn == NULL) && (i < HTTP_POOL_SIZE); i++) {
+        if (!http_pool[i].in_use) conn = &http_pool[i];
+    }
+    if (conn != NULL) {
+        conn->in_use = true;
+        conn->pooled = true;
+    }
+    taskEXIT_CRITICAL(&http_pool_lock);
 
-    http_download_info_t info = {0};
-    info.fd                   = fd;
+    if (conn == NULL) {
+        // Pool exhausted, use a one-off connection
+        conn = calloc(1, sizeof(http_connection_t));
+        if (conn == NULL) return NULL;
+        conn->in_use = true;
+    }
+
+    if ((conn->client != NULL) && (strcmp(conn->origin, origin) == 0)) {
+        *reused = (esp_http_client_set_url(conn->client, url) == ESP_OK);
+        if (*reused) return conn;
+    }
 
+    *reused = false;
+    if (conn->client != NULL) esp_http_client_cleanup(conn->client);
     esp_http_client_config_t config = {
-        .url = url, .use_global_ca_store = true, .keep_alive_enable = true, .timeout_ms = 10000, .user_data = (void*) &info, .event_handler = _event_handler};
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_err_t                err    = esp_http_client_perform(client);
+        .url = url, .use_global_ca_store = true, .keep_alive_enable = true, .timeout_ms = 10000, .user_data = (void*) conn, .event_handler = _event_handler};
+    conn->client = esp_http_client_init(&config);
+    strcpy(conn->origin, origin);
+    if (conn->client == NULL) {
+        conn->in_use = false;
+        if (!conn->pooled) free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void http_connection_release(http_connection_t* conn, bool keep) {
+    // Only keep connections that are known to be in a clean state
+    if ((!keep) || (!conn->pooled)) {
+        esp_http_client_cleanup(conn->client);
+        conn->client = NULL;
+    }
+    conn->info = NULL;
+    if (!conn->pooled) {
+        free(conn);
+        return;
+    }
+    taskENTER_CRITICAL(&http_pool_lock);
+    conn->in_use = false;
+    taskEXIT_CRITICAL(&http_pool_lock);
+}
+
+static esp_err_t http_connection_perform(http_connection_t* conn, http_download_info_t* info) {
+    esp_http_client_handle_t client = conn->client;
+
+    // Request headers, removed again afterwards as the client gets reused
+    if (info->if_none_match != NULL) esp_http_client_set_header(client, "If-None-Match", info->if_none_match);
+    if (info->if_modified_since != NULL) esp_http_client_set_header(client, "If-Modified-Since", info->if_modified_since);
+    if (info->offset > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%u-", info->offset);
+        esp_http_client_set_header(client, "Range", range);
+        if (info->if_range != NULL) esp_http_client_set_header(client, "If-Range", info->if_range);
+    }
+    if (info->buffer != NULL) esp_http_client_set_header(client, "Accept-Encoding", "gzip");
+
+    conn->info     = info;
+    esp_err_t err  = esp_http_client_perform(client);
+    info->status   = esp_http_client_get_status_code(client);
+    info->complete = esp_http_client_is_complete_data_received(client);
+
+    if (info->if_none_match != NULL) esp_http_client_delete_header(client, "If-None-Match");
+    if (info->if_modified_since != NULL) esp_http_client_delete_header(client, "If-Modified-Since");
+    if (info->offset > 0) {
+        esp_http_client_delete_header(client, "Range");
+        if (info->if_range != NULL) esp_http_client_delete_header(client, "If-Range");
+    }
+    if (info->buffer != NULL) esp_http_client_delete_header(client, "Accept-Encoding");
+    return err;
+}
+
+static bool http_perform(const char* url, http_download_info_t* info) {
+    http_download_info_t initial = *info;
+    bool                 reused;
+
+    http_connection_t* conn = http_connection_acquire(url, &reused);
+    if (conn == NULL) {
+        ESP_LOGE(TAG, "Failed to set up HTTP client");
+        return false;
+    }
+
+    esp_err_t err = http_connection_perform(conn, info);
+
+    // The server may have closed a kept connection in the meantime, that shows up as a failure before anything was received: try again right
+    // away on a new connection
+    bool cancelled = (info->cancel != NULL) && *info->cancel;
+    if ((err != ESP_OK) && reused && (!cancelled) && (info->size == 0) && (info->received == 0)) {
+        ESP_LOGI(TAG, "Reused connection failed, reconnecting");
+        http_connection_release(conn, false);
+        free(info->gzip);
+        *info = initial;
+        conn  = http_connection_acquire(url, &reused);
+        if (conn == NULL) return false;
+        err = http_connection_perform(conn, info);
+    }
+
+    // Not modified: there's no body, whatever the content length says
+    bool success = (info->status == 304) ? ((err == ESP_OK) && (!info->error)) : download_success(err, info);
+    if ((info->status < 200) || (info->status >= 400)) success = false;
+    http_connection_release(conn, success);
+    return success;
+}
+
+// Response cache: files on the internal filesystem named after a hash of the URL, holding a header followed by the response body. The
+// least recently stored or revalidated responses are removed to keep it below HTTP_CACHE_MAX_SIZE.
+#define HTTP_CACHE_DIR         "/internal/.http_cache"
+#define HTTP_CACHE_MAGIC       0x32484348  // "HCH2"
+#define HTTP_CACHE_MAX_SIZE    (256 * 1024)
+#define HTTP_CACHE_MAX_ENTRIES 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;               // Size of the body following the header
+    uint32_t boot;               // Boot the response was stored or last revalidated in
+    uint32_t stored;             // Seconds since that boot
+    uint32_t sequence;           // Order in which responses were stored or revalidated
+    char     url[192];           // To tell hash collisions apart
+    char     etag[64];           // Validators
+    char     last_modified[40];
+} http_cache_header_t;
+
+// Nothing sets the clock, so ages are only known within a boot: the boots are counted in NVS, a response is only fresh in the boot that
+// stored it. The least recent responses are found by their sequence number, which continues from the highest one in the cache.
+static bool     http_cache_loaded   = false;
+static uint32_t http_cache_boot     = 0;  // Stays 0 if it can't be counted, nothing is fresh then
+static uint32_t http_cache_sequence = 0;
+
+static uint32_t http_cache_uptime(void) { return esp_timer_get_time() / 1000000; }
+
+static bool http_cache_read_header(const char* path, http_cache_header_t* header) {
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL) return false;
+    bool ok = (fread(header, sizeof(http_cache_header_t), 1, fd) == 1) && (header->magic == HTTP_CACHE_MAGIC);
     fclose(fd);
-    esp_http_client_cleanup(client);
-    return download_success(err, &info);
+    return ok;
 }
 
-bool download_file(const char* url, const char* path) {
-    int retry = 3;
+static void http_cache_load(void) {
+    if (http_cache_loaded) return;
+    http_cache_loaded = true;
+
+    nvs_handle_t handle;
+    if (nvs_open("system", NVS_READWRITE, &handle) == ESP_OK) {
+        uint32_t boot = 0;
+        nvs_get_u32(handle, "http_cache_boot", &boot);
+        if (++boot == 0) boot = 1;
+        if ((nvs_set_u32(handle, "http_cache_boot", boot) == ESP_OK) && (nvs_commit(handle) == ESP_OK)) http_cache_boot = boot;
+        nvs_close(handle);
+    }
+
+    DIR* dir = opendir(HTTP_CACHE_DIR);
+    if (dir == NULL) return;
+    char           path[64];
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strchr(ent->d_name, '.') != NULL) continue;
+        snprintf(path, sizeof(path), HTTP_CACHE_DIR "/%s", ent->d_name);
+        http_cache_header_t header;
+        if (http_cache_read_header(path, &header) && (header.sequence > http_cache_sequence)) http_cache_sequence = header.sequence;
+    }
+    closedir(dir);
+}
+
+static void http_cache_stamp(http_cache_header_t* header) {
+    header->boot     = http_cache_boot;
+    header->stored   = http_cache_uptime();
+    header->sequence = ++http_cache_sequence;
+}
+
+static void http_cache_path(const char* url, char* path, size_t size) {
+    // 64-bit FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char* c = url; *c != '\0'; c++) hash = (hash ^ (uint8_t) *c) * 0x100000001b3ULL;
+    snprintf(path, size, HTTP_CACHE_DIR "/%016llx", hash);
+}
+
+static bool http_cache_read(const char* path, const char* url, http_cache_header_t* header, uint8_t** ptr) {
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL) return false;
+    bool ok = (fread(header, sizeof(http_cache_header_t), 1, fd) == 1) && (header->magic == HTTP_CACHE_MAGIC) &&
+              (strncmp(header->url, url, sizeof(header->url)) == 0);
+    if (ok && (ptr != NULL)) {
+        *ptr = malloc(header->size > 0 ? header->size : 1);
+        ok   = (*ptr != NULL) && (fread(*ptr, 1, header->size, fd) == header->size);
+        if ((!ok) && (*ptr != NULL)) {
+            free(*ptr);
+            *ptr = NULL;
+        }
+    }
+    fclose(fd);
+    return ok;
+}
+
+static void http_cache_write(const char* path, http_cache_header_t* header, const uint8_t* data) {
+    char path_tmp[72];
+    snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+    mkdir(HTTP_CACHE_DIR, 0777);
+    FILE* fd = fopen(path_tmp, "wb");
+    if (fd == NULL) return;
+    bool ok = (fwrite(header, sizeof(http_cache_header_t), 1, fd) == 1) && ((header->size == 0) || (fwrite(data, 1, header->size, fd) == header->size));
+    ok      = (fclose(fd) == 0) && ok;
+    remove(path);
+    if ((!ok) || (rename(path_tmp, path) != 0)) remove(path_tmp);
+}
+
+typedef struct {
+    char     name[20];
+    uint32_t sequence;
+} http_cache_entry_t;
+
+static void http_cache_trim(void) {
+    http_cache_entry_t* entries = calloc(HTTP_CACHE_MAX_ENTRIES, sizeof(http_cache_entry_t));
+    DIR*                dir     = opendir(HTTP_CACHE_DIR);
+    if ((entries == NULL) || (dir == NULL)) {
+        free(entries);
+        if (dir != NULL) closedir(dir);
+        return;
+    }
+
+    // Entries beyond HTTP_CACHE_MAX_ENTRIES and unreadable files go right away, files being written (.tmp) are left alone
+    size_t         count = 0;
+    size_t         total = 0;
+    char           path[64];
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strchr(ent->d_name, '.') != NULL) continue;
+        snprintf(path, sizeof(path), HTTP_CACHE_DIR "/%s", ent->d_name);
+        http_cache_header_t header;
+        if ((!http_cache_read_header(path, &header)) || (strlen(ent->d_name) >= sizeof(entries[0].name)) || (count >= HTTP_CACHE_MAX_ENTRIES)) {
+            remove(path);
+            continue;
+        }
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", ent->d_name);
+        entries[count].sequence = header.sequence;
+        total += sizeof(header) + header.size;
+        count++;
+    }
+    closedir(dir);
+
+    // Then the oldest until the rest fits
+    while (total > HTTP_CACHE_MAX_SIZE) {
+        size_t oldest = 0;
+        for (size_t index = 1; index < count; index++) {
+            if (entries[index].sequence < entries[oldest].sequence) oldest = index;
+        }
+        snprintf(path, sizeof(path), HTTP_CACHE_DIR "/%s", entries[oldest].name);
+        struct stat st;
+        if (stat(path, &st) == 0) total = (total > (size_t) st.st_size) ? total - st.st_size : 0;
+        printf("Removing %s from the HTTP cache\r\n", path);
+        remove(path);
+        entries[oldest] = entries[--count];
+        if (count == 0) break;
+    }
+    free(entries);
+}
+
+static void http_cache_touch(const char* path, http_cache_header_t* header) {
+    FILE* fd = fopen(path, "r+b");
+    if (fd == NULL) return;
+    http_cache_stamp(header);
+    fwrite(header, sizeof(http_cache_header_t), 1, fd);
+    fclose(fd);
+}
+
+// Waits before retrying a download. Returns false if it is cancelled in the meantime, there's no point retrying then.
+static bool download_retry_wait(const volatile bool* cancel) {
+    printf("DL waiting to retry ...");
+    for (int waited = 0; waited < 5000; waited += 100) {
+        if ((cancel != NULL) && *cancel) return false;
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return (cancel == NULL) || (!*cancel);
+}
+
+// Outcome of a failed request: the server answered with an error, or wasn't reached (no connection, or it broke off)
+typedef enum { HTTP_CACHE_FAILED_SERVER, HTTP_CACHE_FAILED_OFFLINE, HTTP_CACHE_FAILED_TRANSFER } http_cache_failure_t;
+
+static bool _download_ram_cached(const char* url, uint8_t** ptr, size_t* size, bool cached, http_cache_header_t* header, const char* path,
+                                 http_cache_failure_t* failure) {
+    http_download_info_t info = {0};
+    info.buffer               = ptr;
+    if (cached) {
+        info.if_none_match     = (header->etag[0] != '\0') ? header->etag : NULL;
+        info.if_modified_since = (header->last_modified[0] != '\0') ? header->last_modified : NULL;
+    }
+
+    *ptr         = NULL;
+    bool success = http_perform(url, &info);
+    download_ram_finish(&info);
+    if (!success) {
+        if (info.status >= 400) {
+            *failure = HTTP_CACHE_FAILED_SERVER;
+        } else {
+            *failure = (info.connected || (info.status > 0)) ? HTTP_CACHE_FAILED_TRANSFER : HTTP_CACHE_FAILED_OFFLINE;
+        }
+        if (*ptr != NULL) free(*ptr);
+        *ptr = NULL;
+        return false;
+    }
+
+    if ((info.status == 304) && cached) {
+        // Still valid, serve the local copy
+        if (*ptr != NULL) free(*ptr);
+        *ptr = NULL;
+        printf("Not modified, using cached copy of %s\r\n", url);
+        if (!http_cache_read(path, url, header, ptr)) return false;
+        http_cache_touch(path, header);
+        if (size != NULL) *size = header->size;
+        return true;
+    }
+
+    if (size != NULL) *size = info.used;
+
+    // Large responses would push everything else out
+    if ((info.status == 200) && (strlen(url) < sizeof(header->url)) && (info.used <= HTTP_CACHE_MAX_SIZE / 4)) {
+        http_cache_header_t new_header = {.magic = HTTP_CACHE_MAGIC, .size = info.used};
+        http_cache_stamp(&new_header);
+        snprintf(new_header.url, sizeof(new_header.url), "%s", url);
+        snprintf(new_header.etag, sizeof(new_header.etag), "%s", info.etag);
+        snprintf(new_header.last_modified, sizeof(new_header.last_modified), "%s", info.last_modified);
+        http_cache_write(path, &new_header, *ptr);
+        http_cache_trim();
+    }
+    return true;
+}
+
+bool download_ram_cached(const char* url, uint8_t** ptr, size_t* size, uint32_t max_age) {
+    char                path[64];
+    http_cache_header_t header;
+    http_cache_load();
+    http_cache_path(url, path, sizeof(path));
+    bool cached = http_cache_read(path, url, &header, NULL);
+
+    // Fresh enough to use without asking the server
+    if (cached && (http_cache_boot != 0) && (header.boot == http_cache_boot) && ((http_cache_uptime() - header.stored) < max_age)) {
+        if (http_cache_read(path, url, &header, ptr)) {
+            if (size != NULL) *size = header.size;
+            return true;
+        }
+        cached = false;
+    }
+
+    // Only a transfer that broke off is worth retrying, and only when there's no copy to fall back on: without a connection to the server
+    // retrying just keeps the caller waiting
+    http_cache_failure_t failure = HTTP_CACHE_FAILED_OFFLINE;
+    int                  retry   = 3;
     while (retry--) {
-        if (_download_file(url, path)) return true;
-        printf("DL waiting to retry ...");
-        vTaskDelay(pdMS_TO_TICKS(5000));
+        if (_download_ram_cached(url, ptr, size, cached, &header, path, &failure)) return true;
+        if (cached || (failure != HTTP_CACHE_FAILED_TRANSFER) || (retry == 0) || (!download_retry_wait(NULL))) break;
+    }
+
+    // Server unreachable, a stale copy beats nothing. An error response from the server means the copy is no longer valid.
+    if (cached && (failure != HTTP_CACHE_FAILED_SERVER) && http_cache_read(path, url, &header, ptr)) {
+        printf("Using stale cached copy of %s\r\n", url);
+        if (size != NULL) *size = header.size;
+        return true;
     }
     return false;
 }
 
-static bool _download_ram(const char* url, uint8_t** ptr, size_t* size) {
-    http_download_info_t info       = {0};
-    info.buffer                     = ptr;
-    esp_http_client_config_t config = {
-        .url = url, .use_global_ca_store = true, .keep_alive_enable = true, .timeout_ms = 10000, .user_data = (void*) &info, .event_handler = _event_handler};
-    esp_http_client_handle_t client  = esp_http_client_init(&config);
-    esp_err_t                err     = esp_http_client_perform(client);
-    bool                     success = download_success(err, &info);
-    if (success && (size != NULL)) *size = info.size;
+// Parallel downloads: each transfer needs a worker stack, a TLS session and HTTP buffers, all in internal RAM
+#define DOWNLOAD_MAX_WORKERS   HTTP_POOL_SIZE
+#define DOWNLOAD_WORKER_STACK  8192
+#define DOWNLOAD_WORKER_MEMORY (48 * 1024)
+
+typedef struct {
+    download_job_t* job;  // Job that finished, NULL when the worker exits
+} download_result_t;
+
+typedef struct {
+    QueueHandle_t jobs;     // Jobs waiting for a worker
+    QueueHandle_t results;  // Finished jobs, handled by the calling task
+    volatile bool abort;    // Set on failure or when stopped, workers stop their downloads and don't pick up new jobs
+} download_workers_t;
+
+static void download_worker_task(void* arg) {
+    download_workers_t* workers = (download_workers_t*) arg;
+    download_result_t   result;
+    while ((!workers->abort) && (xQueueReceive(workers->jobs, &result.job, 0) == pdTRUE)) {
+        printf("Downloading file: %s\r\n", result.job->path);
+        result.job->success = download_file_verified(result.job->url, result.job->path, result.job->sha256, &workers->abort);
+        xQueueSend(workers->results, &result, portMAX_DELAY);
+    }
+    result.job = NULL;
+    xQueueSend(workers->results, &result, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+bool download_files(download_job_t* jobs, size_t count, download_progress_t progress, void* ctx, const volatile bool* cancel) {
+    if (count == 0) return true;
+
+    // As many workers as there's memory for, at least one
+    size_t amount = heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / DOWNLOAD_WORKER_MEMORY;
+    if (amount > DOWNLOAD_MAX_WORKERS) amount = DOWNLOAD_MAX_WORKERS;
+    if (amount > count) amount = count;
+    if (amount < 1) amount = 1;
+
+    download_workers_t workers = {
+        .jobs = xQueueCreate(count, sizeof(download_job_t*)), .results = xQueueCreate(count + amount, sizeof(download_result_t)), .abort = false};
+    if ((workers.jobs == NULL) || (workers.results == NULL)) {
+        if (workers.jobs != NULL) vQueueDelete(workers.jobs);
+        if (workers.results != NULL) vQueueDelete(workers.results);
+        return false;
+    }
+
+    for (size_t index = 0; index < count; index++) {
+        download_job_t* job = &jobs[index];
+        job->success        = false;
+        xQueueSend(workers.jobs, &job, 0);
+    }
+
+    size_t started = 0;
+    for (; started < amount; started++) {
+        if (xTaskCreate(download_worker_task, "download", DOWNLOAD_WORKER_STACK, &workers, uxTaskPriorityGet(NULL), NULL) != pdPASS) break;
+    }
+    printf("Downloading %u files using %u workers\r\n", count, started);
+    if (started == 0) {
+        vQueueDelete(workers.jobs);
+        vQueueDelete(workers.results);
+        return false;
+    }
+
+    // Report progress until all workers are done
+    size_t completed = 0;
+    bool   success   = true;
+    while (started > 0) {
+        download_result_t result;
+        if (xQueueReceive(workers.results, &result, pdMS_TO_TICKS(100)) != pdTRUE) {
+            // Cancelled, stop the downloads that are running too
+            if ((cancel != NULL) && *cancel) {
+                workers.abort = true;
+                success       = false;
+            }
+            continue;
+        }
+        if (result.job == NULL) {
+            started--;
+            continue;
+        }
+        if (!result.job->success) {
+            ESP_LOGE(TAG, "Failed to download %s to %s", result.job->url, result.job->path);
+            workers.abort = true;
+            success       = false;
+        } else {
+            completed++;
+        }
+        if ((progress != NULL) && (!progress(ctx, result.job, completed, count))) {
+            workers.abort = true;
+            success       = false;
+        }
+    }
+
+    vQueueDelete(workers.jobs);
+    vQueueDelete(workers.results);
+    return success && (completed == count);
+}
+
+void download_close_connections(void) {
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        taskENTER_CRITICAL(&http_pool_lock);
+        bool idle = !http_pool[i].in_use;
+        if (idle) http_pool[i].in_use = true;
+        taskEXIT_CRITICAL(&http_pool_lock);
+        if (!idle) continue;
+        if (http_pool[i].client != NULL) esp_http_client_cleanup(http_pool[i].client);
+        http_pool[i].client = NULL;
+        taskENTER_CRITICAL(&http_pool_lock);
+        http_pool[i].in_use = false;
+        taskEXIT_CRITICAL(&http_pool_lock);
+    }
+}
+
+static void download_resume_prepare(http_download_resume_t* resume, http_download_info_t* info) {
+    // Resuming needs a validator to make sure the data received before is still current
+    info->hash = resume->hash;
+    if ((resume->offset > 0) && (resume->validator[0] != '\0')) {
+        printf("Resuming download at %u bytes\r\n", resume->offset);
+        info->offset   = resume->offset;
+        info->if_range = resume->validator;
+    } else {
+        download_hash_start(info);
+    }
+}
+
+static void download_resume_update(http_download_resume_t* resume, http_download_info_t* info) {
+    if ((info->offset > 0) && (info->status >= 400) && (info->status < 500)) {
+        // Range refused, for instance with 416 when the previous attempt had received everything already: start over
+        printf("Can't resume (status %d), downloading from the start next time\r\n", info->status);
+        resume->offset       = 0;
+        resume->validator[0] = '\0';
+        return;
+    }
+    resume->offset = info->offset + info->received;
+    // Weak ETags can't be used with If-Range
+    if ((info->etag[0] != '\0') && (strncmp(info->etag, "W/", 2) != 0)) {
+        snprintf(resume->validator, sizeof(resume->validator), "%s", info->etag);
+    } else if (info->last_modified[0] != '\0') {
+        snprintf(resume->validator, sizeof(resume->validator), "%s", info->last_modified);
+    } else if (info->received > 0) {
+        resume->validator[0] = '\0';
+    }
+}
+
+static bool download_verify(http_download_resume_t* resume, const char* sha256) {
+    // Compare the hash of the complete download with the expected one (hex)
+    uint8_t digest[32];
+    char    hex[sizeof(digest) * 2 + 1];
+    mbedtls_sha256_finish_ret(resume->hash, digest);
+    for (size_t index = 0; index < sizeof(digest); index++) sprintf(&hex[index * 2], "%02x", digest[index]);
+    if (strcasecmp(hex, sha256) == 0) return true;
+    ESP_LOGE(TAG, "SHA-256 mismatch: got %s, expected %s", hex, sha256);
+    // Corrupt, start over instead of resuming
+    resume->offset       = 0;
+    resume->validator[0] = '\0';
+    return false;
+}
+
+static bool _download_file(const char* url, const char* path, const char* sha256, http_download_resume_t* resume, const volatile bool* cancel) {
+    http_download_info_t info = {0};
+    info.cancel               = cancel;
+    download_resume_prepare(resume, &info);
+
+    // Keep what was received before when resuming
+    FILE* fd = fopen(path, (info.offset > 0) ? "r+" : "w");
+    if ((fd != NULL) && (info.offset > 0)) {
+        fflush(fd);
+        if ((ftruncate(fileno(fd), info.offset) != 0) || (fseek(fd, info.offset, SEEK_SET) != 0)) {
+            fclose(fd);
+            fd          = NULL;
+            info.offset = 0;
+            download_hash_start(&info);
+        }
+    }
+    if (fd == NULL) fd = fopen(path, "w");
+    if (fd == NULL) {
+        ESP_LOGE(TAG, "Failed to open file");
+        return false;
+    }
+    info.fd = fd;
+
+    bool success = http_perform(url, &info);
+    fclose(fd);
+    download_resume_update(resume, &info);
+    if (success && (sha256 != NULL)) success = download_verify(resume, sha256);
+    return success;
+}
+
+bool download_file_verified(const char* url, const char* path, const char* sha256, const volatile bool* cancel) {
+    mbedtls_sha256_context hash;
+    http_download_resume_t resume = {.hash = (sha256 != NULL) ? &hash : NULL};
+    mbedtls_sha256_init(&hash);
+    bool success = false;
+    int  retry   = 3;
+    while (retry--) {
+        success = _download_file(url, path, sha256, &resume, cancel);
+        if (success || (retry == 0) || (!download_retry_wait(cancel))) break;
+    }
+    mbedtls_sha256_free(&hash);
+    // Don't leave corrupt files behind
+    if ((!success) && (sha256 != NULL)) remove(path);
+    return success;
+}
+
+bool download_file(const char* url, const char* path) { return download_file_verified(url, path, NULL, NULL); }
+
+static bool _download_ram(const char* url, uint8_t** ptr, size_t* size, const volatile bool* cancel) {
+    http_download_info_t info = {0};
+    info.buffer               = ptr;
+    info.cancel               = cancel;
+    *ptr                      = NULL;
+    bool success              = http_perform(url, &info);
+    download_ram_finish(&info);
+    if ((!success) && (*ptr != NULL)) {
+        free(*ptr);
+        *ptr = NULL;
+    }
+    if (success && (size != NULL)) *size = info.used;
     printf("Buffer: %p -> %p\r\n", ptr, *ptr);
-    esp_http_client_cleanup(client);
     return success;
 }
 
 bool download_ram(const char* url, uint8_t** ptr, size_t* size) {
     int retry = 3;
     while (retry--) {
-        if (_download_ram(url, ptr, size)) return true;
-        printf("DL waiting to retry ...");
-        vTaskDelay(pdMS_TO_TICKS(5000));
+        if (_download_ram(url, ptr, size, NULL)) return true;
+        if ((retry == 0) || (!download_retry_wait(NULL))) break;
     }
     return false;
 }
+
+bool download_ram_cancellable(const char* url, uint8_t** ptr, size_t* size, const volatile bool* cancel) {
+    if (*cancel) return false;
+    return _download_ram(url, ptr, size, cancel);
+}
+
+static bool _download_stream(const char* url, download_callback_t callback, void* ctx, const char* sha256, http_download_resume_t* resume,
+                             const volatile bool* cancel) {
+    http_download_info_t info = {0};
+    info.callback             = callback;
+    info.callback_ctx         = ctx;
+    info.cancel               = cancel;
+    download_resume_prepare(resume, &info);
+    bool success = http_perform(url, &info);
+    download_resume_update(resume, &info);
+    if (success && (sha256 != NULL)) success = download_verify(resume, sha256);
+    return success;
+}
+
+bool download_stream_verified(const char* url, download_callback_t callback, void* ctx, const char* sha256, const volatile bool* cancel) {
+    mbedtls_sha256_context hash;
+    http_download_resume_t resume = {.hash = (sha256 != NULL) ? &hash : NULL};
+    mbedtls_sha256_init(&hash);
+    bool success = false;
+    int  retry   = 3;
+    while (retry--) {
+        success = _download_stream(url, callback, ctx, sha256, &resume, cancel);
+        if (success || (retry == 0) || (!download_retry_wait(cancel))) break;
+    }
+    mbedtls_sha256_free(&hash);
+    return success;
+}
+
+bool download_stream(const char* url, download_callback_t callback, void* ctx) { return download_stream_verified(url, callback, ctx, NULL, NULL); }
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _installed_app {
+    char* type;               // From the metadata of the installed app
+    char* category;
+    char* slug;
+    int   installed_version;
+    int   available_version;  // Version in the category listing, -1 if not known from there
+    bool  listed;             // Category listing has been checked
+    bool  sdcard;             // App is installed on the SD card
+} installed_app_t;
+
+// Marks the apps from index on that are in the same type and category as apps[index]: one listing covers all of them, whether or not it
+// can be fetched
+void app_listing_mark(installed_app_t* apps, size_t amount, size_t index);
+
+// Takes the available versions of the apps from index on in the same type and category as apps[index] from the listing of that category
+// (JSON array of objects with "slug" and "version"). Apps missing from the listing keep their available version. Returns false if the
+// listing isn't valid JSON, versions found before the error are kept.
+bool app_listing_apply(installed_app_t* apps, size_t amount, size_t index, const char* data, size_t size);
@@ -7,3 +7,13 @@
 
 bool create_dir(const char* path);
 bool install_app(xQueueHandle button_queue, const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info, cJSON* json_app_info);
+
+typedef enum { INSTALL_STAGE_DOWNLOADING, INSTALL_STAGE_VERIFYING } install_stage_t;
+
+// Called from the installing task as the installation progresses, completed and total count the files of the app
+typedef void (*install_progress_t)(void* ctx, install_stage_t stage, size_t completed, size_t total);
+
+// Like install_app, without using the display or the buttons (for installing from a background task), parsing the metadata itself. Setting
+// cancel stops the installation at the next file or block of data.
+bool install_app_background(const char* type_slug, bool to_sd_card, char* data_app_info, size_t size_app_info, install_progress_t progress, void* ctx,
+                            const volatile bool* cancel);
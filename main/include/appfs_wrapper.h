@@ -11,3 +11,14 @@ appfs_handle_t appfs_detect_crash();
 void           appfs_boot_app(int fd);
 void           appfs_store_app(xQueueHandle button_queue, const char* path, const char* name, const char* title, uint16_t version);
 esp_err_t      appfs_store_in_memory_app(xQueueHandle button_queue, const char* name, const char* title, uint16_t version, size_t app_size, uint8_t* app);
+
+// Incremental writer, erases flash just ahead of the data as it comes in
+typedef struct {
+    appfs_handle_t handle;
+    size_t         size;
+    size_t         erased;
+    size_t         written;
+} appfs_writer_t;
+
+esp_err_t appfs_writer_create(appfs_writer_t* writer, const char* name, const char* title, uint16_t version, size_t size);
+esp_err_t appfs_writer_write(appfs_writer_t* writer, const uint8_t* data, size_t length);
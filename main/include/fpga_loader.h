@@ -0,0 +1,35 @@
+/*
+ * fpga_loader.h
+ *
+ * Streaming bitstream loader for the iCE40
+ */
+
+#pragma once
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ice40.h"
+
+/* Compressed bitstream container, detected automatically by the loader:
+ *
+ *   "ICEZ"            magic
+ *   uint32_t (LE)     uncompressed length
+ *   ...               zlib stream of the bitstream
+ *
+ * The inflate dictionary is sized from the zlib window, so compressing
+ * with a small window (tools/compress_bitstream.py uses 4 KiB) keeps
+ * the RAM needed for loading low. */
+#define FPGA_LOADER_Z_MAGIC   "ICEZ"
+#define FPGA_LOADER_Z_HDR_LEN 8
+
+/* Source callback: fill `buf` with up to `len` bytes of bitstream.
+ * Returns the number of bytes read, 0 at the end of the bitstream or
+ * a negative value on error. Called from the loader's reader task. */
+typedef int (*fpga_loader_read_t)(void *ctx, uint8_t *buf, size_t len);
+
+esp_err_t fpga_loader_load(ICE40 *ice40, fpga_loader_read_t read, void *ctx);
+esp_err_t fpga_loader_load_file(ICE40 *ice40, FILE *fd);
+esp_err_t fpga_loader_load_memory(ICE40 *ice40, const uint8_t *data, size_t len);
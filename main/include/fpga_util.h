@@ -24,12 +24,15 @@
 #define SPI_CMD_BUTTON_REPORT   0xf4
 #define SPI_CMD_FREAD_GET       0xf8
 #define SPI_CMD_FREAD_PUT       0xf9
+#define SPI_CMD_FWRITE_GET      0xfa
+#define SPI_CMD_FWRITE_DATA     0xfb
 #define SPI_CMD_IRQ_ACK         0xfd
 #define SPI_CMD_RESP_ACK        0xfe
 #define SPI_CMD_NOP2            0xff
 
 /* Request bits */
-#define SPI_REQ_FREAD (1 << 0)
+#define SPI_REQ_FREAD  (1 << 0)
+#define SPI_REQ_FWRITE (1 << 1)
 
 /* FPGA IRQ --------------------------------------------------------------- */
 
@@ -37,12 +40,38 @@ esp_err_t fpga_irq_setup(ICE40 *ice40);
 void      fpga_irq_cleanup(ICE40 *ice40);
 bool      fpga_irq_wait(TickType_t wait);
 
+/* Statistics ------------------------------------------------------------- */
+
+/* Counters for the SPI traffic generated by this module, to measure the
+ * effect of changes on real gateware. Not synchronized, so approximate if
+ * several tasks use the bridge concurrently. Times are in microseconds. */
+struct fpga_stats {
+    uint32_t wb_exec;           // Wishbone command buffers executed
+    uint32_t wb_reads;          // Wishbone reads returned
+    uint64_t wb_bytes;          // Wishbone bytes on the SPI bus
+    uint64_t wb_us;             // Time spent executing command buffers
+    uint32_t btn_events;        // Button events forwarded
+    uint32_t btn_msgs;          // Button SPI messages sent
+    uint32_t fread;             // Read requests served
+    uint32_t fread_prefetched;  // Read requests served from read-ahead
+    uint64_t fread_bytes;       // Bytes sent for read requests
+    uint32_t fwrite;            // Write requests served
+    uint64_t fwrite_bytes;      // Bytes received for write requests
+    uint64_t req_us;            // Time spent serving requests
+};
+
+void fpga_stats_get(struct fpga_stats *stats);
+void fpga_stats_reset(void);
+
 /* Wishbone bridge -------------------------------------------------------- */
 
 struct fpga_wb_cmdbuf;
 
+typedef void (*fpga_wb_done_cb_t)(struct fpga_wb_cmdbuf *cb, bool ok, void *arg);
+
 struct fpga_wb_cmdbuf *fpga_wb_alloc(int n);
 void                   fpga_wb_free(struct fpga_wb_cmdbuf *cb);
+void                   fpga_wb_reset(struct fpga_wb_cmdbuf *cb);
 
 bool fpga_wb_queue_write(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr, uint32_t val);
 bool fpga_wb_queue_read(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr, uint32_t *val);
@@ -51,17 +80,67 @@ bool fpga_wb_queue_read_burst(struct fpga_wb_cmdbuf *cb, int dev, uint32_t addr,
 
 bool fpga_wb_exec(struct fpga_wb_cmdbuf *cb, ICE40 *ice40);
 
+/* Asynchronous execution: command buffers are executed in submission
+ * order by a dedicated task. Completion is reported through `done_cb`
+ * (called from that task, which then owns the buffer) or, without a
+ * callback, by waiting with fpga_wb_wait. Don't call fpga_wb_exec
+ * directly while submitted buffers are still pending. The task is
+ * stopped by fpga_wb_async_stop, which fpga_req_cleanup and
+ * fpga_irq_cleanup call when the bitstream goes away. */
+esp_err_t fpga_wb_async_start(ICE40 *ice40);
+void      fpga_wb_async_stop(void);
+bool      fpga_wb_submit(struct fpga_wb_cmdbuf *cb, fpga_wb_done_cb_t done_cb, void *arg);
+bool      fpga_wb_wait(struct fpga_wb_cmdbuf *cb, TickType_t wait);
+
+/* Bursts of any length, split over several command buffers executed by
+ * the asynchronous task (started if needed), in order with the buffers
+ * submitted before. The next buffer is built while the previous one is
+ * being executed. Returns false as soon as a buffer fails. */
+bool fpga_wb_bulk_write(ICE40 *ice40, int dev, uint32_t addr, const uint32_t *val, size_t n, bool inc);
+bool fpga_wb_bulk_read(ICE40 *ice40, int dev, uint32_t addr, uint32_t *val, size_t n, bool inc);
+
 /* Button reports --------------------------------------------------------- */
 
+/* All queued events are forwarded at once, merged into as few
+ * SPI_CMD_BUTTON_REPORT messages as possible (new state + mask of changed
+ * buttons, split only when a button changes twice). */
 void fpga_btn_reset(void);
 bool fpga_btn_forward_events(ICE40 *ice40, xQueueHandle buttonQueue, esp_err_t *err);
 
 /* Request processing ----------------------------------------------------- */
 
+/* Every bitstream talking to the host must be served between a setup and
+ * a cleanup call: cleanup commits pending writes and closes the files. */
 void fpga_req_setup(void);
 void fpga_req_cleanup(void);
+
+/* To be called when another bitstream gets loaded without a cleanup in
+ * between. Files opened on demand and remembered misses are dropped, the
+ * registered aliases and data blocks are kept. */
+void fpga_req_new_bitstream(void);
+
+/* `path` is either a file path, "appfs:<name>" for an AppFS entry or
+ * "partition:<label>" for a data partition. Flash aliases are memory
+ * mapped and served without going through the filesystem. */
 int  fpga_req_add_file_alias(uint32_t fid, const char *path);
 int  fpga_req_add_file_data(uint32_t fid, void *data, size_t len);
 void fpga_req_del_file(uint32_t fid);
 
+/* Files are opened for writing on the first write request, a missing
+ * file is created then (never truncated if it appeared since). Writes
+ * are buffered per file and coalesced when contiguous. This sets when
+ * they are committed to storage, only files written to are synced:
+ *  - EACH:   after every write request
+ *  - IDLE:   once the FPGA stopped writing for a while (default)
+ *  - MANUAL: only on fpga_req_flush(), fpga_req_cleanup() or when the
+ *            buffer fills up */
+enum fpga_req_flush_policy {
+    FPGA_REQ_FLUSH_EACH,
+    FPGA_REQ_FLUSH_IDLE,
+    FPGA_REQ_FLUSH_MANUAL,
+};
+
+void fpga_req_set_flush_policy(enum fpga_req_flush_policy policy);
+void fpga_req_flush(void);
+
 bool fpga_req_process(const char *prefix, ICE40 *ice40, TickType_t wait, esp_err_t *err);
@@ -4,4 +4,43 @@
 #include <stdint.h>
 
 bool download_file(const char* url, const char* path);
+
+// Like download_file, checking the SHA-256 of the data (hex string, hashed as it comes in) against the expected one. A corrupt download is
+// retried from the start and removed if it stays corrupt. Setting *cancel (optional) stops the download and the retries.
+bool download_file_verified(const char* url, const char* path, const char* sha256, const volatile bool* cancel);
+// Downloads to a buffer allocated for the purpose (free it when done), of the size in the content-length. Responses without a content-length
+// (chunked) and gzip compressed responses work too, up to 1 MiB.
 bool download_ram(const char* url, uint8_t** ptr, size_t* size);
+// Like download_ram, for downloads nobody waits for: a single attempt, stopped as soon as *cancel is set
+bool download_ram_cancellable(const char* url, uint8_t** ptr, size_t* size, const volatile bool* cancel);
+
+// Like download_ram, through a response cache on the internal filesystem. Cached responses younger than max_age seconds are used as they
+// are, older ones are revalidated with the server (If-None-Match / If-Modified-Since). When the server can't be reached the cached copy
+// is used whatever its age, without retrying; an error response from the server is not covered up by the cache.
+bool download_ram_cached(const char* url, uint8_t** ptr, size_t* size, uint32_t max_age);
+
+// Called for every block of data received. Size is the total size (0 if unknown) and offset the position of the data in the file. A retry
+// resumes where the previous attempt stopped if the server allows it, otherwise it starts over at offset 0. Returning false aborts the
+// download.
+typedef bool (*download_callback_t)(void* ctx, size_t size, size_t offset, const uint8_t* data, size_t length);
+
+bool download_stream(const char* url, download_callback_t callback, void* ctx);
+// Like download_stream, verifying the SHA-256 like download_file_verified does. Setting *cancel (optional) stops the download and the retries.
+bool download_stream_verified(const char* url, download_callback_t callback, void* ctx, const char* sha256, const volatile bool* cancel);
+
+typedef struct {
+    const char* url;      // Source
+    const char* path;     // Destination on the filesystem
+    const char* name;     // Name to show in progress messages
+    const char* sha256;   // Expected SHA-256 as hex string (optional)
+    bool        success;  // Set once the file has been downloaded
+} download_job_t;
+
+// Called from the calling task every time a file is done (or failed). Returning false stops the remaining downloads.
+typedef bool (*download_progress_t)(void* ctx, const download_job_t* job, size_t completed, size_t total);
+
+// Downloads a list of files, several at a time as far as memory allows. Stops at the first failure, or soon after *cancel (optional) is set.
+bool download_files(download_job_t* jobs, size_t count, download_progress_t progress, void* ctx, const volatile bool* cancel);
+
+// Downloads reuse connections to the same server, this closes the idle ones (call when done, before disabling WiFi)
+void download_close_connections(void);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pax_gfx.h"
+
+// App installations are queued and carried out one at a time by a background task, the menus stay usable in the meantime. Finished jobs
+// are kept (for showing their result) until their slot is needed for a new one.
+#define INSTALL_QUEUE_SIZE 8
+
+typedef enum {
+    INSTALL_JOB_QUEUED,
+    INSTALL_JOB_DOWNLOADING,
+    INSTALL_JOB_VERIFYING,
+    INSTALL_JOB_DONE,
+    INSTALL_JOB_FAILED,
+    INSTALL_JOB_CANCELLED
+} install_job_state_t;
+
+typedef struct {
+    uint32_t            id;
+    char                type_slug[16];
+    char                slug[48];
+    char                name[48];
+    install_job_state_t state;
+    size_t              completed;  // Files of the app installed so far
+    size_t              total;
+} install_job_status_t;
+
+// Creates the locks, call once at startup before anything else in here
+void install_queue_init(void);
+
+// Queues the installation of an app, data is its metadata as served by the hatchery (copied). Returns the id of the job, 0 if the queue is
+// full or the metadata is invalid.
+uint32_t install_queue_add(const char* type_slug, bool to_sd_card, const char* data, size_t size);
+// Cancels a queued or running job, returns false if it has finished already
+bool install_queue_cancel(uint32_t id);
+// Returns the id of the unfinished job installing the app, 0 if there is none
+uint32_t install_queue_find(const char* type_slug, const char* slug);
+// Copies the status of up to max jobs, oldest first, and returns the amount
+size_t install_queue_get_status(install_job_status_t* status, size_t max);
+// Changes every time the status of a job changes, for redrawing status indicators
+uint32_t install_queue_generation(void);
+// Changes every time an app has been installed, for reloading lists of installed apps
+uint32_t install_queue_installed(void);
+// Returns true while jobs are queued or running
+bool install_queue_busy(void);
+
+// Short description of the running job, or of the last finished one for a few seconds. Returns false if there is nothing to show.
+bool install_queue_summary(char* buffer, size_t size);
+// Draws the summary right aligned, ending at x
+void install_queue_render_status(pax_buf_t* pax_buffer, pax_col_t color, float x, float y);
+
+// WiFi is shared between the install queue, the menus and everything else using the network, none of them switches it on or off directly.
+// Taking the network connects unless it is up already, and returns false if connecting failed. Releasing it disables WiFi once the last user
+// is done. Every successful take needs a release.
+bool install_queue_take_network(void);
+void install_queue_release_network(void);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming (SAX style) JSON parser: the document is fed in blocks of any size, values are handed to a callback as they are parsed and nothing
+// is kept afterwards. The buffer for string values grows with the longest one seen, values longer than JSON_STREAM_VALUE_MAX are truncated.
+// Member names longer than JSON_STREAM_KEY_MAX are truncated as well.
+#define JSON_STREAM_KEY_MAX       32
+#define JSON_STREAM_VALUE_INITIAL 64
+#define JSON_STREAM_VALUE_MAX     (32 * 1024)
+#define JSON_STREAM_DEPTH_MAX     32
+
+typedef enum {
+    JSON_STREAM_OBJECT_START,
+    JSON_STREAM_OBJECT_END,
+    JSON_STREAM_ARRAY_START,
+    JSON_STREAM_ARRAY_END,
+    JSON_STREAM_STRING,
+    JSON_STREAM_NUMBER,
+    JSON_STREAM_TRUE,
+    JSON_STREAM_FALSE,
+    JSON_STREAM_NULL
+} json_stream_event_t;
+
+// Called for every value. Key is the member name if the value is part of an object (NULL otherwise), value the text of strings and numbers
+// (NULL for the other events). Depth is 0 for the document itself, 1 for its members or elements and so on. Returning false stops parsing.
+typedef bool (*json_stream_callback_t)(void* ctx, json_stream_event_t event, const char* key, const char* value, size_t depth);
+
+typedef struct {
+    json_stream_callback_t callback;
+    void*                  ctx;
+    uint8_t                state;
+    uint8_t                depth;
+    uint32_t               objects;      // Bit per nesting level, set if the container is an object
+    bool                   reading_key;  // String being read is a member name
+    bool                   has_key;      // Member name for the next value has been read
+    char                   key[JSON_STREAM_KEY_MAX];
+    char*                  value;        // String or literal being read (allocated as needed)
+    size_t                 capacity;     // Size of the value buffer
+    size_t                 length;       // Length of the string or literal being read
+    bool                   out_of_memory;
+    uint32_t               unicode;      // \uXXXX escape being read
+    uint8_t                digits;
+    uint32_t               surrogate;    // First half of a surrogate pair
+} json_stream_t;
+
+void json_stream_init(json_stream_t* stream, json_stream_callback_t callback, void* ctx);
+// Returns false on a syntax error or when the callback stopped parsing
+bool json_stream_feed(json_stream_t* stream, const char* data, size_t length);
+// Returns true if a complete document was parsed
+bool json_stream_finish(json_stream_t* stream);
+// Frees the value buffer, call when done with the stream (also after an error)
+void json_stream_free(json_stream_t* stream);
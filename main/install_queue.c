@@ -0,0 +1,321 @@
+#include "install_queue.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app_management.h"
+#include "http_download.h"
+#include "json_stream.h"
+#include "wifi_connect.h"
+
+static const char* TAG = "Install queue";
+
+#define INSTALL_QUEUE_STACK       8192
+#define INSTALL_QUEUE_RESULT_TIME 10000  // Milliseconds the result of the last job stays in the summary
+
+typedef struct {
+    install_job_status_t status;  // Empty slot if the id is 0
+    bool                 to_sd_card;
+    char*                data;  // App metadata, freed when the job finishes
+    size_t               size;
+    volatile bool        cancel;    // Checked by the installation between files and blocks of data
+    TickType_t           finished;  // When the job finished
+} install_job_t;
+
+static install_job_t     jobs[INSTALL_QUEUE_SIZE];
+static SemaphoreHandle_t queue_lock       = NULL;  // Protects the jobs and everything below
+static TaskHandle_t      queue_task       = NULL;  // Runs while there are jobs to do
+static uint32_t          queue_next_id    = 1;
+static uint32_t          queue_generation = 0;
+static uint32_t          queue_installed  = 0;
+
+// Held while connecting or disconnecting, so that counting the users of the network and switching WiFi on or off happen as one step
+static SemaphoreHandle_t network_lock  = NULL;
+static size_t            network_users = 0;
+static bool              network_up    = false;
+
+void install_queue_init(void) {
+    queue_lock   = xSemaphoreCreateMutex();
+    network_lock = xSemaphoreCreateMutex();
+    if ((queue_lock == NULL) || (network_lock == NULL)) ESP_LOGE(TAG, "Failed to create locks");
+}
+
+static bool install_queue_job_finished(install_job_t* job) { return job->status.state >= INSTALL_JOB_DONE; }
+
+static void install_queue_job_finish(install_job_t* job, install_job_state_t state) {
+    job->status.state = state;
+    job->finished     = xTaskGetTickCount();
+    free(job->data);
+    job->data = NULL;
+    if (state == INSTALL_JOB_DONE) queue_installed++;
+    queue_generation++;
+}
+
+static void install_queue_progress(void* ctx, install_stage_t stage, size_t completed, size_t total) {
+    install_job_t* job = (install_job_t*) ctx;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    job->status.state     = (stage == INSTALL_STAGE_VERIFYING) ? INSTALL_JOB_VERIFYING : INSTALL_JOB_DOWNLOADING;
+    job->status.completed = completed;
+    job->status.total     = total;
+    queue_generation++;
+    xSemaphoreGive(queue_lock);
+}
+
+static void install_queue_task(void* arg) {
+    bool network = false;  // This task is one of the users of the network
+    while (true) {
+        // Oldest job waiting
+        xSemaphoreTake(queue_lock, portMAX_DELAY);
+        install_job_t* job = NULL;
+        for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+            if ((jobs[index].status.id == 0) || (jobs[index].status.state != INSTALL_JOB_QUEUED)) continue;
+            if ((job == NULL) || (jobs[index].status.id < job->status.id)) job = &jobs[index];
+        }
+        if (job == NULL) {
+            // A job queued from here on starts a new task, which takes the network for itself
+            queue_task = NULL;
+            xSemaphoreGive(queue_lock);
+            break;
+        }
+        job->status.state = INSTALL_JOB_DOWNLOADING;
+        queue_generation++;
+        xSemaphoreGive(queue_lock);
+
+        // The slot stays with this task until the job is marked as finished
+        printf("Installing %s/%s\r\n", job->status.type_slug, job->status.slug);
+        bool success = false;
+        if (!network) network = install_queue_take_network();
+        if (!network) {
+            ESP_LOGE(TAG, "Unable to connect to the WiFi network");
+        } else {
+            success = install_app_background(job->status.type_slug, job->to_sd_card, job->data, job->size, install_queue_progress, job, &job->cancel);
+        }
+
+        xSemaphoreTake(queue_lock, portMAX_DELAY);
+        ESP_LOGI(TAG, "Installation of %s %s", job->status.slug, success ? "done" : (job->cancel ? "cancelled" : "failed"));
+        install_queue_job_finish(job, success ? INSTALL_JOB_DONE : (job->cancel ? INSTALL_JOB_CANCELLED : INSTALL_JOB_FAILED));
+        xSemaphoreGive(queue_lock);
+    }
+    if (network) install_queue_release_network();
+    vTaskDelete(NULL);
+}
+
+static bool install_queue_metadata_callback(void* ctx, json_stream_event_t event, const char* key, const char* value, size_t depth) {
+    install_job_status_t* status = (install_job_status_t*) ctx;
+    if ((event != JSON_STREAM_STRING) || (depth != 1) || (key == NULL)) return true;
+    if (strcmp(key, "slug") == 0) snprintf(status->slug, sizeof(status->slug), "%s", value);
+    if (strcmp(key, "name") == 0) snprintf(status->name, sizeof(status->name), "%s", value);
+    return true;
+}
+
+uint32_t install_queue_add(const char* type_slug, bool to_sd_card, const char* data, size_t size) {
+    // Slug and name for the status, refusing metadata the installation would choke on
+    install_job_status_t status = {.state = INSTALL_JOB_QUEUED};
+    json_stream_t        stream;
+    json_stream_init(&stream, install_queue_metadata_callback, &status);
+    bool valid = json_stream_feed(&stream, data, size) && json_stream_finish(&stream) && (status.slug[0] != '\0') && (status.name[0] != '\0');
+    json_stream_free(&stream);
+    snprintf(status.type_slug, sizeof(status.type_slug), "%s", type_slug);
+    if (!valid) {
+        ESP_LOGE(TAG, "Invalid app metadata");
+        return 0;
+    }
+
+    if (queue_lock == NULL) return 0;
+    char* copy = malloc(size);
+    if (copy == NULL) return 0;
+    memcpy(copy, data, size);
+
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    // Empty slot, or the slot of the oldest finished job
+    install_job_t* job = NULL;
+    for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+        if (jobs[index].status.id == 0) {
+            job = &jobs[index];
+            break;
+        }
+        if (install_queue_job_finished(&jobs[index]) && ((job == NULL) || (jobs[index].status.id < job->status.id))) job = &jobs[index];
+    }
+    uint32_t id = 0;
+    if (job != NULL) {
+        status.id       = queue_next_id++;
+        job->status     = status;
+        job->to_sd_card = to_sd_card;
+        job->data       = copy;
+        job->size       = size;
+        job->cancel     = false;
+        copy            = NULL;
+        id              = status.id;
+        queue_generation++;
+        if ((queue_task == NULL) && (xTaskCreate(install_queue_task, "install", INSTALL_QUEUE_STACK, NULL, tskIDLE_PRIORITY + 1, &queue_task) != pdPASS)) {
+            queue_task = NULL;
+            free(job->data);
+            memset(job, 0, sizeof(install_job_t));
+            id = 0;
+        }
+    }
+    xSemaphoreGive(queue_lock);
+    free(copy);
+
+    if (id == 0) ESP_LOGE(TAG, "Failed to queue installation of %s", status.slug);
+    return id;
+}
+
+bool install_queue_cancel(uint32_t id) {
+    if (queue_lock == NULL) return false;
+    bool found = false;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+        install_job_t* job = &jobs[index];
+        if ((id == 0) || (job->status.id != id) || install_queue_job_finished(job)) continue;
+        if (job->status.state == INSTALL_JOB_QUEUED) {
+            install_queue_job_finish(job, INSTALL_JOB_CANCELLED);
+        } else {
+            job->cancel = true;  // The task marks the job as cancelled once the installation stopped
+            queue_generation++;
+        }
+        found = true;
+    }
+    xSemaphoreGive(queue_lock);
+    return found;
+}
+
+uint32_t install_queue_find(const char* type_slug, const char* slug) {
+    if (queue_lock == NULL) return 0;
+    uint32_t id = 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+        install_job_t* job = &jobs[index];
+        if ((job->status.id == 0) || install_queue_job_finished(job)) continue;
+        if ((strcmp(job->status.type_slug, type_slug) == 0) && (strcmp(job->status.slug, slug) == 0)) id = job->status.id;
+    }
+    xSemaphoreGive(queue_lock);
+    return id;
+}
+
+size_t install_queue_get_status(install_job_status_t* status, size_t max) {
+    if (queue_lock == NULL) return 0;
+    size_t   amount = 0;
+    uint32_t last   = 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    while (amount < max) {
+        // Next job in order of id
+        install_job_t* next = NULL;
+        for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+            if (jobs[index].status.id <= last) continue;
+            if ((next == NULL) || (jobs[index].status.id < next->status.id)) next = &jobs[index];
+        }
+        if (next == NULL) break;
+        status[amount++] = next->status;
+        last             = next->status.id;
+    }
+    xSemaphoreGive(queue_lock);
+    return amount;
+}
+
+uint32_t install_queue_generation(void) {
+    if (queue_lock == NULL) return 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    uint32_t generation = queue_generation;
+    xSemaphoreGive(queue_lock);
+    return generation;
+}
+
+uint32_t install_queue_installed(void) {
+    if (queue_lock == NULL) return 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    uint32_t installed = queue_installed;
+    xSemaphoreGive(queue_lock);
+    return installed;
+}
+
+bool install_queue_busy(void) {
+    if (queue_lock == NULL) return false;
+    bool busy = false;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+        if ((jobs[index].status.id != 0) && (!install_queue_job_finished(&jobs[index]))) busy = true;
+    }
+    xSemaphoreGive(queue_lock);
+    return busy;
+}
+
+bool install_queue_summary(char* buffer, size_t size) {
+    if (queue_lock == NULL) return false;
+    install_job_t* active = NULL;
+    install_job_t* last   = NULL;
+    size_t         queued = 0;
+    bool           show   = true;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (size_t index = 0; index < INSTALL_QUEUE_SIZE; index++) {
+        install_job_t* job = &jobs[index];
+        if (job->status.id == 0) continue;
+        if (job->status.state == INSTALL_JOB_QUEUED) {
+            queued++;
+        } else if (!install_queue_job_finished(job)) {
+            active = job;
+        } else if ((last == NULL) || ((int32_t) (job->finished - last->finished) > 0)) {
+            last = job;
+        }
+    }
+    if (active != NULL) {
+        // Names are cut short to fit next to the title of a menu
+        const char* action = (active->status.state == INSTALL_JOB_VERIFYING) ? "Verifying" : "Installing";
+        if (active->status.total > 0) {
+            snprintf(buffer, size, "%s %.16s %u/%u", action, active->status.name, active->status.completed, active->status.total);
+        } else {
+            snprintf(buffer, size, "%s %.16s", action, active->status.name);
+        }
+        size_t length = strlen(buffer);
+        if ((queued > 0) && (length < size)) snprintf(&buffer[length], size - length, " +%u", queued);
+    } else if (queued > 0) {
+        snprintf(buffer, size, "%u apps queued", queued);
+    } else if ((last != NULL) && ((xTaskGetTickCount() - last->finished) < pdMS_TO_TICKS(INSTALL_QUEUE_RESULT_TIME))) {
+        const char* result = (last->status.state == INSTALL_JOB_DONE) ? "Installed" : (last->status.state == INSTALL_JOB_CANCELLED) ? "Cancelled" : "Failed";
+        snprintf(buffer, size, "%s %.16s", result, last->status.name);
+    } else {
+        show = false;
+    }
+    xSemaphoreGive(queue_lock);
+    return show;
+}
+
+void install_queue_render_status(pax_buf_t* pax_buffer, pax_col_t color, float x, float y) {
+    char buffer[64];
+    if (!install_queue_summary(buffer, sizeof(buffer))) return;
+    const pax_font_t* font = pax_font_saira_regular;
+    pax_vec1_t        size = pax_text_size(font, 12, buffer);
+    pax_draw_text(pax_buffer, color, font, 12, x - size.x, y, buffer);
+}
+
+bool install_queue_take_network(void) {
+    if (network_lock == NULL) return false;
+    xSemaphoreTake(network_lock, portMAX_DELAY);
+    bool connected = network_up || wifi_connect_to_stored();
+    if (connected) {
+        network_up = true;
+        network_users++;
+    } else {
+        // Nobody else is using it, or it would have been up
+        wifi_disconnect_and_disable();
+    }
+    xSemaphoreGive(network_lock);
+    return connected;
+}
+
+void install_queue_release_network(void) {
+    if (network_lock == NULL) return;
+    xSemaphoreTake(network_lock, portMAX_DELAY);
+    if (network_users > 0) network_users--;
+    if ((network_users == 0) && network_up) {
+        download_close_connections();
+        wifi_disconnect_and_disable();
+        network_up = false;
+    }
+    xSemaphoreGive(network_lock);
+}
@@ -0,0 +1,284 @@
+#include "json_stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    JSON_STATE_VALUE,           // Expecting a value
+    JSON_STATE_VALUE_OR_END,    // Expecting the first element of an array or its end
+    JSON_STATE_KEY,             // Expecting a member name
+    JSON_STATE_KEY_OR_END,      // Expecting the first member name of an object or its end
+    JSON_STATE_COLON,           // Expecting the colon after a member name
+    JSON_STATE_AFTER_VALUE,     // Expecting a comma or the end of the container
+    JSON_STATE_STRING,          // Reading a string
+    JSON_STATE_ESCAPE,          // Reading the character after a backslash
+    JSON_STATE_UNICODE,         // Reading the digits of a \uXXXX escape
+    JSON_STATE_LITERAL,         // Reading a number, true, false or null
+    JSON_STATE_DONE,            // Document complete
+    JSON_STATE_ERROR
+};
+
+void json_stream_init(json_stream_t* stream, json_stream_callback_t callback, void* ctx) {
+    memset(stream, 0, sizeof(json_stream_t));
+    stream->callback = callback;
+    stream->ctx      = ctx;
+    stream->state    = JSON_STATE_VALUE;
+}
+
+static bool json_stream_emit(json_stream_t* stream, json_stream_event_t event, const char* value) {
+    const char* key = stream->has_key ? stream->key : NULL;
+    stream->has_key = false;
+    return stream->callback(stream->ctx, event, key, value, stream->depth);
+}
+
+static bool json_stream_reserve(json_stream_t* stream, size_t size) {
+    // Grows the value buffer to hold size bytes, up to JSON_STREAM_VALUE_MAX
+    if (size <= stream->capacity) return true;
+    size_t capacity = (stream->capacity > 0) ? stream->capacity : JSON_STREAM_VALUE_INITIAL;
+    while (capacity < size) capacity *= 2;
+    if (capacity > JSON_STREAM_VALUE_MAX) capacity = JSON_STREAM_VALUE_MAX;
+    if (size > capacity) return false;
+    char* value = realloc(stream->value, capacity);
+    if (value == NULL) {
+        stream->out_of_memory = true;
+        return false;
+    }
+    stream->value    = value;
+    stream->capacity = capacity;
+    return true;
+}
+
+static void json_stream_append(json_stream_t* stream, char c) {
+    // Keeps room for the terminator, truncates what doesn't fit in JSON_STREAM_VALUE_MAX
+    if (json_stream_reserve(stream, stream->length + 2)) stream->value[stream->length++] = c;
+}
+
+static bool json_stream_terminate(json_stream_t* stream) {
+    // Empty strings haven't needed the buffer yet
+    if (!json_stream_reserve(stream, stream->length + 1)) return false;
+    stream->value[stream->length] = '\0';
+    return true;
+}
+
+static void json_stream_append_utf8(json_stream_t* stream, uint32_t code) {
+    if (code < 0x80) {
+        json_stream_append(stream, code);
+    } else if (code < 0x800) {
+        json_stream_append(stream, 0xC0 | (code >> 6));
+        json_stream_append(stream, 0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        json_stream_append(stream, 0xE0 | (code >> 12));
+        json_stream_append(stream, 0x80 | ((code >> 6) & 0x3F));
+        json_stream_append(stream, 0x80 | (code & 0x3F));
+    } else {
+        json_stream_append(stream, 0xF0 | (code >> 18));
+        json_stream_append(stream, 0x80 | ((code >> 12) & 0x3F));
+        json_stream_append(stream, 0x80 | ((code >> 6) & 0x3F));
+        json_stream_append(stream, 0x80 | (code & 0x3F));
+    }
+}
+
+static bool json_stream_value_done(json_stream_t* stream) {
+    stream->state = (stream->depth == 0) ? JSON_STATE_DONE : JSON_STATE_AFTER_VALUE;
+    return true;
+}
+
+static bool json_stream_open(json_stream_t* stream, bool object) {
+    if (!json_stream_emit(stream, object ? JSON_STREAM_OBJECT_START : JSON_STREAM_ARRAY_START, NULL)) return false;
+    if (stream->depth >= JSON_STREAM_DEPTH_MAX) return false;
+    if (object) {
+        stream->objects |= (1UL << stream->depth);
+    } else {
+        stream->objects &= ~(1UL << stream->depth);
+    }
+    stream->depth++;
+    stream->state = object ? JSON_STATE_KEY_OR_END : JSON_STATE_VALUE_OR_END;
+    return true;
+}
+
+static bool json_stream_close(json_stream_t* stream, bool object) {
+    // Must match the container that is open
+    if (stream->depth == 0) return false;
+    bool is_object = (stream->objects >> (stream->depth - 1)) & 1;
+    if (is_object != object) return false;
+    stream->depth--;
+    stream->has_key = false;
+    if (!json_stream_emit(stream, object ? JSON_STREAM_OBJECT_END : JSON_STREAM_ARRAY_END, NULL)) return false;
+    return json_stream_value_done(stream);
+}
+
+static bool json_stream_literal(json_stream_t* stream) {
+    if (!json_stream_terminate(stream)) return false;
+    json_stream_event_t event;
+    if (strcmp(stream->value, "true") == 0) {
+        event = JSON_STREAM_TRUE;
+    } else if (strcmp(stream->value, "false") == 0) {
+        event = JSON_STREAM_FALSE;
+    } else if (strcmp(stream->value, "null") == 0) {
+        event = JSON_STREAM_NULL;
+    } else if ((stream->value[0] == '-') || ((stream->value[0] >= '0') && (stream->value[0] <= '9'))) {
+        event = JSON_STREAM_NUMBER;
+    } else {
+        return false;
+    }
+    if (!json_stream_emit(stream, event, (event == JSON_STREAM_NUMBER) ? stream->value : NULL)) return false;
+    return json_stream_value_done(stream);
+}
+
+static bool json_stream_whitespace(char c) { return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'); }
+
+static bool json_stream_char(json_stream_t* stream, char c) {
+    switch (stream->state) {
+        case JSON_STATE_VALUE:
+        case JSON_STATE_VALUE_OR_END:
+            if (json_stream_whitespace(c)) return true;
+            if (c == '{') return json_stream_open(stream, true);
+            if (c == '[') return json_stream_open(stream, false);
+            if ((c == ']') && (stream->state == JSON_STATE_VALUE_OR_END)) return json_stream_close(stream, false);
+            stream->length = 0;
+            if (c == '"') {
+                stream->reading_key = false;
+                stream->state       = JSON_STATE_STRING;
+                return true;
+            }
+            if ((c == '-') || ((c >= '0') && (c <= '9')) || (c == 't') || (c == 'f') || (c == 'n')) {
+                json_stream_append(stream, c);
+                stream->state = JSON_STATE_LITERAL;
+                return true;
+            }
+            return false;
+        case JSON_STATE_KEY:
+        case JSON_STATE_KEY_OR_END:
+            if (json_stream_whitespace(c)) return true;
+            if ((c == '}') && (stream->state == JSON_STATE_KEY_OR_END)) return json_stream_close(stream, true);
+            if (c != '"') return false;
+            stream->length      = 0;
+            stream->reading_key = true;
+            stream->state       = JSON_STATE_STRING;
+            return true;
+        case JSON_STATE_COLON:
+            if (json_stream_whitespace(c)) return true;
+            if (c != ':') return false;
+            stream->state = JSON_STATE_VALUE;
+            return true;
+        case JSON_STATE_AFTER_VALUE:
+            if (json_stream_whitespace(c)) return true;
+            if (c == ',') {
+                stream->state = ((stream->objects >> (stream->depth - 1)) & 1) ? JSON_STATE_KEY : JSON_STATE_VALUE;
+                return true;
+            }
+            if (c == '}') return json_stream_close(stream, true);
+            if (c == ']') return json_stream_close(stream, false);
+            return false;
+        case JSON_STATE_STRING:
+            if (c == '\\') {
+                stream->state = JSON_STATE_ESCAPE;
+                return true;
+            }
+            if ((uint8_t) c < 0x20) return false;
+            if (c != '"') {
+                json_stream_append(stream, c);
+                return true;
+            }
+            if (!json_stream_terminate(stream)) return false;
+            if (stream->reading_key) {
+                strncpy(stream->key, stream->value, sizeof(stream->key) - 1);
+                stream->key[sizeof(stream->key) - 1] = '\0';
+                stream->has_key                      = true;
+                stream->state                        = JSON_STATE_COLON;
+                return true;
+            }
+            if (!json_stream_emit(stream, JSON_STREAM_STRING, stream->value)) return false;
+            return json_stream_value_done(stream);
+        case JSON_STATE_ESCAPE:
+            stream->state = JSON_STATE_STRING;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    json_stream_append(stream, c);
+                    return true;
+                case 'b':
+                    json_stream_append(stream, '\b');
+                    return true;
+                case 'f':
+                    json_stream_append(stream, '\f');
+                    return true;
+                case 'n':
+                    json_stream_append(stream, '\n');
+                    return true;
+                case 'r':
+                    json_stream_append(stream, '\r');
+                    return true;
+                case 't':
+                    json_stream_append(stream, '\t');
+                    return true;
+                case 'u':
+                    stream->unicode = 0;
+                    stream->digits  = 0;
+                    stream->state   = JSON_STATE_UNICODE;
+                    return true;
+                default:
+                    return false;
+            }
+        case JSON_STATE_UNICODE:
+            if ((c >= '0') && (c <= '9')) {
+                stream->unicode = (stream->unicode << 4) | (c - '0');
+            } else if ((c >= 'a') && (c <= 'f')) {
+                stream->unicode = (stream->unicode << 4) | (c - 'a' + 10);
+            } else if ((c >= 'A') && (c <= 'F')) {
+                stream->unicode = (stream->unicode << 4) | (c - 'A' + 10);
+            } else {
+                return false;
+            }
+            if (++stream->digits < 4) return true;
+            stream->state = JSON_STATE_STRING;
+            if ((stream->unicode >= 0xD800) && (stream->unicode <= 0xDBFF)) {
+                // First half of a surrogate pair, the second half follows as another escape
+                stream->surrogate = stream->unicode;
+            } else if ((stream->unicode >= 0xDC00) && (stream->unicode <= 0xDFFF) && (stream->surrogate != 0)) {
+                json_stream_append_utf8(stream, 0x10000 + ((stream->surrogate - 0xD800) << 10) + (stream->unicode - 0xDC00));
+                stream->surrogate = 0;
+            } else {
+                json_stream_append_utf8(stream, stream->unicode);
+                stream->surrogate = 0;
+            }
+            return true;
+        case JSON_STATE_LITERAL:
+            if (((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) || (c == 'E') || (c == '.') || (c == '+') || (c == '-')) {
+                json_stream_append(stream, c);
+                return true;
+            }
+            // The character ending the literal belongs to what follows it
+            if (!json_stream_literal(stream)) return false;
+            return json_stream_char(stream, c);
+        case JSON_STATE_DONE:
+            return json_stream_whitespace(c);
+        default:
+            return false;
+    }
+}
+
+bool json_stream_feed(json_stream_t* stream, const char* data, size_t length) {
+    for (size_t position = 0; position < length; position++) {
+        if (stream->state == JSON_STATE_ERROR) return false;
+        // Running out of memory would silently truncate values
+        if ((!json_stream_char(stream, data[position])) || stream->out_of_memory) {
+            stream->state = JSON_STATE_ERROR;
+            return false;
+        }
+    }
+    return stream->state != JSON_STATE_ERROR;
+}
+
+bool json_stream_finish(json_stream_t* stream) {
+    // A number at the top level only ends with the document
+    if ((stream->state == JSON_STATE_LITERAL) && (stream->depth == 0) && (!json_stream_literal(stream))) stream->state = JSON_STATE_ERROR;
+    return stream->state == JSON_STATE_DONE;
+}
+
+void json_stream_free(json_stream_t* stream) {
+    free(stream->value);
+    stream->value    = NULL;
+    stream->capacity = 0;
+}
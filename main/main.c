@@ -28,6 +28,7 @@
 #include "graphics_wrapper.h"
 #include "gui_element_header.h"
 #include "hardware.h"
+#include "install_queue.h"
 #include "managed_i2c.h"
 #include "menu.h"
 #include "menus/start.h"
@@ -333,6 +334,7 @@ void app_main(void) {
 
     /* Start WiFi */
     wifi_init();
+    install_queue_init();
 
     if (!wifi_check_configured()) {
         if (wifi_set_defaults()) {
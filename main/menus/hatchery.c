@@ -3,6 +3,7 @@
 #include <esp_system.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <sdkconfig.h>
 #include <stddef.h>
@@ -19,13 +20,14 @@
 #include "gui_element_header.h"
 #include "hardware.h"
 #include "http_download.h"
+#include "install_queue.h"
+#include "json_stream.h"
 #include "menu.h"
 #include "metadata.h"
 #include "pax_codecs.h"
 #include "pax_gfx.h"
 #include "rp2040.h"
 #include "system_wrapper.h"
-#include "wifi_connect.h"
 
 extern const uint8_t hatchery_png_start[] asm("_binary_hatchery_png_start");
 extern const uint8_t hatchery_png_end[] asm("_binary_hatchery_png_end");
@@ -33,6 +35,12 @@ extern const uint8_t hatchery_png_end[] asm("_binary_hatchery_png_end");
 static const char* esp32_type   = "esp32";
 static const char* esp32_bin_fn = "main.bin";
 
+// Catalog responses younger than this are shown without asking the server, older ones are revalidated
+#define HATCHERY_CACHE_MAX_AGE (5 * 60)
+
+// Interval for checking the install queue while waiting for buttons, the status shown next to the title follows it
+#define HATCHERY_STATUS_INTERVAL 250
+
 static menu_t* hatchery_menu_create(const char* title) {
     menu_t* menu             = menu_alloc(title, 34, 18);
     menu->fgColor            = 0xFF000000;
@@ -58,33 +66,203 @@ static void hatchery_menu_destroy(menu_t* menu) {
     menu_free(menu);
 }
 
+// Background prefetch: while a menu is open a low priority task downloads the page behind the highlighted entry, so opening it doesn't have
+// to wait for the network. Prefetched pages are kept in a few slots in RAM only (they don't go through the response cache on flash), the
+// least recently stored one is replaced first. Moving on to another entry cancels the download in progress.
+#define HATCHERY_PREFETCH_SLOTS    4
+#define HATCHERY_PREFETCH_MAX_SIZE (32 * 1024)
+#define HATCHERY_PREFETCH_DELAY    300  // Time in ms the highlight has to stay on an entry before its page is fetched
+#define HATCHERY_PREFETCH_STACK    8192
+
+typedef struct {
+    char     url[128];
+    char*    data;
+    size_t   size;
+    uint32_t stored;  // For replacing the oldest slot
+} hatchery_prefetch_slot_t;
+
+static hatchery_prefetch_slot_t prefetch_slots[HATCHERY_PREFETCH_SLOTS];
+static uint32_t                 prefetch_clock   = 0;
+static SemaphoreHandle_t        prefetch_lock    = NULL;  // Protects the slots and the URLs below
+static SemaphoreHandle_t        prefetch_stopped = NULL;
+static SemaphoreHandle_t        prefetch_done    = NULL;  // Given every time a download of the prefetch task ends
+static TaskHandle_t             prefetch_task    = NULL;
+static volatile bool            prefetch_stop    = false;
+static volatile bool            prefetch_cancel  = false;  // Stops the download of the prefetch task
+static char                     prefetch_pending[128];  // Page to prefetch next, empty if none
+static char                     prefetch_active[128];   // Page being downloaded by the prefetch task
+
+static int hatchery_prefetch_find(const char* url) {
+    for (int slot = 0; slot < HATCHERY_PREFETCH_SLOTS; slot++) {
+        if ((prefetch_slots[slot].data != NULL) && (strcmp(prefetch_slots[slot].url, url) == 0)) return slot;
+    }
+    return -1;
+}
+
+static void hatchery_prefetch_store(const char* url, char* data, size_t size) {
+    int slot = 0;
+    for (int index = 1; index < HATCHERY_PREFETCH_SLOTS; index++) {
+        if (prefetch_slots[index].stored < prefetch_slots[slot].stored) slot = index;
+    }
+    free(prefetch_slots[slot].data);
+    snprintf(prefetch_slots[slot].url, sizeof(prefetch_slots[slot].url), "%s", url);
+    prefetch_slots[slot].data   = data;
+    prefetch_slots[slot].size   = size;
+    prefetch_slots[slot].stored = ++prefetch_clock;
+}
+
+static void hatchery_prefetch_task(void* arg) {
+    while (!prefetch_stop) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Wait for the highlight to settle, no use fetching every entry scrolled past
+        while ((!prefetch_stop) && ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HATCHERY_PREFETCH_DELAY))) {
+        }
+        if (prefetch_stop) break;
+
+        char url[sizeof(prefetch_pending)];
+        xSemaphoreTake(prefetch_lock, portMAX_DELAY);
+        strcpy(url, prefetch_pending);
+        prefetch_pending[0] = '\0';
+        bool skip           = (url[0] == '\0') || (hatchery_prefetch_find(url) >= 0);
+        if (!skip) {
+            strcpy(prefetch_active, url);
+            prefetch_cancel = prefetch_stop;
+        }
+        xSemaphoreGive(prefetch_lock);
+        if (skip) continue;
+
+        char*  data    = NULL;
+        size_t size    = 0;
+        bool   success = download_ram_cancellable(url, (uint8_t**) &data, &size, &prefetch_cancel);
+
+        xSemaphoreTake(prefetch_lock, portMAX_DELAY);
+        prefetch_active[0] = '\0';
+        if (success && (data != NULL) && (size <= HATCHERY_PREFETCH_MAX_SIZE)) {
+            hatchery_prefetch_store(url, data, size);
+        } else {
+            free(data);
+        }
+        xSemaphoreGive(prefetch_lock);
+        xSemaphoreGive(prefetch_done);
+    }
+    xSemaphoreGive(prefetch_stopped);
+    vTaskDelete(NULL);
+}
+
+static void hatchery_prefetch_start() {
+    prefetch_stop       = false;
+    prefetch_cancel     = false;
+    prefetch_pending[0] = '\0';
+    prefetch_active[0]  = '\0';
+    prefetch_lock       = xSemaphoreCreateMutex();
+    prefetch_stopped    = xSemaphoreCreateBinary();
+    prefetch_done       = xSemaphoreCreateBinary();
+    if ((prefetch_lock == NULL) || (prefetch_stopped == NULL) || (prefetch_done == NULL) ||
+        (xTaskCreate(hatchery_prefetch_task, "prefetch", HATCHERY_PREFETCH_STACK, NULL, tskIDLE_PRIORITY + 1, &prefetch_task) != pdPASS)) {
+        // Works without, just slower
+        printf("Failed to start prefetch task\r\n");
+        prefetch_task = NULL;
+    }
+}
+
+static void hatchery_prefetch_stop() {
+    if (prefetch_task != NULL) {
+        prefetch_stop   = true;
+        prefetch_cancel = true;
+        xTaskNotifyGive(prefetch_task);
+        xSemaphoreTake(prefetch_stopped, portMAX_DELAY);
+        prefetch_task = NULL;
+    }
+    for (int slot = 0; slot < HATCHERY_PREFETCH_SLOTS; slot++) {
+        free(prefetch_slots[slot].data);
+        prefetch_slots[slot].data = NULL;
+    }
+    if (prefetch_lock != NULL) vSemaphoreDelete(prefetch_lock);
+    if (prefetch_stopped != NULL) vSemaphoreDelete(prefetch_stopped);
+    if (prefetch_done != NULL) vSemaphoreDelete(prefetch_done);
+    prefetch_lock    = NULL;
+    prefetch_stopped = NULL;
+    prefetch_done    = NULL;
+}
+
+static void hatchery_prefetch(const char* url) {
+    // Replaces the page queued before, if it wasn't fetched yet, and stops fetching any other page
+    if (prefetch_task == NULL) return;
+    xSemaphoreTake(prefetch_lock, portMAX_DELAY);
+    snprintf(prefetch_pending, sizeof(prefetch_pending), "%s", url);
+    if ((prefetch_active[0] != '\0') && (strcmp(prefetch_active, url) != 0)) prefetch_cancel = true;
+    xSemaphoreGive(prefetch_lock);
+    xTaskNotifyGive(prefetch_task);
+}
+
+static bool hatchery_fetch(const char* url, char** data, size_t* size) {
+    // Take the page from the prefetch slots if it's there, wait for the prefetch task if it is busy fetching it. A prefetch of any other
+    // page is cancelled, it would only slow this download down.
+    while (prefetch_task != NULL) {
+        xSemaphoreTake(prefetch_lock, portMAX_DELAY);
+        prefetch_pending[0] = '\0';  // Navigating away, the queued page is not needed
+        int  slot           = hatchery_prefetch_find(url);
+        bool busy           = (strcmp(prefetch_active, url) == 0);
+        if (slot >= 0) {
+            *data                     = prefetch_slots[slot].data;
+            *size                     = prefetch_slots[slot].size;
+            prefetch_slots[slot].data = NULL;
+        }
+        if ((!busy) && (prefetch_active[0] != '\0')) prefetch_cancel = true;
+        xSemaphoreGive(prefetch_lock);
+        if (slot >= 0) return true;
+        if (!busy) break;
+        xSemaphoreTake(prefetch_done, portMAX_DELAY);
+    }
+    return download_ram_cached(url, (uint8_t**) data, size, HATCHERY_CACHE_MAX_AGE);
+}
+
+// Returns -1 if no button was pressed within the timeout
 int wait_for_button_press(xQueueHandle button_queue, TickType_t timeout) {
-    int button = -1;
     while (true) {
         rp2040_input_message_t message;
-        xQueueReceive(button_queue, &message, portMAX_DELAY);
-        button = message.input;
-        if (message.state) break;
+        if (xQueueReceive(button_queue, &message, timeout) != pdTRUE) return -1;
+        if (message.state) return message.input;
     }
-    return button;
 }
 
-static void* hatchery_menu_show(xQueueHandle button_queue, menu_t* menu, const char* prompt, bool* back_btn, bool* select_btn, bool* menu_btn, bool* home_btn) {
-    pax_buf_t* pax_buffer   = get_pax_buffer();
-    bool       quit         = false;
-    bool       render       = true;
-    void*      return_value = NULL;
+static void hatchery_render_status(pax_buf_t* pax_buffer) {
+    // Right aligned in the title bar
+    install_queue_render_status(pax_buffer, 0xFFfa448c, pax_buffer->width - 5, 11);
+}
+
+// The page behind the highlighted entry (prefetch_url/<slug><prefetch_suffix>) is prefetched in the background
+static void* hatchery_menu_show(xQueueHandle button_queue, menu_t* menu, const char* prompt, const char* prefetch_url, const char* prefetch_suffix,
+                                bool* back_btn, bool* select_btn, bool* menu_btn, bool* home_btn) {
+    pax_buf_t*  pax_buffer   = get_pax_buffer();
+    bool        quit         = false;
+    bool        render       = true;
+    void*       return_value = NULL;
+    uint32_t    generation   = 0;
+    const char* prefetched   = NULL;  // Slug of the entry whose page was queued for prefetching
     while (!quit) {
         if (render) {
+            generation = install_queue_generation();
             pax_background(pax_buffer, 0xFFFFFF);
             menu_render(pax_buffer, menu, 0, 0, 320, 220);
+            hatchery_render_status(pax_buffer);
             pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, pax_buffer->height - 18, prompt);
             display_flush();
             render = false;
+
+            // Only when the highlight moved, re-rendering for the install status would restart the prefetch delay
+            const char* slug = (const char*) menu_get_callback_args(menu, menu_get_position(menu));
+            if ((slug != NULL) && (slug != prefetched)) {
+                prefetched = slug;
+                char url[128];
+                snprintf(url, sizeof(url), "%s/%s%s", prefetch_url, slug, prefetch_suffix);
+                hatchery_prefetch(url);
+            }
         }
 
-        int button   = wait_for_button_press(button_queue, portMAX_DELAY);
+        int button   = wait_for_button_press(button_queue, pdMS_TO_TICKS(HATCHERY_STATUS_INTERVAL));
         return_value = menu_get_callback_args(menu, menu_get_position(menu));
+        if (generation != install_queue_generation()) render = true;
         switch (button) {
             case RP2040_INPUT_JOYSTICK_DOWN:
                 menu_navigate_next(menu);
@@ -123,25 +301,35 @@ static void* hatchery_menu_show(xQueueHandle button_queue, menu_t* menu, const c
     return return_value;
 }
 
-static char*  data_types = NULL;
-static size_t size_types = 0;
-static cJSON* json_types = NULL;
-
-static char*  data_categories = NULL;
-static size_t size_categories = 0;
-static cJSON* json_categories = NULL;
-
-static char*  data_apps = NULL;
-static size_t size_apps = 0;
-static cJSON* json_apps = NULL;
+// Listings (types, categories and apps) only keep the slug and name of every entry, taken from the response by the streaming parser without
+// building a JSON tree
+typedef struct {
+    size_t slug;  // Offsets in the string pool
+    size_t name;
+} hatchery_entry_t;
+
+typedef struct {
+    hatchery_entry_t* entries;
+    size_t            amount;
+    size_t            capacity;
+    char*             strings;  // Pool holding the strings of all entries
+    size_t            strings_used;
+    size_t            strings_size;
+    hatchery_entry_t  current;  // Entry being parsed
+    bool              has_slug;
+    bool              has_name;
+} hatchery_list_t;
+
+static hatchery_list_t types      = {0};
+static hatchery_list_t categories = {0};
+static hatchery_list_t apps       = {0};
 
 static char*  data_app_info = NULL;
 static size_t size_app_info = 0;
 static cJSON* json_app_info = NULL;
 
 static bool connect_to_wifi() {
-    if (!wifi_connect_to_stored()) {
-        wifi_disconnect_and_disable();
+    if (!install_queue_take_network()) {
         render_message("Unable to connect to\nthe WiFi network");
         display_flush();
         wait_for_button();
@@ -150,45 +338,79 @@ static bool connect_to_wifi() {
     return true;
 }
 
-static void hatchery_free_types() {
-    if (json_types != NULL) {
-        cJSON_Delete(json_types);
-        json_types = NULL;
-    }
-
-    if (data_types != NULL) {
-        free(data_types);
-        data_types = NULL;
-        size_types = 0;
-    }
+static void hatchery_list_free(hatchery_list_t* list) {
+    free(list->entries);
+    free(list->strings);
+    memset(list, 0, sizeof(hatchery_list_t));
 }
 
-static void hatchery_free_categories() {
-    if (json_categories != NULL) {
-        cJSON_Delete(json_categories);
-        json_categories = NULL;
-    }
+static const char* hatchery_list_slug(hatchery_list_t* list, size_t index) { return &list->strings[list->entries[index].slug]; }
+
+static const char* hatchery_list_name(hatchery_list_t* list, size_t index) { return &list->strings[list->entries[index].name]; }
 
-    if (data_categories != NULL) {
-        free(data_categories);
-        data_categories = NULL;
-        size_categories = 0;
+static bool hatchery_list_add_string(hatchery_list_t* list, const char* value, size_t* offset) {
+    size_t length = strlen(value) + 1;
+    if (list->strings_used + length > list->strings_size) {
+        size_t size = (list->strings_size > 0) ? list->strings_size : 512;
+        while (size < list->strings_used + length) size *= 2;
+        char* strings = realloc(list->strings, size);
+        if (strings == NULL) return false;
+        list->strings      = strings;
+        list->strings_size = size;
     }
+    memcpy(&list->strings[list->strings_used], value, length);
+    *offset = list->strings_used;
+    list->strings_used += length;
+    return true;
 }
 
-static void hatchery_free_apps() {
-    if (json_apps != NULL) {
-        cJSON_Delete(json_apps);
-        json_apps = NULL;
+static bool hatchery_list_parse(void* ctx, json_stream_event_t event, const char* key, const char* value, size_t depth) {
+    // The listing is an array of objects, of which only the slug and name members are needed
+    hatchery_list_t* list = (hatchery_list_t*) ctx;
+    if ((event == JSON_STREAM_OBJECT_START) && (depth == 1)) {
+        list->has_slug = false;
+        list->has_name = false;
+    } else if ((event == JSON_STREAM_STRING) && (depth == 2) && (key != NULL)) {
+        if ((strcmp(key, "slug") == 0) && (!list->has_slug)) {
+            list->has_slug = hatchery_list_add_string(list, value, &list->current.slug);
+            if (!list->has_slug) return false;
+        } else if ((strcmp(key, "name") == 0) && (!list->has_name)) {
+            list->has_name = hatchery_list_add_string(list, value, &list->current.name);
+            if (!list->has_name) return false;
+        }
+    } else if ((event == JSON_STREAM_OBJECT_END) && (depth == 1) && list->has_slug && list->has_name) {
+        if (list->amount == list->capacity) {
+            size_t            capacity = (list->capacity > 0) ? list->capacity * 2 : 16;
+            hatchery_entry_t* entries  = realloc(list->entries, capacity * sizeof(hatchery_entry_t));
+            if (entries == NULL) return false;
+            list->entries  = entries;
+            list->capacity = capacity;
+        }
+        list->entries[list->amount++] = list->current;
     }
+    return true;
+}
 
-    if (data_apps != NULL) {
-        free(data_apps);
-        data_apps = NULL;
-        size_apps = 0;
-    }
+static bool hatchery_list_load(hatchery_list_t* list, const char* url) {
+    char*  data = NULL;
+    size_t size = 0;
+    if (!hatchery_fetch(url, &data, &size)) return false;
+    if (data == NULL) return false;
+    json_stream_t stream;
+    json_stream_init(&stream, hatchery_list_parse, list);
+    bool success = json_stream_feed(&stream, data, size) && json_stream_finish(&stream);
+    json_stream_free(&stream);
+    free(data);  // Not needed anymore once the entries have been taken out
+    if (!success) hatchery_list_free(list);
+    return success;
 }
 
+static void hatchery_free_types() { hatchery_list_free(&types); }
+
+static void hatchery_free_categories() { hatchery_list_free(&categories); }
+
+static void hatchery_free_apps() { hatchery_list_free(&apps); }
+
 static void hatchery_free_app_info() {
     if (json_app_info != NULL) {
         cJSON_Delete(json_app_info);
@@ -216,42 +438,26 @@ static void show_communication_error(xQueueHandle button_queue) {
 }
 
 static bool load_types() {
-    if (data_types == NULL) {
-        bool success = download_ram("https://mch2022.badge.team/v2/mch2022/types", (uint8_t**) &data_types, &size_types);
-        if (!success) return false;
-    }
-    if (data_types == NULL) return false;
-    json_types = cJSON_ParseWithLength(data_types, size_types);
-    if (json_types == NULL) return false;
-    return true;
+    if (types.entries != NULL) return true;
+    return hatchery_list_load(&types, "https://mch2022.badge.team/v2/mch2022/types");
 }
 
 static bool load_categories(const char* type_slug) {
     char url[128];
     snprintf(url, sizeof(url) - 1, "https://mch2022.badge.team/v2/mch2022/%s/categories", type_slug);
-    bool success = download_ram(url, (uint8_t**) &data_categories, &size_categories);
-    if (!success) return false;
-    if (data_categories == NULL) return false;
-    json_categories = cJSON_ParseWithLength(data_categories, size_categories);
-    if (json_categories == NULL) return false;
-    return true;
+    return hatchery_list_load(&categories, url);
 }
 
 static bool load_apps(const char* type_slug, const char* category_slug) {
     char url[128];
     snprintf(url, sizeof(url) - 1, "https://mch2022.badge.team/v2/mch2022/%s/%s", type_slug, category_slug);
-    bool success = download_ram(url, (uint8_t**) &data_apps, &size_apps);
-    if (!success) return false;
-    if (data_apps == NULL) return false;
-    json_apps = cJSON_ParseWithLength(data_apps, size_apps);
-    if (json_apps == NULL) return false;
-    return true;
+    return hatchery_list_load(&apps, url);
 }
 
 static bool load_app_info(const char* type_slug, const char* category_slug, const char* app_slug) {
     char url[128];
     snprintf(url, sizeof(url) - 1, "https://mch2022.badge.team/v2/mch2022/%s/%s/%s", type_slug, category_slug, app_slug);
-    bool success = download_ram(url, (uint8_t**) &data_app_info, &size_app_info);
+    bool success = hatchery_fetch(url, &data_app_info, &size_app_info);
     if (!success) return false;
     if (data_app_info == NULL) return false;
     json_app_info = cJSON_ParseWithLength(data_app_info, size_app_info);
@@ -260,7 +466,14 @@ static bool load_app_info(const char* type_slug, const char* category_slug, cons
 }
 
 bool menu_hatchery_install_app_execute(xQueueHandle button_queue, const char* type_slug, bool to_sd_card) {
-    return install_app(button_queue, type_slug, to_sd_card, data_app_info, size_app_info, json_app_info);
+    // Installed in the background, the menus show the progress
+    if (install_queue_add(type_slug, to_sd_card, data_app_info, size_app_info) == 0) {
+        render_message("Can not install app\nToo many installations\nin progress");
+        display_flush();
+        wait_for_button(button_queue);
+        return false;
+    }
+    return true;
 }
 
 bool menu_hatchery_install_app(xQueueHandle button_queue, const char* type_slug) {
@@ -426,12 +639,17 @@ bool menu_hatchery_app_info(xQueueHandle button_queue, const char* type_slug, co
     cJSON* description_obj = cJSON_GetObjectItem(json_app_info, "description");
     cJSON* version_obj     = cJSON_GetObjectItem(json_app_info, "version");
 
-    bool render = true;
-    bool quit   = false;
+    bool     render     = true;
+    bool     quit       = false;
+    uint32_t generation = 0;
+    uint32_t job        = 0;  // Installation of this app in progress
     while (!quit) {
         if (render) {
+            generation = install_queue_generation();
+            job        = install_queue_find(type_slug, app_slug);
             pax_background(pax_buffer, 0xFFFFFF);
             render_header(pax_buffer, 0, 0, pax_buffer->width, 34, 18, 0xFFfa448c, 0xFF491d88, NULL, name_obj->valuestring);
+            hatchery_render_status(pax_buffer);
             char buffer[128];
             snprintf(buffer, sizeof(buffer) - 1, "Author: %s", author_obj->valuestring);
             pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, 52, buffer);
@@ -441,12 +659,14 @@ bool menu_hatchery_app_info(xQueueHandle button_queue, const char* type_slug, co
             pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, 52 + 20 * 2, buffer);
             wraplines(description_obj->valuestring);
             pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, 52 + 20 * 3, description_obj->valuestring);
-            pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, pax_buffer->height - 18, "🅰 install app  🅱 back");
+            pax_draw_text(pax_buffer, 0xFF491d88, pax_font_saira_regular, 18, 5, pax_buffer->height - 18,
+                          (job != 0) ? "🅰 cancel install  🅱 back" : "🅰 install app  🅱 back");
             display_flush();
             render = false;
         }
 
-        int button = wait_for_button_press(button_queue, portMAX_DELAY);
+        int button = wait_for_button_press(button_queue, pdMS_TO_TICKS(HATCHERY_STATUS_INTERVAL));
+        if (generation != install_queue_generation()) render = true;
         switch (button) {
             case RP2040_INPUT_JOYSTICK_DOWN:
                 render = true;
@@ -458,7 +678,11 @@ bool menu_hatchery_app_info(xQueueHandle button_queue, const char* type_slug, co
             case RP2040_INPUT_JOYSTICK_PRESS:
             case RP2040_INPUT_BUTTON_START:
                 render = true;
-                menu_hatchery_install_app(button_queue, type_slug);
+                if (job != 0) {
+                    install_queue_cancel(job);
+                } else {
+                    menu_hatchery_install_app(button_queue, type_slug);
+                }
                 break;
             case RP2040_INPUT_BUTTON_BACK:
                 quit = true;
@@ -493,17 +717,16 @@ bool menu_hatchery_apps(xQueueHandle button_queue, const char* type_slug, const
     }
 
     menu_t* menu = hatchery_menu_create("Apps");
+    char    prefetch_url[128];
+    snprintf(prefetch_url, sizeof(prefetch_url), "https://mch2022.badge.team/v2/mch2022/%s/%s", type_slug, category_slug);
 
-    cJSON* app_obj;
-    cJSON_ArrayForEach(app_obj, json_apps) {
-        cJSON* slug_obj = cJSON_GetObjectItem(app_obj, "slug");
-        cJSON* name_obj = cJSON_GetObjectItem(app_obj, "name");
-        menu_insert_item(menu, name_obj->valuestring, NULL, (void*) slug_obj->valuestring, -1);
+    for (size_t index = 0; index < apps.amount; index++) {
+        menu_insert_item(menu, hatchery_list_name(&apps, index), NULL, (void*) hatchery_list_slug(&apps, index), -1);
     }
 
     bool quit = false;
     while (!quit) {
-        const char* app_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select app  🅱 back", &quit, NULL, NULL, &quit);
+        const char* app_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select app  🅱 back", prefetch_url, "", &quit, NULL, NULL, &quit);
         if (quit) break;
         quit = !menu_hatchery_app_info(button_queue, type_slug, category_slug, app_slug);
     }
@@ -525,17 +748,17 @@ bool menu_hatchery_categories(xQueueHandle button_queue, const char* type_slug)
     }
 
     menu_t* menu = hatchery_menu_create("Categories");
+    char    prefetch_url[128];
+    snprintf(prefetch_url, sizeof(prefetch_url), "https://mch2022.badge.team/v2/mch2022/%s", type_slug);
 
-    cJSON* category_obj;
-    cJSON_ArrayForEach(category_obj, json_categories) {
-        cJSON* slug_obj = cJSON_GetObjectItem(category_obj, "slug");
-        cJSON* name_obj = cJSON_GetObjectItem(category_obj, "name");
-        menu_insert_item(menu, name_obj->valuestring, NULL, (void*) slug_obj->valuestring, -1);
+    for (size_t index = 0; index < categories.amount; index++) {
+        menu_insert_item(menu, hatchery_list_name(&categories, index), NULL, (void*) hatchery_list_slug(&categories, index), -1);
     }
 
     bool quit = false;
     while (!quit) {
-        const char* category_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select category  🅱 back", &quit, NULL, NULL, &quit);
+        const char* category_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select category  🅱 back", prefetch_url, "", &quit, NULL, NULL,
+                                                                    &quit);
         if (quit) break;
         quit = !menu_hatchery_apps(button_queue, type_slug, category_slug);
     }
@@ -555,30 +778,30 @@ void menu_hatchery(xQueueHandle button_queue) {
     if (!connect_to_wifi()) return;
 
     if (!load_types()) {
-        wifi_disconnect_and_disable();
+        install_queue_release_network();
         hatchery_free();
         show_communication_error(button_queue);
         return;
     }
 
+    hatchery_prefetch_start();
     menu_t* menu = hatchery_menu_create("Hatchery");
 
-    cJSON* type_obj;
-    cJSON_ArrayForEach(type_obj, json_types) {
-        cJSON* slug_obj = cJSON_GetObjectItem(type_obj, "slug");
-        cJSON* name_obj = cJSON_GetObjectItem(type_obj, "name");
-        menu_insert_item(menu, name_obj->valuestring, NULL, (void*) slug_obj->valuestring, -1);
+    for (size_t index = 0; index < types.amount; index++) {
+        menu_insert_item(menu, hatchery_list_name(&types, index), NULL, (void*) hatchery_list_slug(&types, index), -1);
     }
 
     bool quit = false;
     while (!quit) {
-        const char* type_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select type  🅱 back", &quit, NULL, NULL, &quit);
+        const char* type_slug = (const char*) hatchery_menu_show(button_queue, menu, "🅰 select type  🅱 back", "https://mch2022.badge.team/v2/mch2022",
+                                                                "/categories", &quit, NULL, NULL, &quit);
         if (quit) break;
         quit = !menu_hatchery_categories(button_queue, type_slug);
     }
 
     hatchery_menu_destroy(menu);
-    wifi_disconnect_and_disable();
+    hatchery_prefetch_stop();
+    install_queue_release_network();  // Disables WiFi, unless the install queue is still using it
     hatchery_free();
     size_t ram_after = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
     printf("Leak (hatchery): %d (%u to %u)\r\n", ram_before - ram_after, ram_before, ram_after);
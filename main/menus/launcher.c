@@ -17,12 +17,14 @@
 #include "appfs_wrapper.h"
 #include "bootscreen.h"
 #include "fpga_download.h"
+#include "fpga_loader.h"
 #include "fpga_util.h"
 #include "graphics_wrapper.h"
 #include "gui_element_header.h"
 #include "hardware.h"
 #include "ice40.h"
 #include "ili9341.h"
+#include "install_queue.h"
 #include "menu.h"
 #include "metadata.h"
 #include "pax_codecs.h"
@@ -62,19 +64,19 @@ static void start_fpga_app(xQueueHandle button_queue, const char* path) {
         wait_for_button();
         return;
     }
-    size_t   bitstream_length = get_file_size(fd);
-    uint8_t* bitstream        = load_file_to_ram(fd);
-    ICE40*   ice40            = get_ice40();
+    ICE40* ice40 = get_ice40();
     ili9341_deinit(ili9341);
     ili9341_select(ili9341, false);
     vTaskDelay(200 / portTICK_PERIOD_MS);
     ili9341_select(ili9341, true);
-    esp_err_t res = ice40_load_bitstream(ice40, bitstream, bitstream_length);
-    free(bitstream);
+    esp_err_t res = fpga_loader_load_file(ice40, fd);
     fclose(fd);
     if (res == ESP_OK) {
         fpga_irq_setup(ice40);
+        fpga_req_setup();
+        fpga_btn_reset();
         fpga_host(button_queue, ice40, false, path);
+        fpga_req_cleanup();
         fpga_irq_cleanup(ice40);
         ice40_disable(ice40);
         ili9341_init(ili9341);
@@ -159,6 +161,13 @@ static bool populate_menu(menu_t* menu) {
 }
 
 static void start_app(xQueueHandle button_queue, launcher_app_t* app_to_start) {
+    if ((strcmp(app_to_start->type, "ice40") != 0) && install_queue_busy()) {
+        // Starting an ESP32 or Python app restarts the badge, which would abort the installations
+        render_message("Apps are being installed\n\nPlease wait until the\ninstallations are done");
+        display_flush();
+        wait_for_button();
+        return;
+    }
     display_boot_screen("Starting app...");
     if ((strlen(app_to_start->type) == strlen("ice40")) && (strncmp(app_to_start->type, "ice40", strlen(app_to_start->type)) == 0)) {
         start_fpga_app(button_queue, app_to_start->path);
@@ -302,13 +311,27 @@ void menu_launcher(xQueueHandle button_queue) {
         launcher_app_t* app_to_start = NULL;
         bool            render       = true;
         bool            quit         = false;
+        uint32_t        generation   = 0;
+        uint32_t        installed    = install_queue_installed();
         while (!quit) {
+            if (generation != install_queue_generation()) {
+                // Show the progress of installations in the background, and the apps that have been installed
+                generation = install_queue_generation();
+                render     = true;
+                if (installed != install_queue_installed()) {
+                    reload = true;
+                    quit   = true;
+                    continue;
+                }
+            }
+
             if (render) {
                 const pax_font_t* font = pax_font_saira_regular;
                 pax_background(pax_buffer, 0xFFFFFF);
                 pax_noclip(pax_buffer);
                 pax_draw_text(pax_buffer, 0xFF491d88, font, 18, 5, 240 - 18, "🅰 start  🅱 back  🅼 options");
                 menu_render(pax_buffer, menu, 0, 0, 320, 220);
+                install_queue_render_status(pax_buffer, 0xFF491d88, 320 - 5, 11);
                 if (empty) render_message("No apps installed");
                 display_flush();
                 render = false;
@@ -18,6 +18,7 @@
 #include "gui_element_header.h"
 #include "hardware.h"
 #include "http_download.h"
+#include "install_queue.h"
 #include "menu.h"
 #include "pax_codecs.h"
 #include "pax_gfx.h"
@@ -25,7 +26,6 @@
 #include "sao_eeprom.h"
 #include "settings.h"
 #include "system_wrapper.h"
-#include "wifi_connect.h"
 
 void program_small() {
     sao_driver_storage_data_t data = {.flags         = 0,
@@ -333,6 +333,13 @@ bool sao_is_app_installed(char* name) {
 }
 
 void sao_start_app(char* name) {
+    if (install_queue_busy()) {
+        // Starting the app restarts the badge, which would abort the installations
+        render_message("Apps are being installed\n\nPlease wait until the\ninstallations are done");
+        display_flush();
+        wait_for_button();
+        return;
+    }
     appfs_handle_t appfs_fd = appfsNextEntry(APPFS_INVALID_FD);
     while (appfs_fd != APPFS_INVALID_FD) {
         const char* slug    = NULL;
@@ -487,8 +494,7 @@ static void render_sao_not_detected(pax_buf_t* pax_buffer) {
 static bool connect_to_wifi() {
     render_message("Connecting to WiFi...");
     display_flush();
-    if (!wifi_connect_to_stored()) {
-        wifi_disconnect_and_disable();
+    if (!install_queue_take_network()) {
         render_message("Unable to connect to\nthe WiFi network");
         display_flush();
         wait_for_button();
@@ -628,7 +634,9 @@ void menu_sao(xQueueHandle button_queue) {
                                 if (connect_to_wifi()) {
                                     render_message("Installing app...");
                                     display_flush();
-                                    if (sao_install_app(button_queue, (char*) sao.drivers[0].data)) {
+                                    bool installed = sao_install_app(button_queue, (char*) sao.drivers[0].data);
+                                    install_queue_release_network();
+                                    if (installed) {
                                         sao_start_app((char*) sao.drivers[0].data);
                                     } else {
                                         render_message("Failed to install app");
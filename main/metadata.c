@@ -1,6 +1,5 @@
 #include "metadata.h"
 
-#include <cJSON.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_system.h>
@@ -11,8 +10,10 @@
 #include <freertos/task.h>
 #include <sdkconfig.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "json_stream.h"
 #include "menu.h"
 #include "pax_codecs.h"
 #include "pax_gfx.h"
@@ -20,6 +21,39 @@
 
 static const char* TAG = "Metadata";
 
+// String members of metadata.json that can be asked for, in the order of the outputs of parse_metadata
+static const char* metadata_keys[] = {"device", "type", "category", "slug", "name", "description", "author", "license"};
+
+#define METADATA_KEYS (sizeof(metadata_keys) / sizeof(metadata_keys[0]))
+
+typedef struct {
+    char** outputs[METADATA_KEYS];  // NULL for the members that aren't asked for
+    char*  values[METADATA_KEYS];   // Collected while parsing, handed out once the whole file turned out to be valid
+    int    version;
+    bool   has_version;
+} metadata_fields_t;
+
+static bool parse_metadata_field(void* ctx, json_stream_event_t event, const char* key, const char* value, size_t depth) {
+    // Only the string members of the top level object are of interest, the first occurrence of each
+    metadata_fields_t* fields = (metadata_fields_t*) ctx;
+    if ((depth != 1) || (key == NULL)) return true;
+    if (event == JSON_STREAM_NUMBER) {
+        if ((!fields->has_version) && (strcmp(key, "version") == 0)) {
+            fields->version     = atoi(value);
+            fields->has_version = true;
+        }
+        return true;
+    }
+    if (event != JSON_STREAM_STRING) return true;
+    for (size_t index = 0; index < METADATA_KEYS; index++) {
+        if ((fields->outputs[index] == NULL) || (fields->values[index] != NULL) || (strcmp(key, metadata_keys[index]) != 0)) continue;
+        fields->values[index] = strdup(value);
+        if (fields->values[index] == NULL) return false;
+        break;
+    }
+    return true;
+}
+
 void parse_metadata(const char* path, char** device, char** type, char** category, char** slug, char** name, char** description, char** author, int* version,
                     char** license) {
     FILE* fd = fopen(path, "r");
@@ -27,70 +61,29 @@ void parse_metadata(const char* path, char** device, char** type, char** categor
         ESP_LOGW(TAG, "Failed to open metadata file %s", path);
         return;
     }
-    char* json_data = (char*) load_file_to_ram(fd);
+
+    // Parsed while reading, the fields are taken out without loading the file or building a JSON tree. Like before, an invalid file gives
+    // nothing at all rather than the fields that came before the error.
+    metadata_fields_t fields = {.outputs = {device, type, category, slug, name, description, author, license}, .has_version = false};
+    json_stream_t     stream;
+    json_stream_init(&stream, parse_metadata_field, &fields);
+    char   buffer[256];
+    size_t length;
+    bool   valid = true;
+    while (valid && ((length = fread(buffer, 1, sizeof(buffer), fd)) > 0)) valid = json_stream_feed(&stream, buffer, length);
+    valid = valid && (!ferror(fd)) && json_stream_finish(&stream);
+    json_stream_free(&stream);
     fclose(fd);
-    if (json_data == NULL) return;
-    cJSON* root = cJSON_Parse(json_data);
-    if (root == NULL) {
-        free(json_data);
-        return;
-    }
-    if (device) {
-        cJSON* device_obj = cJSON_GetObjectItem(root, "device");
-        if (device_obj && (device_obj->valuestring != NULL)) {
-            *device = strdup(device_obj->valuestring);
-        }
-    }
-    if (type) {
-        cJSON* type_obj = cJSON_GetObjectItem(root, "type");
-        if (type_obj && (type_obj->valuestring != NULL)) {
-            *type = strdup(type_obj->valuestring);
-        }
-    }
-    if (category) {
-        cJSON* category_obj = cJSON_GetObjectItem(root, "category");
-        if (category_obj && (category_obj->valuestring != NULL)) {
-            *category = strdup(category_obj->valuestring);
-        }
-    }
-    if (slug) {
-        cJSON* slug_obj = cJSON_GetObjectItem(root, "slug");
-        if (slug_obj && (slug_obj->valuestring != NULL)) {
-            *slug = strdup(slug_obj->valuestring);
-        }
-    }
-    if (name) {
-        cJSON* name_obj = cJSON_GetObjectItem(root, "name");
-        if (name_obj && (name_obj->valuestring != NULL)) {
-            *name = strdup(name_obj->valuestring);
-        }
-    }
-    if (description) {
-        cJSON* description_obj = cJSON_GetObjectItem(root, "description");
-        if (description_obj && (description_obj->valuestring != NULL)) {
-            *description = strdup(description_obj->valuestring);
-        }
-    }
-    if (author) {
-        cJSON* author_obj = cJSON_GetObjectItem(root, "author");
-        if (author_obj && (author_obj->valuestring != NULL)) {
-            *author = strdup(author_obj->valuestring);
-        }
-    }
-    if (version) {
-        cJSON* version_obj = cJSON_GetObjectItem(root, "version");
-        if (version_obj) {
-            *version = version_obj->valueint;
-        }
-    }
-    if (license) {
-        cJSON* license_obj = cJSON_GetObjectItem(root, "license");
-        if (license_obj && (license_obj->valuestring != NULL)) {
-            *license = strdup(license_obj->valuestring);
+
+    if (!valid) ESP_LOGW(TAG, "Failed to parse metadata file %s", path);
+    for (size_t index = 0; index < METADATA_KEYS; index++) {
+        if (valid && (fields.values[index] != NULL)) {
+            *fields.outputs[index] = fields.values[index];
+        } else {
+            free(fields.values[index]);
         }
     }
-    cJSON_Delete(root);
-    free(json_data);
+    if (valid && fields.has_version && (version != NULL)) *version = fields.version;
 }
 
 void free_launcher_app(launcher_app_t* app) {
@@ -14,12 +14,12 @@
 #include "freertos/task.h"
 #include "gui_element_header.h"
 #include "hardware.h"
+#include "install_queue.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "string.h"
 #include "wifi.h"
 #include "wifi_cert.h"
-#include "wifi_connect.h"
 
 #define HASH_LEN 32
 
@@ -130,7 +130,14 @@ void ota_update(bool nightly) {
 
     char *ota_url = nightly ? "https://mch2022.ota.bodge.team/mch2022_dev.bin" : "https://mch2022.ota.bodge.team/mch2022.bin";
 
-    if (!wifi_connect_to_stored()) {
+    if (install_queue_busy()) {
+        // The update ends in a restart, which would abort the installations
+        display_ota_state("Apps are being installed", nightly);
+        vTaskDelay(2000 / portTICK_PERIOD_MS);
+        return;
+    }
+
+    if (!install_queue_take_network()) {
         display_ota_state("Failed to connect to WiFi", nightly);
         vTaskDelay(500 / portTICK_PERIOD_MS);
         return;
@@ -161,7 +168,7 @@ void ota_update(bool nightly) {
     esp_https_ota_handle_t https_ota_handle = NULL;
     esp_err_t              err              = esp_https_ota_begin(&ota_config, &https_ota_handle);
     if (err != ESP_OK) {
-        wifi_disconnect_and_disable();
+        install_queue_release_network();
         ESP_LOGE(TAG, "ESP HTTPS OTA Begin failed");
         display_ota_state("Failed to start download", nightly);
         vTaskDelay(5000 / portTICK_PERIOD_MS);
@@ -173,7 +180,7 @@ void ota_update(bool nightly) {
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_https_ota_read_img_desc failed");
         esp_https_ota_abort(https_ota_handle);
-        wifi_disconnect_and_disable();
+        install_queue_release_network();
         display_ota_state("Failed to read image desc", nightly);
         vTaskDelay(5000 / portTICK_PERIOD_MS);
         return;
@@ -181,7 +188,7 @@ void ota_update(bool nightly) {
     err = validate_image_header(&app_desc);
     if (err != ESP_OK) {
         esp_https_ota_abort(https_ota_handle);
-        wifi_disconnect_and_disable();
+        install_queue_release_network();
         display_ota_state("Already up-to-date!", nightly);
         vTaskDelay(2000 / portTICK_PERIOD_MS);
         return;
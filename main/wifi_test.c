@@ -15,6 +15,7 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "hardware.h"
+#include "install_queue.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "string.h"
@@ -97,16 +98,20 @@ void wifi_connection_test(xQueueHandle button_queue) {
     nvs_close(handle);
 
     bool quit             = false;
+    bool connected        = false;
     char test_result[128] = {0};
     while (!quit) {
         esp_netif_ip_info_t* ip_info = wifi_get_ip_info();
-        wifi_disconnect_and_disable();
+        // WiFi stays up while the install queue is using it, the test then runs over that connection
+        if (connected) install_queue_release_network();
+        connected = false;
         display_test_state(test_result, ssid, password, authmode, phase2, username, anon_ident, ip_info, true);
         quit = !wait_for_button();
         if (quit) break;
         display_test_state("Connecting...", ssid, password, authmode, phase2, username, anon_ident, ip_info, false);
 
-        if (!wifi_connect_to_stored()) {
+        connected = install_queue_take_network();
+        if (!connected) {
             sprintf(test_result, "Failed to connect to network!");
             continue;
         }
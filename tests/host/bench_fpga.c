@@ -0,0 +1,206 @@
+/*
+ * bench_fpga.c
+ *
+ * Throughput of the FPGA host code against the simulated gateware:
+ * Wishbone operations per second and file read requests in MB/s.
+ *
+ *   bench_fpga [bus_hz [setup_ns]]
+ *   bench_fpga --quick
+ *
+ * Without a bus clock the transfers are instant and only the host side
+ * is measured. With one, every transfer takes as long as it would on the
+ * SPI bus, which shows what batching and read-ahead hide of it.
+ */
+
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fpga_sim.h"
+#include "fpga_util.h"
+
+static ICE40    g_ice40;
+static char     g_prefix[64];
+static bool     g_quick;
+static uint32_t g_bus_hz;
+static uint32_t g_bus_setup_ns;
+
+#define FILE_SIZE (4 * 1024 * 1024)
+
+static void start(void) {
+    fpga_sim_init(&g_ice40);
+    fpga_sim_set_bus_timing(g_bus_hz, g_bus_setup_ns);
+    fpga_stats_reset();
+}
+
+static void report(const char *what, double count, const char *unit, int64_t us) {
+    printf("%-36s %12.0f %s/s\n", what, count * 1000000.0 / (us ? us : 1), unit);
+}
+
+/* ---------------------------------------------------------------------------
+ * Wishbone
+ * ------------------------------------------------------------------------ */
+
+static void bench_wb_exec(int batch, bool read) {
+    struct fpga_wb_cmdbuf *cb    = fpga_wb_alloc(batch);
+    int                    iters = (g_quick ? 2000 : 200000) / batch;
+    uint32_t               val[64];
+    char                   what[64];
+    int64_t                t;
+
+    start();
+
+    t = esp_timer_get_time();
+    for (int i = 0; i < iters; i++) {
+        fpga_wb_reset(cb);
+        for (int j = 0; j < batch; j++) {
+            if (read)
+                fpga_wb_queue_read(cb, 1, 4 * j, &val[j]);
+            else
+                fpga_wb_queue_write(cb, 1, 4 * j, i);
+        }
+        if (!fpga_wb_exec(cb, &g_ice40)) abort();
+    }
+    t = esp_timer_get_time() - t;
+
+    snprintf(what, sizeof(what), "wb %s, %d per cmdbuf", read ? "reads" : "writes", batch);
+    report(what, (double) iters * batch, "ops", t);
+
+    fpga_wb_free(cb);
+}
+
+static void bench_wb_async(int batch) {
+    struct fpga_wb_cmdbuf *cbs[2] = {fpga_wb_alloc(batch), fpga_wb_alloc(batch)};
+    int                    iters  = (g_quick ? 2000 : 200000) / batch;
+    char                   what[64];
+    int64_t                t;
+
+    start();
+    fpga_wb_async_start(&g_ice40);
+
+    // Build the next buffer while the previous one is executed
+    t = esp_timer_get_time();
+    for (int i = 0; i < iters; i++) {
+        struct fpga_wb_cmdbuf *cb = cbs[i & 1];
+
+        if ((i >= 2) && !fpga_wb_wait(cb, portMAX_DELAY)) abort();
+        fpga_wb_reset(cb);
+        for (int j = 0; j < batch; j++) fpga_wb_queue_write(cb, 1, 4 * j, i);
+        if (!fpga_wb_submit(cb, NULL, NULL)) abort();
+    }
+    fpga_wb_wait(cbs[0], portMAX_DELAY);
+    fpga_wb_wait(cbs[1], portMAX_DELAY);
+    t = esp_timer_get_time() - t;
+
+    snprintf(what, sizeof(what), "wb async writes, %d per cmdbuf", batch);
+    report(what, (double) iters * batch, "ops", t);
+
+    fpga_wb_async_stop();
+    fpga_wb_free(cbs[0]);
+    fpga_wb_free(cbs[1]);
+}
+
+static void bench_wb_bulk(bool read) {
+    static uint32_t buf[4096];
+    int             iters = g_quick ? 4 : 200;
+    int64_t         t;
+
+    start();
+
+    t = esp_timer_get_time();
+    for (int i = 0; i < iters; i++) {
+        bool ok = read ? fpga_wb_bulk_read(&g_ice40, 2, 0, buf, 4096, true) : fpga_wb_bulk_write(&g_ice40, 2, 0, buf, 4096, true);
+        if (!ok) abort();
+    }
+    t = esp_timer_get_time() - t;
+
+    report(read ? "wb bulk reads" : "wb bulk writes", (double) iters * 4096, "ops", t);
+
+    fpga_wb_async_stop();
+}
+
+/* ---------------------------------------------------------------------------
+ * File requests
+ * ------------------------------------------------------------------------ */
+
+static void bench_fread(size_t req_len, bool sequential) {
+    struct fpga_stats stats;
+    size_t            total = g_quick ? (256 * 1024) : FILE_SIZE;
+    char              what[64];
+    esp_err_t         err;
+    int64_t           t;
+
+    start();
+    fpga_irq_setup(&g_ice40);
+    fpga_req_setup();
+
+    t = esp_timer_get_time();
+    for (size_t n = 0; n < total / req_len; n++) {
+        // Random order is a fixed stride through the file
+        size_t ofs = sequential ? (n * req_len) : (((n * 769) % (FILE_SIZE / req_len)) * req_len);
+
+        fpga_sim_fread(0x100, ofs, req_len);
+        while (fpga_sim_busy()) {
+            fpga_req_process(g_prefix, &g_ice40, 100, &err);
+            if (err != ESP_OK) abort();
+        }
+    }
+    t = esp_timer_get_time() - t;
+
+    fpga_stats_get(&stats);
+    snprintf(what, sizeof(what), "fread %s, %zu byte requests", sequential ? "seq" : "random", req_len);
+    printf("%-36s %12.2f MB/s (%u/%u read-ahead)\n", what, stats.fread_bytes / (t ? (double) t : 1.0), stats.fread_prefetched, stats.fread);
+
+    fpga_req_cleanup();
+    fpga_irq_cleanup(&g_ice40);
+}
+
+int main(int argc, char **argv) {
+    static uint8_t block[65536];
+    char           path[128];
+
+    if ((argc > 1) && !strcmp(argv[1], "--quick")) {
+        g_quick = true;
+    } else {
+        if (argc > 1) g_bus_hz = strtoul(argv[1], NULL, 0);
+        if (argc > 2) g_bus_setup_ns = strtoul(argv[2], NULL, 0);
+    }
+
+    if (g_bus_hz)
+        printf("SPI bus at %u Hz, %u ns per transfer\n", g_bus_hz, g_bus_setup_ns);
+    else
+        printf("Instant SPI bus, host side only\n");
+
+    // File to serve
+    snprintf(g_prefix, sizeof(g_prefix), "bench_fpga.XXXXXX");
+    if (!mkdtemp(g_prefix)) return 1;
+    snprintf(path, sizeof(path), "%s/fpga_%08x.dat", g_prefix, 0x100);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) return 1;
+    for (size_t i = 0; i < FILE_SIZE; i += sizeof(block)) {
+        memset(block, i >> 16, sizeof(block));
+        fwrite(block, 1, sizeof(block), f);
+    }
+    fclose(f);
+
+    bench_wb_exec(1, false);
+    bench_wb_exec(32, false);
+    bench_wb_exec(1, true);
+    bench_wb_exec(32, true);
+    bench_wb_async(32);
+    bench_wb_bulk(false);
+    bench_wb_bulk(true);
+
+    bench_fread(1024, true);
+    bench_fread(4096, true);
+    bench_fread(1024, false);
+    bench_fread(4096, false);
+
+    unlink(path);
+    rmdir(g_prefix);
+
+    return 0;
+}
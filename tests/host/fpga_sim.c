@@ -0,0 +1,336 @@
+/*
+ * fpga_sim.c
+ *
+ * Simulated gateware behind the iCE40 SPI transfers. Implements the
+ * protocol of main/include/fpga_util.h from the FPGA side.
+ */
+
+#include "fpga_sim.h"
+
+#include <driver/gpio.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "fpga_util.h"
+
+#define SIM_LOG_MAX 65536
+
+static pthread_mutex_t g_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    ICE40   *ice40;
+    int      fail_after;
+    uint32_t bus_hz;
+    uint32_t bus_setup_ns;
+
+    // Wishbone devices
+    uint32_t regs[FPGA_SIM_WB_DEVS][FPGA_SIM_WB_WORDS];
+    size_t   log_len;
+    struct {
+        int      dev;
+        uint32_t addr;
+        uint32_t val;
+    } log[SIM_LOG_MAX];
+
+    // Response to the next SPI_CMD_RESP_ACK
+    uint8_t resp[FPGA_SIM_REQ_MAX + 12];
+    size_t  resp_len;
+
+    // File requests
+    struct {
+        bool     pending;
+        uint32_t fid;
+        uint32_t ofs;
+        size_t   len;
+    } rd, wr;
+    uint8_t rd_data[FPGA_SIM_REQ_MAX];
+    size_t  rd_data_len;
+    uint8_t wr_data[FPGA_SIM_REQ_MAX];
+    bool    wr_data_sent;
+} g_sim;
+
+void fpga_sim_init(ICE40 *ice40) {
+    pthread_mutex_lock(&g_sim_lock);
+    memset(&g_sim, 0x00, sizeof(g_sim));
+    g_sim.ice40      = ice40;
+    g_sim.fail_after = -1;
+    ice40->pin_int   = FPGA_SIM_PIN_INT;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+void fpga_sim_fail_after(int n) {
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim.fail_after = n;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+void fpga_sim_set_bus_timing(uint32_t hz, uint32_t setup_ns) {
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim.bus_hz       = hz;
+    g_sim.bus_setup_ns = setup_ns;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+static uint64_t _sim_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Holds the bus (the lock) for as long as the transfer would take. Busy
+// waits, sleeping is far too coarse for short transfers.
+static void _sim_bus_time(size_t len) {
+    if (!g_sim.bus_hz) return;
+
+    uint64_t end = _sim_now_ns() + g_sim.bus_setup_ns + (uint64_t) len * 8 * 1000000000 / g_sim.bus_hz;
+    while (_sim_now_ns() < end)
+        ;
+}
+
+// Called with the lock held for every transfer
+static bool _sim_transfer_ok(void) {
+    if (g_sim.fail_after < 0) return true;
+    if (!g_sim.fail_after) return false;
+    g_sim.fail_after--;
+    return true;
+}
+
+static void _sim_put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void _sim_req_header(uint32_t fid, uint32_t ofs, size_t len) {
+    _sim_put_be32(&g_sim.resp[0], fid);
+    _sim_put_be32(&g_sim.resp[4], ofs);
+    g_sim.resp[8]  = (len - 1) >> 8;
+    g_sim.resp[9]  = (len - 1) & 0xff;
+    g_sim.resp_len = 10;
+}
+
+/* ---------------------------------------------------------------------------
+ * Wishbone bridge
+ * ------------------------------------------------------------------------ */
+
+static void _sim_wb_access(int dev, uint32_t word, const uint8_t *data, bool write) {
+    uint32_t *reg = &g_sim.regs[dev][word % FPGA_SIM_WB_WORDS];
+
+    if (write) {
+        *reg = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+
+        if (g_sim.log_len < SIM_LOG_MAX) {
+            g_sim.log[g_sim.log_len].dev  = dev;
+            g_sim.log[g_sim.log_len].addr = word << 2;
+            g_sim.log[g_sim.log_len].val  = *reg;
+        }
+        g_sim.log_len++;
+    } else if (g_sim.resp_len + 4 <= sizeof(g_sim.resp)) {
+        _sim_put_be32(&g_sim.resp[g_sim.resp_len], *reg);
+        g_sim.resp_len += 4;
+    }
+}
+
+static void _sim_wb_commands(const uint8_t *buf, size_t len) {
+    size_t i = 1;
+
+    g_sim.resp_len = 0;
+
+    while ((i + 4) <= len) {
+        uint8_t  mode  = buf[i];
+        int      dev   = mode & 0xf;
+        bool     write = mode & 0x80;
+        uint32_t word  = (buf[i + 1] << 16) | (buf[i + 2] << 8) | buf[i + 3];
+
+        i += 4;
+
+        if (mode & 0x40) {
+            // Single access
+            if ((i + 4) > len) break;
+            _sim_wb_access(dev, word, &buf[i], write);
+            i += 4;
+        } else {
+            // Burst, up to the end of the transfer
+            for (; (i + 4) <= len; i += 4) {
+                _sim_wb_access(dev, word, &buf[i], write);
+                if (mode & 0x20) word++;
+            }
+        }
+    }
+}
+
+uint32_t fpga_sim_wb_peek(int dev, uint32_t addr) {
+    pthread_mutex_lock(&g_sim_lock);
+    uint32_t val = g_sim.regs[dev][(addr >> 2) % FPGA_SIM_WB_WORDS];
+    pthread_mutex_unlock(&g_sim_lock);
+    return val;
+}
+
+void fpga_sim_wb_poke(int dev, uint32_t addr, uint32_t val) {
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim.regs[dev][(addr >> 2) % FPGA_SIM_WB_WORDS] = val;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+size_t fpga_sim_wb_writes(void) {
+    pthread_mutex_lock(&g_sim_lock);
+    size_t n = g_sim.log_len;
+    pthread_mutex_unlock(&g_sim_lock);
+    return n;
+}
+
+bool fpga_sim_wb_log(size_t i, int *dev, uint32_t *addr, uint32_t *val) {
+    bool ok = false;
+
+    pthread_mutex_lock(&g_sim_lock);
+    if ((i < g_sim.log_len) && (i < SIM_LOG_MAX)) {
+        *dev  = g_sim.log[i].dev;
+        *addr = g_sim.log[i].addr;
+        *val  = g_sim.log[i].val;
+        ok    = true;
+    }
+    pthread_mutex_unlock(&g_sim_lock);
+
+    return ok;
+}
+
+/* ---------------------------------------------------------------------------
+ * File requests
+ * ------------------------------------------------------------------------ */
+
+void fpga_sim_fread(uint32_t fid, uint32_t ofs, size_t len) {
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim.rd.pending = true;
+    g_sim.rd.fid     = fid;
+    g_sim.rd.ofs     = ofs;
+    g_sim.rd.len     = len;
+    pthread_mutex_unlock(&g_sim_lock);
+
+    gpio_shim_trigger(FPGA_SIM_PIN_INT);
+}
+
+void fpga_sim_fwrite(uint32_t fid, uint32_t ofs, const void *data, size_t len) {
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim.wr.pending = true;
+    g_sim.wr.fid     = fid;
+    g_sim.wr.ofs     = ofs;
+    g_sim.wr.len     = len;
+    memcpy(g_sim.wr_data, data, len);
+    pthread_mutex_unlock(&g_sim_lock);
+
+    gpio_shim_trigger(FPGA_SIM_PIN_INT);
+}
+
+bool fpga_sim_busy(void) {
+    pthread_mutex_lock(&g_sim_lock);
+    bool busy = g_sim.rd.pending || g_sim.wr.pending;
+    pthread_mutex_unlock(&g_sim_lock);
+    return busy;
+}
+
+size_t fpga_sim_fread_data(void *buf, size_t max) {
+    pthread_mutex_lock(&g_sim_lock);
+    size_t len = (g_sim.rd_data_len < max) ? g_sim.rd_data_len : max;
+    memcpy(buf, g_sim.rd_data, len);
+    pthread_mutex_unlock(&g_sim_lock);
+    return len;
+}
+
+/* ---------------------------------------------------------------------------
+ * SPI transfers
+ * ------------------------------------------------------------------------ */
+
+esp_err_t ice40_send(ICE40 *device, const uint8_t *data, uint32_t length) {
+    esp_err_t res = ESP_OK;
+
+    if (!length) return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&g_sim_lock);
+
+    if (!_sim_transfer_ok()) {
+        res = ESP_FAIL;
+        goto done;
+    }
+
+    switch (data[0]) {
+        case SPI_CMD_WISHBONE:
+            _sim_wb_commands(data, length);
+            break;
+
+        case SPI_CMD_FREAD_GET:
+            _sim_req_header(g_sim.rd.fid, g_sim.rd.ofs, g_sim.rd.len);
+            break;
+
+        case SPI_CMD_FREAD_PUT:
+            // Data follows the command byte
+            g_sim.rd_data_len = length - 1;
+            if (g_sim.rd_data_len > sizeof(g_sim.rd_data)) g_sim.rd_data_len = sizeof(g_sim.rd_data);
+            memcpy(g_sim.rd_data, &data[1], g_sim.rd_data_len);
+            g_sim.rd.pending = false;
+            break;
+
+        case SPI_CMD_FWRITE_GET:
+            _sim_req_header(g_sim.wr.fid, g_sim.wr.ofs, g_sim.wr.len);
+            break;
+
+        case SPI_CMD_FWRITE_DATA:
+            memcpy(g_sim.resp, g_sim.wr_data, g_sim.wr.len);
+            g_sim.resp_len     = g_sim.wr.len;
+            g_sim.wr_data_sent = true;
+            break;
+
+        default:
+            break;
+    }
+
+    _sim_bus_time(length);
+
+done:
+    pthread_mutex_unlock(&g_sim_lock);
+    return res;
+}
+
+esp_err_t ice40_send_turbo(ICE40 *device, const uint8_t *data, uint32_t length) { return ice40_send(device, data, length); }
+
+esp_err_t ice40_transaction(ICE40 *device, uint8_t *data_out, uint32_t out_length, uint8_t *data_in, uint32_t in_length) {
+    esp_err_t res = ESP_OK;
+    uint8_t   cmd = data_out[0];
+
+    pthread_mutex_lock(&g_sim_lock);
+
+    if (!_sim_transfer_ok()) {
+        res = ESP_FAIL;
+        goto done;
+    }
+
+    memset(data_in, 0x00, in_length);
+
+    switch (cmd) {
+        case SPI_CMD_NOP2:
+            // Status byte: pending requests
+            if (in_length >= 2) data_in[1] = (g_sim.rd.pending ? SPI_REQ_FREAD : 0) | (g_sim.wr.pending ? SPI_REQ_FWRITE : 0);
+            break;
+
+        case SPI_CMD_RESP_ACK:
+            // Response after two dummy bytes
+            if (in_length > 2) memcpy(&data_in[2], g_sim.resp, ((in_length - 2) < g_sim.resp_len) ? (in_length - 2) : g_sim.resp_len);
+
+            // Write data was read back, request is done
+            if (g_sim.wr_data_sent) {
+                g_sim.wr_data_sent = false;
+                g_sim.wr.pending   = false;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    _sim_bus_time((out_length > in_length) ? out_length : in_length);
+
+done:
+    pthread_mutex_unlock(&g_sim_lock);
+    return res;
+}
@@ -0,0 +1,53 @@
+/*
+ * fpga_sim.h
+ *
+ * Simulated gateware behind the iCE40 SPI transfers, for running the
+ * FPGA host code without a badge: a Wishbone bridge in front of a few
+ * devices made of plain registers, and a requester for the file read and
+ * write requests. Requests raise the FPGA interrupt like the real one.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ice40.h"
+
+#define FPGA_SIM_PIN_INT  10
+#define FPGA_SIM_WB_DEVS  16
+#define FPGA_SIM_WB_WORDS 4096
+#define FPGA_SIM_REQ_MAX  65536
+
+/* Resets all state and sets up the device to point to the simulation */
+void fpga_sim_init(ICE40 *ice40);
+
+/* Makes every transfer after the next `n` ones fail, -1 to never fail */
+void fpga_sim_fail_after(int n);
+
+/* Transfers take as long as they would on a bus clocked at `hz` plus a
+ * fixed setup time per transfer. 0 Hz (the default) makes them instant,
+ * to measure the host side alone. */
+void fpga_sim_set_bus_timing(uint32_t hz, uint32_t setup_ns);
+
+/* Wishbone ------------------------------------------------------------ */
+
+/* Register access, addresses are in bytes like on the bus */
+uint32_t fpga_sim_wb_peek(int dev, uint32_t addr);
+void     fpga_sim_wb_poke(int dev, uint32_t addr, uint32_t val);
+
+/* Every write that reached the bus, in order */
+size_t fpga_sim_wb_writes(void);
+bool   fpga_sim_wb_log(size_t i, int *dev, uint32_t *addr, uint32_t *val);
+
+/* File requests ------------------------------------------------------- */
+
+/* One read and one write request can be pending at a time, `len` is at
+ * most FPGA_SIM_REQ_MAX */
+void fpga_sim_fread(uint32_t fid, uint32_t ofs, size_t len);
+void fpga_sim_fwrite(uint32_t fid, uint32_t ofs, const void *data, size_t len);
+bool fpga_sim_busy(void);
+
+/* Data the host sent for the last read request */
+size_t fpga_sim_fread_data(void *buf, size_t max);
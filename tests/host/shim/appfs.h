@@ -0,0 +1,18 @@
+/*
+ * appfs.h
+ *
+ * Host build of the AppFS API used by the FPGA request server. There are
+ * no AppFS entries.
+ */
+
+#pragma once
+
+#include <esp_spi_flash.h>
+
+typedef int appfs_handle_t;
+
+#define APPFS_INVALID_FD -1
+
+appfs_handle_t appfsOpen(const char *filename);
+void           appfsEntryInfo(appfs_handle_t fd, const char **name, int *size);
+esp_err_t      appfsMmap(appfs_handle_t fd, size_t offset, size_t len, const void **out_ptr, spi_flash_mmap_memory_t memory, spi_flash_mmap_handle_t *out_handle);
@@ -0,0 +1,45 @@
+/*
+ * gpio.h
+ *
+ * Host build of the ESP-IDF GPIO driver. Interrupt handlers are kept so
+ * the simulated hardware can call them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#define IRAM_ATTR
+
+typedef int gpio_num_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE,
+    GPIO_INTR_POSEDGE,
+    GPIO_INTR_NEGEDGE,
+    GPIO_INTR_ANYEDGE,
+} gpio_int_type_t;
+
+typedef enum {
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+typedef struct {
+    uint64_t        pin_bit_mask;
+    gpio_mode_t     mode;
+    int             pull_up_en;
+    int             pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+typedef void (*gpio_isr_t)(void *arg);
+
+esp_err_t gpio_config(const gpio_config_t *config);
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg);
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin);
+
+/* Host only: runs the handler installed for the pin, if any */
+void gpio_shim_trigger(gpio_num_t pin);
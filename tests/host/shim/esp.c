@@ -0,0 +1,82 @@
+/*
+ * esp.c
+ *
+ * Host build of the ESP-IDF and component functions used by the code
+ * under test.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <appfs.h>
+#include <driver/gpio.h>
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <esp_timer.h>
+
+const char *esp_err_to_name(esp_err_t code) {
+    static char name[16];
+    snprintf(name, sizeof(name), "0x%x", code);
+    return name;
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* ---------------------------------------------------------------------------
+ * GPIO
+ * ------------------------------------------------------------------------ */
+
+#define GPIO_SHIM_PINS 40
+
+static struct {
+    gpio_isr_t handler;
+    void      *arg;
+} g_gpio_isr[GPIO_SHIM_PINS];
+
+esp_err_t gpio_config(const gpio_config_t *config) { return ESP_OK; }
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg) {
+    if ((pin < 0) || (pin >= GPIO_SHIM_PINS)) return ESP_ERR_INVALID_ARG;
+    g_gpio_isr[pin].handler = handler;
+    g_gpio_isr[pin].arg     = arg;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin) {
+    if ((pin < 0) || (pin >= GPIO_SHIM_PINS)) return ESP_ERR_INVALID_ARG;
+    g_gpio_isr[pin].handler = NULL;
+    return ESP_OK;
+}
+
+void gpio_shim_trigger(gpio_num_t pin) {
+    if ((pin >= 0) && (pin < GPIO_SHIM_PINS) && g_gpio_isr[pin].handler) g_gpio_isr[pin].handler(g_gpio_isr[pin].arg);
+}
+
+/* ---------------------------------------------------------------------------
+ * Flash, nothing there
+ * ------------------------------------------------------------------------ */
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) { return NULL; }
+
+esp_err_t esp_partition_mmap(const esp_partition_t *part, size_t offset, size_t size, spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+appfs_handle_t appfsOpen(const char *filename) { return APPFS_INVALID_FD; }
+
+void appfsEntryInfo(appfs_handle_t fd, const char **name, int *size) {
+    if (name) *name = NULL;
+    if (size) *size = 0;
+}
+
+esp_err_t appfsMmap(appfs_handle_t fd, size_t offset, size_t len, const void **out_ptr, spi_flash_mmap_memory_t memory, spi_flash_mmap_handle_t *out_handle) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
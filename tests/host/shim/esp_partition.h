@@ -0,0 +1,33 @@
+/*
+ * esp_partition.h
+ *
+ * Host build of the ESP-IDF partition API. There are no partitions.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <esp_spi_flash.h>
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP  = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t    type;
+    esp_partition_subtype_t subtype;
+    uint32_t                address;
+    uint32_t                size;
+    char                    label[17];
+    bool                    encrypted;
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_mmap(const esp_partition_t *part, size_t offset, size_t size, spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle);
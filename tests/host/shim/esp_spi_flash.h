@@ -0,0 +1,22 @@
+/*
+ * esp_spi_flash.h
+ *
+ * Host build of the ESP-IDF flash mapping API. There is no flash, mapping
+ * always fails.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef enum {
+    SPI_FLASH_MMAP_DATA,
+    SPI_FLASH_MMAP_INST,
+} spi_flash_mmap_memory_t;
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle);
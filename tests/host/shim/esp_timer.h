@@ -0,0 +1,11 @@
+/*
+ * esp_timer.h
+ *
+ * Host build of the ESP-IDF high resolution timer.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,278 @@
+/*
+ * freertos.c
+ *
+ * Host build of the FreeRTOS API subset used by the launcher, on top of
+ * pthreads.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+/* ---------------------------------------------------------------------------
+ * Time
+ * ------------------------------------------------------------------------ */
+
+static uint64_t _shim_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    static uint64_t start;
+    if (!start) start = _shim_now_ms();
+    return (TickType_t) (_shim_now_ms() - start) / portTICK_PERIOD_MS;
+}
+
+void vTaskDelay(TickType_t ticks) { usleep((useconds_t) ticks * portTICK_PERIOD_MS * 1000); }
+
+// Waits on `cond` until `deadline`, returns false on timeout
+static bool _shim_wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t wait, const struct timespec *deadline) {
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static void _shim_deadline(struct timespec *ts, TickType_t wait) {
+    uint64_t ms = (uint64_t) wait * portTICK_PERIOD_MS;
+
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Critical sections
+ * ------------------------------------------------------------------------ */
+
+static pthread_mutex_t g_critical = PTHREAD_MUTEX_INITIALIZER;
+
+void vPortEnterCritical(portMUX_TYPE *mux) { pthread_mutex_lock(&g_critical); }
+
+void vPortExitCritical(portMUX_TYPE *mux) { pthread_mutex_unlock(&g_critical); }
+
+/* ---------------------------------------------------------------------------
+ * Queues and semaphores
+ * ------------------------------------------------------------------------ */
+
+struct shim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    size_t          item_size;
+    size_t          length;
+    size_t          count;
+    size_t          head;
+    uint8_t         data[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct shim_queue *q = calloc(1, sizeof(struct shim_queue) + length * item_size);
+    if (!q) return NULL;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+    q->item_size = item_size;
+    q->length    = length;
+
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+static BaseType_t _shim_queue_send(QueueHandle_t q, const void *item, TickType_t wait, bool front) {
+    struct timespec deadline;
+
+    _shim_deadline(&deadline, wait);
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count == q->length) {
+        if (!wait || !_shim_wait(&q->changed, &q->lock, wait, &deadline)) {
+            pthread_mutex_unlock(&q->lock);
+            return pdFALSE;
+        }
+    }
+
+    size_t slot;
+    if (front) {
+        q->head = (q->head + q->length - 1) % q->length;
+        slot    = q->head;
+    } else {
+        slot = (q->head + q->count) % q->length;
+    }
+    if (q->item_size) memcpy(&q->data[slot * q->item_size], item, q->item_size);
+    q->count++;
+
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait) { return _shim_queue_send(q, item, wait, false); }
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t wait) { return _shim_queue_send(q, item, wait, true); }
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait) {
+    struct timespec deadline;
+
+    _shim_deadline(&deadline, wait);
+    pthread_mutex_lock(&q->lock);
+
+    while (!q->count) {
+        if (!wait || !_shim_wait(&q->changed, &q->lock, wait, &deadline)) {
+            pthread_mutex_unlock(&q->lock);
+            return pdFALSE;
+        }
+    }
+
+    if (q->item_size) memcpy(item, &q->data[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    q->count = 0;
+    q->head  = 0;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return xQueueCreate(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    SemaphoreHandle_t sem = xQueueCreate(1, 0);
+    if (sem) xSemaphoreGive(sem);
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+    SemaphoreHandle_t sem = xQueueCreate(max, 0);
+    while (sem && initial--) xSemaphoreGive(sem);
+    return sem;
+}
+
+/* ---------------------------------------------------------------------------
+ * Tasks
+ * ------------------------------------------------------------------------ */
+
+struct shim_task {
+    pthread_mutex_t lock;
+    pthread_cond_t  notified;
+    uint32_t        notify;
+    TaskFunction_t  fn;
+    void           *arg;
+};
+
+// Threads not created through xTaskCreate get a handle on first use
+static __thread struct shim_task *g_current;
+
+static struct shim_task *_shim_task_new(void) {
+    struct shim_task *t = calloc(1, sizeof(struct shim_task));
+    if (!t) abort();
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->notified, NULL);
+
+    return t;
+}
+
+static void *_shim_task_entry(void *arg) {
+    g_current = arg;
+    g_current->fn(g_current->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle) {
+    struct shim_task *t = _shim_task_new();
+    pthread_attr_t    attr;
+    pthread_t         thread;
+
+    t->fn  = fn;
+    t->arg = arg;
+    if (handle) *handle = t;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int res = pthread_create(&thread, &attr, _shim_task_entry, t);
+    pthread_attr_destroy(&attr);
+
+    return res ? pdFAIL : pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle, BaseType_t core) {
+    return xTaskCreate(fn, name, stack, arg, prio, handle);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    // The handle may still be notified by others, it is never freed
+    if (task && (task != g_current)) abort();
+    pthread_exit(NULL);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (!g_current) g_current = _shim_task_new();
+    return g_current;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) { return tskIDLE_PRIORITY + 5; }
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_broadcast(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+    struct shim_task *t = xTaskGetCurrentTaskHandle();
+    struct timespec   deadline;
+    uint32_t          value;
+
+    _shim_deadline(&deadline, wait);
+    pthread_mutex_lock(&t->lock);
+
+    while (!t->notify) {
+        if (!wait || !_shim_wait(&t->notified, &t->lock, wait, &deadline)) break;
+    }
+
+    value = t->notify;
+    if (value) t->notify = clear ? 0 : (value - 1);
+
+    pthread_mutex_unlock(&t->lock);
+
+    return value;
+}
@@ -0,0 +1,46 @@
+/*
+ * FreeRTOS.h
+ *
+ * Host build of the FreeRTOS API subset used by the launcher, tasks are
+ * threads and ticks are milliseconds.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+typedef uint32_t      TickType_t;
+typedef long          BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY       ((TickType_t) 0xffffffff)
+#define configTICK_RATE_HZ  1000
+#define portTICK_PERIOD_MS  (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)   ((TickType_t) (ms) / portTICK_PERIOD_MS)
+#define portYIELD_FROM_ISR()
+#define tskIDLE_PRIORITY    0
+#define tskNO_AFFINITY      0x7fffffff
+
+/* Critical sections are a single process wide lock */
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)  vPortExitCritical(mux)
+#define taskENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define taskEXIT_CRITICAL(mux)  vPortExitCritical(mux)
@@ -0,0 +1,22 @@
+/*
+ * queue.h
+ *
+ * Host build of the FreeRTOS queues.
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct shim_queue *QueueHandle_t;
+typedef QueueHandle_t      xQueueHandle;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void          vQueueDelete(QueueHandle_t queue);
+BaseType_t    xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t    xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t    xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait);
+BaseType_t    xQueueReset(QueueHandle_t queue);
+UBaseType_t   uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#define xQueueSendToBack xQueueSend
@@ -0,0 +1,22 @@
+/*
+ * semphr.h
+ *
+ * Host build of the FreeRTOS semaphores, queues of empty items like the
+ * real ones.
+ */
+
+#pragma once
+
+#include "queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+
+#define xSemaphoreTake(sem, wait)            xQueueReceive((sem), NULL, (wait))
+#define xSemaphoreGive(sem)                  xQueueSend((sem), NULL, 0)
+#define xSemaphoreGiveFromISR(sem, woken)    xQueueSend((sem), NULL, 0)
+#define vSemaphoreDelete(sem)                vQueueDelete(sem)
+#define uxSemaphoreGetCount(sem)             uxQueueMessagesWaiting(sem)
@@ -0,0 +1,24 @@
+/*
+ * task.h
+ *
+ * Host build of the FreeRTOS tasks, one thread each. Only tasks deleting
+ * themselves are supported.
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct shim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+BaseType_t   xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle);
+BaseType_t   xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle, BaseType_t core);
+void         vTaskDelete(TaskHandle_t task);
+void         vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TickType_t   xTaskGetTickCount(void);
+UBaseType_t  uxTaskPriorityGet(TaskHandle_t task);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t   ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
@@ -0,0 +1,21 @@
+/*
+ * ice40.h
+ *
+ * Host build of the iCE40 driver API, the transfers are handled by the
+ * simulated gateware in fpga_sim.c.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+typedef struct {
+    int pin_int;
+} ICE40;
+
+esp_err_t ice40_send(ICE40 *device, const uint8_t *data, uint32_t length);
+esp_err_t ice40_send_turbo(ICE40 *device, const uint8_t *data, uint32_t length);
+esp_err_t ice40_transaction(ICE40 *device, uint8_t *data_out, uint32_t out_length, uint8_t *data_in, uint32_t in_length);
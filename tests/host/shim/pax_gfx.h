@@ -0,0 +1,23 @@
+/*
+ * pax_gfx.h
+ *
+ * Host build of the PAX types and text functions used by status
+ * indicators. Tests that draw provide the functions.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct pax_buf  pax_buf_t;
+typedef struct pax_font pax_font_t;
+typedef uint32_t        pax_col_t;
+
+typedef struct {
+    float x, y;
+} pax_vec1_t;
+
+extern const pax_font_t *pax_font_saira_regular;
+
+pax_vec1_t pax_text_size(const pax_font_t *font, float font_size, const char *text);
+void       pax_draw_text(pax_buf_t *buf, pax_col_t color, const pax_font_t *font, float font_size, float x, float y, const char *text);
@@ -0,0 +1,31 @@
+/*
+ * rp2040.h
+ *
+ * Host build of the RP2040 input definitions.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    RP2040_INPUT_BUTTON_HOME = 0,
+    RP2040_INPUT_BUTTON_MENU,
+    RP2040_INPUT_BUTTON_START,
+    RP2040_INPUT_BUTTON_ACCEPT,
+    RP2040_INPUT_BUTTON_BACK,
+    RP2040_INPUT_FPGA_CDONE,
+    RP2040_INPUT_BATTERY_CHARGING,
+    RP2040_INPUT_BUTTON_SELECT,
+    RP2040_INPUT_JOYSTICK_LEFT,
+    RP2040_INPUT_JOYSTICK_PRESS,
+    RP2040_INPUT_JOYSTICK_DOWN,
+    RP2040_INPUT_JOYSTICK_UP,
+    RP2040_INPUT_JOYSTICK_RIGHT,
+} rp2040_input_t;
+
+typedef struct {
+    uint8_t input;
+    bool    state;
+} rp2040_input_message_t;
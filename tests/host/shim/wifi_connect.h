@@ -0,0 +1,12 @@
+/*
+ * wifi_connect.h
+ *
+ * Host build of the WiFi connection API. Tests provide the functions.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+bool wifi_connect_to_stored(void);
+void wifi_disconnect_and_disable(void);
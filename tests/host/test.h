@@ -0,0 +1,28 @@
+/*
+ * test.h
+ *
+ * Minimal checks for the host tests: failures are reported and counted,
+ * the test program exits with an error if there were any.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+static int test_failures;
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                         \
+        }                                                                            \
+    } while (0)
+
+#define RUN(test)                      \
+    do {                               \
+        printf("%s\n", #test);         \
+        test();                        \
+    } while (0)
+
+#define TEST_RESULT() (test_failures ? (fprintf(stderr, "%d check(s) failed\n", test_failures), 1) : 0)
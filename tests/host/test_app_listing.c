@@ -0,0 +1,107 @@
+/*
+ * test_app_listing.c
+ *
+ * Versions of installed apps taken from the category listings of the
+ * hatchery, the way the app updater checks them.
+ */
+
+#include <string.h>
+
+#include "app_listing.h"
+#include "test.h"
+
+#define APP(t, c, s, v) {.type = t, .category = c, .slug = s, .installed_version = v, .available_version = -1}
+
+static bool apply(installed_app_t *apps, size_t amount, size_t index, const char *listing) {
+    return app_listing_apply(apps, amount, index, listing, strlen(listing));
+}
+
+static void test_mark_category(void) {
+    installed_app_t apps[] = {
+        APP("python", "games", "snake", 1), APP("python", "utilities", "clock", 1), APP("esp32", "games", "doom", 1), APP("python", "games", "tetris", 1),
+    };
+
+    // Same type and category only, from the given app on
+    app_listing_mark(apps, 4, 3);
+    CHECK(!apps[0].listed && apps[3].listed);
+
+    app_listing_mark(apps, 4, 0);
+    CHECK(apps[0].listed && !apps[1].listed && !apps[2].listed && apps[3].listed);
+}
+
+static void test_versions_from_listing(void) {
+    installed_app_t apps[] = {
+        APP("python", "games", "snake", 3), APP("python", "games", "pong", 1), APP("esp32", "games", "snake", 1), APP("python", "games", "tetris", 2),
+    };
+    const char *listing =
+        "[{\"slug\": \"tetris\", \"name\": \"Tetris\", \"version\": 4},"
+        " {\"name\": \"Snake\", \"version\": 3, \"slug\": \"snake\", \"author\": {\"slug\": \"pong\", \"version\": 9}},"
+        " {\"slug\": \"breakout\", \"version\": 1}]";
+
+    CHECK(apply(apps, 4, 0, listing));
+
+    // Updated, unchanged, missing from the listing
+    CHECK(apps[3].available_version == 4);
+    CHECK(apps[0].available_version == 3);
+    CHECK(apps[1].available_version == -1);
+
+    // Same slug in another type isn't in this listing
+    CHECK(apps[2].available_version == -1);
+}
+
+static void test_apps_before_index(void) {
+    installed_app_t apps[] = {APP("python", "games", "snake", 1), APP("python", "games", "pong", 1)};
+
+    // Earlier apps were checked with a listing of their own already
+    CHECK(apply(apps, 2, 1, "[{\"slug\": \"snake\", \"version\": 5}, {\"slug\": \"pong\", \"version\": 2}]"));
+    CHECK(apps[0].available_version == -1);
+    CHECK(apps[1].available_version == 2);
+}
+
+static void test_incomplete_entries(void) {
+    installed_app_t apps[] = {APP("python", "games", "snake", 1), APP("python", "games", "pong", 1), APP("python", "games", "tetris", 1)};
+    char            listing[2048];
+    char            description[1200];
+
+    // Without a numeric version the entry says nothing, long members don't get in the way
+    memset(description, 'x', sizeof(description) - 1);
+    description[sizeof(description) - 1] = '\0';
+    snprintf(listing, sizeof(listing),
+             "[{\"slug\": \"snake\"}, {\"slug\": \"pong\", \"version\": \"2\"}, {\"description\": \"%s\", \"slug\": \"tetris\", \"version\": 7}, {}, []]",
+             description);
+
+    CHECK(apply(apps, 3, 0, listing));
+    CHECK(apps[0].available_version == -1);
+    CHECK(apps[1].available_version == -1);
+    CHECK(apps[2].available_version == 7);
+}
+
+static void test_invalid_listing(void) {
+    installed_app_t apps[] = {APP("python", "games", "snake", 1), APP("python", "games", "pong", 1)};
+
+    // Entries before the error count, the error is reported
+    CHECK(!apply(apps, 2, 0, "[{\"slug\": \"snake\", \"version\": 2}, {\"slug\": \"pong\", \"version\": 3"));
+    CHECK(apps[0].available_version == 2);
+    CHECK(apps[1].available_version == -1);
+
+    CHECK(!apply(apps, 2, 0, "<html>502 Bad Gateway</html>"));
+    CHECK(!apply(apps, 2, 0, ""));
+
+    // Not an array: nothing at the depth of apps
+    CHECK(apply(apps, 2, 0, "{\"slug\": \"pong\", \"version\": 3}"));
+    CHECK(apps[1].available_version == -1);
+
+    // Arrays where apps should be
+    CHECK(apply(apps, 2, 0, "[[\"pong\", 3], [{\"slug\": \"pong\", \"version\": 3}]]"));
+    CHECK(apps[1].available_version == -1);
+}
+
+int main(void) {
+    RUN(test_mark_category);
+    RUN(test_versions_from_listing);
+    RUN(test_apps_before_index);
+    RUN(test_incomplete_entries);
+    RUN(test_invalid_listing);
+
+    return TEST_RESULT();
+}
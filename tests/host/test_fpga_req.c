@@ -0,0 +1,273 @@
+/*
+ * test_fpga_req.c
+ *
+ * FPGA file request server against the simulated gateware, set up the
+ * way the launcher and the file browser run a bitstream.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <freertos/FreeRTOS.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fpga_sim.h"
+#include "fpga_util.h"
+#include "test.h"
+
+static ICE40 g_ice40;
+static char  g_prefix[64];
+
+/* The file calls of the request server are wrapped at link time, to see
+ * how files get opened and synced */
+static int g_open_write;
+static int g_open_trunc;
+static int g_fsync;
+
+FILE *__real_fopen(const char *path, const char *mode);
+int   __real_open(const char *path, int flags, ...);
+int   __real_fsync(int fd);
+
+FILE *__wrap_fopen(const char *path, const char *mode) {
+    if (strchr(mode, 'w') || strchr(mode, '+') || strchr(mode, 'a')) g_open_write++;
+    if (strchr(mode, 'w')) g_open_trunc++;
+    return __real_fopen(path, mode);
+}
+
+int __wrap_open(const char *path, int flags, ...) {
+    va_list va;
+    va_start(va, flags);
+    int mode = va_arg(va, int);
+    va_end(va);
+
+    if ((flags & O_ACCMODE) != O_RDONLY) g_open_write++;
+    if (flags & O_TRUNC) g_open_trunc++;
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_fsync(int fd) {
+    g_fsync++;
+    return __real_fsync(fd);
+}
+
+static void make_path(char *path, size_t size, uint32_t fid) { snprintf(path, size, "%s/fpga_%08x.dat", g_prefix, fid); }
+
+static void make_file(uint32_t fid, const void *data, size_t len) {
+    char path[128];
+    make_path(path, sizeof(path), fid);
+    FILE *f = __real_fopen(path, "wb");
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+static size_t load_file(uint32_t fid, void *data, size_t max) {
+    char path[128];
+    make_path(path, sizeof(path), fid);
+    FILE *f = __real_fopen(path, "rb");
+    if (!f) return 0;
+    size_t len = fread(data, 1, max, f);
+    fclose(f);
+    return len;
+}
+
+static void start_bitstream(void) {
+    fpga_sim_init(&g_ice40);
+    CHECK(fpga_irq_setup(&g_ice40) == ESP_OK);
+    fpga_req_setup();
+    fpga_btn_reset();
+    fpga_stats_reset();
+}
+
+static void stop_bitstream(void) {
+    fpga_req_cleanup();
+    fpga_irq_cleanup(&g_ice40);
+}
+
+// Serves requests until the simulated FPGA has nothing pending
+static bool serve(void) {
+    esp_err_t err;
+
+    for (int i = 0; fpga_sim_busy(); i++) {
+        if (i == 100) return false;
+        fpga_req_process(g_prefix, &g_ice40, 100, &err);
+        if (err != ESP_OK) return false;
+    }
+    return true;
+}
+
+static bool read_back(uint32_t fid, uint32_t ofs, void *buf, size_t len) {
+    fpga_sim_fread(fid, ofs, len);
+    if (!serve()) return false;
+    return fpga_sim_fread_data(buf, len) == len;
+}
+
+static bool write_req(uint32_t fid, uint32_t ofs, const void *data, size_t len) {
+    fpga_sim_fwrite(fid, ofs, data, len);
+    return serve();
+}
+
+static void test_open_for_writing_on_write(void) {
+    uint8_t data[1000], buf[100];
+
+    memset(data, 'A', sizeof(data));
+    make_file(0x300, data, sizeof(data));
+
+    start_bitstream();
+    g_open_write = g_open_trunc = 0;
+
+    // Reading opens read-only
+    CHECK(read_back(0x300, 0, buf, sizeof(buf)));
+    CHECK(!memcmp(buf, data, sizeof(buf)));
+    CHECK(g_open_write == 0);
+
+    // The first write reopens for writing, without truncating
+    CHECK(write_req(0x300, 10, "wxyz", 4));
+    CHECK(write_req(0x300, 14, "1234", 4));
+    CHECK(g_open_write == 1);
+    CHECK(g_open_trunc == 0);
+
+    // And what was written is read back
+    memcpy(data + 10, "wxyz1234", 8);
+    CHECK(read_back(0x300, 0, buf, sizeof(buf)));
+    CHECK(!memcmp(buf, data, sizeof(buf)));
+
+    stop_bitstream();
+
+    CHECK(load_file(0x300, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(!memcmp(buf, data, sizeof(buf)));
+}
+
+static void test_create_after_miss(void) {
+    uint8_t data[512], buf[513];
+
+    start_bitstream();
+    g_open_trunc = 0;
+
+    // Missing when the FPGA first looks, read as zeroes
+    CHECK(read_back(0x301, 0, buf, 16));
+    CHECK(!buf[0] && !buf[15]);
+
+    // Appears behind our back, the write must not truncate it
+    memset(data, 'B', sizeof(data));
+    make_file(0x301, data, sizeof(data));
+    CHECK(write_req(0x301, 0, "new!", 4));
+    CHECK(g_open_trunc == 0);
+
+    stop_bitstream();
+
+    memcpy(data, "new!", 4);
+    CHECK(load_file(0x301, buf, sizeof(buf)) == sizeof(data));
+    CHECK(!memcmp(buf, data, sizeof(data)));
+
+    // Created if really missing
+    start_bitstream();
+    CHECK(write_req(0x305, 4, "abcd", 4));
+    stop_bitstream();
+    CHECK(load_file(0x305, buf, sizeof(buf)) == 8);
+    CHECK(!memcmp(buf, "\0\0\0\0abcd", 8));
+}
+
+static void test_new_bitstream_forgets_misses(void) {
+    uint8_t data[64], buf[64];
+
+    memset(data, 'C', sizeof(data));
+
+    start_bitstream();
+
+    CHECK(read_back(0x302, 0, buf, sizeof(buf)));
+    CHECK(!buf[0]);
+
+    // Misses are remembered while the bitstream runs
+    make_file(0x302, data, sizeof(data));
+    CHECK(read_back(0x302, 0, buf, sizeof(buf)));
+    CHECK(!buf[0]);
+
+    // But not by the next one
+    fpga_req_new_bitstream();
+    CHECK(read_back(0x302, 0, buf, sizeof(buf)));
+    CHECK(!memcmp(buf, data, sizeof(buf)));
+
+    stop_bitstream();
+}
+
+static void test_sync_written_files_only(void) {
+    uint8_t data[256], buf[16];
+
+    memset(data, 'D', sizeof(data));
+    make_file(0x303, data, sizeof(data));
+    make_file(0x304, data, sizeof(data));
+
+    start_bitstream();
+    fpga_req_set_flush_policy(FPGA_REQ_FLUSH_MANUAL);
+    g_fsync = 0;
+
+    CHECK(read_back(0x303, 0, buf, sizeof(buf)));
+    CHECK(read_back(0x304, 0, buf, sizeof(buf)));
+    CHECK(write_req(0x304, 0, "dirty", 5));
+    CHECK(g_fsync == 0);
+
+    fpga_req_flush();
+    CHECK(g_fsync == 1);
+
+    // Nothing written since
+    fpga_req_flush();
+    stop_bitstream();
+    CHECK(g_fsync == 1);
+
+    fpga_req_set_flush_policy(FPGA_REQ_FLUSH_IDLE);
+}
+
+static void test_sequential_readahead(void) {
+    static uint8_t data[64 * 1024], buf[1024];
+    struct fpga_stats stats;
+    bool              same = true;
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (i * 7) ^ (i >> 8);
+    make_file(0x100, data, sizeof(data));
+
+    start_bitstream();
+
+    for (size_t ofs = 0; ofs < sizeof(data); ofs += sizeof(buf)) {
+        CHECK(read_back(0x100, ofs, buf, sizeof(buf)));
+        same &= !memcmp(buf, data + ofs, sizeof(buf));
+    }
+    CHECK(same);
+
+    // All but the first two of the sequential stream come from read-ahead
+    fpga_stats_get(&stats);
+    CHECK(stats.fread == sizeof(data) / sizeof(buf));
+    CHECK(stats.fread_prefetched == stats.fread - 2);
+
+    stop_bitstream();
+}
+
+static void remove_prefix(void) {
+    struct dirent *de;
+    DIR           *dir = opendir(g_prefix);
+    char           path[512];
+
+    while (dir && (de = readdir(dir))) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", g_prefix, de->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+    rmdir(g_prefix);
+}
+
+int main(void) {
+    snprintf(g_prefix, sizeof(g_prefix), "fpga_req.XXXXXX");
+    if (!mkdtemp(g_prefix)) return 1;
+
+    RUN(test_sequential_readahead);
+    RUN(test_open_for_writing_on_write);
+    RUN(test_create_after_miss);
+    RUN(test_new_bitstream_forgets_misses);
+    RUN(test_sync_written_files_only);
+
+    remove_prefix();
+    return TEST_RESULT();
+}
@@ -0,0 +1,205 @@
+/*
+ * test_fpga_wb.c
+ *
+ * Wishbone bridge against the simulated gateware: ordering and completion
+ * of asynchronous execution, bulk transfers and their failures, and the
+ * lifetime of the execution task.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#include "fpga_sim.h"
+#include "fpga_util.h"
+#include "test.h"
+
+#define N_BUFS 8
+
+static ICE40 g_ice40;
+
+struct done_log {
+    SemaphoreHandle_t sem;
+    int               count;
+    bool              ok;
+    uint32_t          value_at_done;
+    uint32_t         *value;
+};
+
+static void done_cb(struct fpga_wb_cmdbuf *cb, bool ok, void *arg) {
+    struct done_log *log = arg;
+
+    // Read data must be there by the time completion is reported
+    if (log->value) log->value_at_done = *log->value;
+
+    log->count++;
+    log->ok = ok;
+    xSemaphoreGive(log->sem);
+}
+
+static void test_async_order(void) {
+    struct fpga_wb_cmdbuf *cbs[N_BUFS];
+    int                    dev;
+    uint32_t               addr, val;
+
+    fpga_sim_init(&g_ice40);
+    CHECK(fpga_wb_async_start(&g_ice40) == ESP_OK);
+
+    // Each buffer writes its index to a shared register and to its own
+    for (int i = 0; i < N_BUFS; i++) {
+        cbs[i] = fpga_wb_alloc(4);
+        fpga_wb_queue_write(cbs[i], 1, 0x100, i);
+        fpga_wb_queue_write(cbs[i], 1, 4 * i, 3 * i);
+        CHECK(fpga_wb_submit(cbs[i], NULL, NULL));
+    }
+
+    for (int i = 0; i < N_BUFS; i++) CHECK(fpga_wb_wait(cbs[i], portMAX_DELAY));
+
+    // Executed in submission order
+    CHECK(fpga_sim_wb_writes() == 2 * N_BUFS);
+    for (int i = 0; i < N_BUFS; i++) {
+        CHECK(fpga_sim_wb_log(2 * i, &dev, &addr, &val));
+        CHECK((dev == 1) && (addr == 0x100) && (val == i));
+        CHECK(fpga_sim_wb_log(2 * i + 1, &dev, &addr, &val));
+        CHECK((dev == 1) && (addr == 4 * i) && (val == 3 * i));
+    }
+    CHECK(fpga_sim_wb_peek(1, 0x100) == N_BUFS - 1);
+
+    for (int i = 0; i < N_BUFS; i++) fpga_wb_free(cbs[i]);
+    fpga_wb_async_stop();
+}
+
+static void test_async_callback(void) {
+    struct done_log        log = {.sem = xSemaphoreCreateCounting(N_BUFS, 0)};
+    struct fpga_wb_cmdbuf *cb  = fpga_wb_alloc(2);
+    uint32_t               value;
+
+    fpga_sim_init(&g_ice40);
+    fpga_sim_wb_poke(3, 0x40, 0xcafe1234);
+    CHECK(fpga_wb_async_start(&g_ice40) == ESP_OK);
+
+    // Completion is reported once the read data was filled in
+    log.value = &value;
+    value     = 0;
+    fpga_wb_queue_read(cb, 3, 0x40, &value);
+    CHECK(fpga_wb_submit(cb, done_cb, &log));
+    CHECK(xSemaphoreTake(log.sem, 5000) == pdTRUE);
+    CHECK(log.ok);
+    CHECK(log.value_at_done == 0xcafe1234);
+
+    // Failures are reported as well
+    fpga_wb_reset(cb);
+    fpga_wb_queue_write(cb, 3, 0x40, 0);
+    fpga_sim_fail_after(0);
+    CHECK(fpga_wb_submit(cb, done_cb, &log));
+    CHECK(xSemaphoreTake(log.sem, 5000) == pdTRUE);
+    CHECK(!log.ok);
+    CHECK(log.count == 2);
+    fpga_sim_fail_after(-1);
+
+    fpga_wb_async_stop();
+    fpga_wb_free(cb);
+    vSemaphoreDelete(log.sem);
+}
+
+static void test_bulk_after_async(void) {
+    struct fpga_wb_cmdbuf *cb = fpga_wb_alloc(2);
+    uint32_t               val[4];
+
+    fpga_sim_init(&g_ice40);
+    CHECK(fpga_wb_async_start(&g_ice40) == ESP_OK);
+
+    // A short bulk read sees what was submitted before it
+    fpga_wb_queue_write(cb, 2, 0x8, 0x12345678);
+    CHECK(fpga_wb_submit(cb, NULL, NULL));
+    CHECK(fpga_wb_bulk_read(&g_ice40, 2, 0x0, val, 4, true));
+    CHECK(val[2] == 0x12345678);
+    CHECK(fpga_wb_wait(cb, portMAX_DELAY));
+
+    fpga_wb_async_stop();
+    fpga_wb_free(cb);
+}
+
+static void test_bulk_roundtrip(void) {
+    static uint32_t wr[1000], rd[1000];
+    int             dev;
+    uint32_t        addr, val;
+
+    fpga_sim_init(&g_ice40);
+
+    for (int i = 0; i < 1000; i++) wr[i] = 0x01000000 * (i & 0xff) + i;
+
+    // Incrementing, split over many buffers
+    CHECK(fpga_wb_bulk_write(&g_ice40, 4, 0x0, wr, 1000, true));
+    CHECK(fpga_wb_bulk_read(&g_ice40, 4, 0x0, rd, 1000, true));
+    CHECK(!memcmp(wr, rd, sizeof(wr)));
+
+    // Fixed address, every word reaches it in order
+    size_t base = fpga_sim_wb_writes();
+    CHECK(fpga_wb_bulk_write(&g_ice40, 5, 0x20, wr, 600, false));
+    CHECK(fpga_sim_wb_writes() == base + 600);
+    for (int i = 0; i < 600; i++) {
+        CHECK(fpga_sim_wb_log(base + i, &dev, &addr, &val));
+        if ((dev != 5) || (addr != 0x20) || (val != wr[i])) {
+            CHECK(!"fixed address burst out of order");
+            break;
+        }
+    }
+
+    fpga_wb_async_stop();
+}
+
+static void test_bulk_failure(void) {
+    static uint32_t wr[2000];
+
+    fpga_sim_init(&g_ice40);
+
+    // Fails without hanging, whichever buffer fails
+    for (int n = 0; n < 4; n++) {
+        fpga_sim_fail_after(n);
+        CHECK(!fpga_wb_bulk_write(&g_ice40, 1, 0x0, wr, 2000, true));
+        CHECK(!fpga_wb_bulk_read(&g_ice40, 1, 0x0, wr, 10, true));
+    }
+
+    // And recovers once the bus works again
+    fpga_sim_fail_after(-1);
+    CHECK(fpga_wb_bulk_write(&g_ice40, 1, 0x0, wr, 2000, true));
+
+    fpga_wb_async_stop();
+}
+
+static void test_cleanup_stops_async(void) {
+    struct fpga_wb_cmdbuf *cb = fpga_wb_alloc(2);
+    uint32_t               val[100];
+
+    fpga_sim_init(&g_ice40);
+    fpga_wb_queue_write(cb, 1, 0x0, 1);
+
+    // Bulk transfers start the task, request cleanup stops it
+    CHECK(fpga_irq_setup(&g_ice40) == ESP_OK);
+    fpga_req_setup();
+    CHECK(fpga_wb_bulk_read(&g_ice40, 1, 0x0, val, 100, true));
+    fpga_req_cleanup();
+    CHECK(!fpga_wb_submit(cb, NULL, NULL));
+
+    // So does IRQ cleanup
+    CHECK(fpga_wb_bulk_read(&g_ice40, 1, 0x0, val, 100, true));
+    fpga_irq_cleanup(&g_ice40);
+    CHECK(!fpga_wb_submit(cb, NULL, NULL));
+
+    // Nothing to do without a task
+    fpga_wb_async_stop();
+    fpga_wb_free(cb);
+}
+
+int main(void) {
+    RUN(test_async_order);
+    RUN(test_async_callback);
+    RUN(test_bulk_after_async);
+    RUN(test_bulk_roundtrip);
+    RUN(test_bulk_failure);
+    RUN(test_cleanup_stops_async);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,293 @@
+/*
+ * test_install_queue.c
+ *
+ * Background installation queue: jobs going through their states in
+ * order, cancellation of queued and running jobs, and WiFi being shared
+ * between the queue and the menus. The installation itself and WiFi are
+ * fakes that the test controls.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "app_management.h"
+#include "http_download.h"
+#include "install_queue.h"
+#include "test.h"
+#include "wifi_connect.h"
+
+#define WAIT_MS 5000
+
+/* ---------------------------------------------------------------------------
+ * Fakes
+ * ------------------------------------------------------------------------ */
+
+static SemaphoreHandle_t g_install_go;     // Given once per installation allowed to finish
+static volatile bool     g_install_wait;   // Installations wait for g_install_go
+static volatile bool     g_install_result; // What a finished installation returns
+static char              g_installed[64][48];
+static volatile int      g_installs;
+
+static volatile bool g_wifi_available = true;
+static volatile bool g_wifi_up;
+static volatile int  g_connects;
+static volatile int  g_disconnects;
+static volatile bool g_download_without_wifi;
+
+bool wifi_connect_to_stored(void) {
+    g_connects++;
+    g_wifi_up = g_wifi_available;
+    return g_wifi_up;
+}
+
+void wifi_disconnect_and_disable(void) {
+    g_disconnects++;
+    g_wifi_up = false;
+}
+
+void download_close_connections(void) {}
+
+bool install_app_background(const char *type_slug, bool to_sd_card, char *data_app_info, size_t size_app_info, install_progress_t progress, void *ctx,
+                            const volatile bool *cancel) {
+    int n = g_installs;
+
+    sscanf(data_app_info, "{\"slug\": \"%47[^\"]\"", g_installed[n % 64]);
+    g_installs = n + 1;
+    progress(ctx, INSTALL_STAGE_DOWNLOADING, 0, 1);
+
+    // Downloading until allowed to finish or cancelled, with WiFi up all along
+    while (g_install_wait && !*cancel) {
+        if (!g_wifi_up) g_download_without_wifi = true;
+        if (xSemaphoreTake(g_install_go, 1)) break;
+    }
+    if (!g_wifi_up) g_download_without_wifi = true;
+    if (*cancel) return false;
+
+    progress(ctx, INSTALL_STAGE_VERIFYING, 1, 1);
+    return g_install_result;
+}
+
+const pax_font_t *pax_font_saira_regular;
+
+pax_vec1_t pax_text_size(const pax_font_t *font, float font_size, const char *text) { return (pax_vec1_t){0}; }
+
+void pax_draw_text(pax_buf_t *buf, pax_col_t color, const pax_font_t *font, float font_size, float x, float y, const char *text) {}
+
+/* ---------------------------------------------------------------------------
+ * Helpers
+ * ------------------------------------------------------------------------ */
+
+static uint32_t add(const char *slug) {
+    char data[128];
+
+    snprintf(data, sizeof(data), "{\"slug\": \"%s\", \"name\": \"App %s\", \"version\": 1}", slug, slug);
+    return install_queue_add("python", false, data, strlen(data));
+}
+
+// State of the job, -1 if it is gone
+static int state(uint32_t id) {
+    install_job_status_t status[INSTALL_QUEUE_SIZE];
+    size_t               amount = install_queue_get_status(status, INSTALL_QUEUE_SIZE);
+
+    for (size_t i = 0; i < amount; i++) {
+        if (status[i].id == id) return status[i].state;
+    }
+    return -1;
+}
+
+static bool wait_state(uint32_t id, int expected) {
+    for (int ms = 0; ms < WAIT_MS; ms++) {
+        if (state(id) == expected) return true;
+        vTaskDelay(1);
+    }
+    return false;
+}
+
+// Queue finished and, unless somebody else holds it, WiFi disabled
+static bool wait_idle(bool wifi_up) {
+    for (int ms = 0; ms < WAIT_MS; ms++) {
+        if (!install_queue_busy() && (g_wifi_up == wifi_up)) return true;
+        vTaskDelay(1);
+    }
+    return false;
+}
+
+static void reset(void) {
+    g_install_wait   = true;
+    g_install_result = true;
+    g_wifi_available = true;
+    g_installs       = 0;
+    g_connects       = 0;
+    g_disconnects    = 0;
+    while (xSemaphoreTake(g_install_go, 0)) {
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Tests
+ * ------------------------------------------------------------------------ */
+
+static void test_job_states(void) {
+    uint32_t installed = install_queue_installed();
+
+    reset();
+    uint32_t id = add("snake");
+    CHECK(id != 0);
+    CHECK(install_queue_busy());
+    CHECK(install_queue_find("python", "snake") == id);
+    CHECK(install_queue_find("esp32", "snake") == 0);
+
+    // Downloading with WiFi connected for the job, then done
+    CHECK(wait_state(id, INSTALL_JOB_DOWNLOADING));
+    CHECK(g_wifi_up && (g_connects == 1));
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(id, INSTALL_JOB_DONE));
+    CHECK(install_queue_installed() == installed + 1);
+    CHECK(install_queue_find("python", "snake") == 0);
+    CHECK(install_queue_cancel(id) == false);
+
+    // A failed installation doesn't count as installed
+    g_install_result = false;
+    id               = add("pong");
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(id, INSTALL_JOB_FAILED));
+    CHECK(install_queue_installed() == installed + 1);
+
+    // WiFi is disabled once the queue is done with it
+    CHECK(wait_idle(false));
+    CHECK(g_disconnects >= 1);
+    CHECK(!g_download_without_wifi);
+}
+
+static void test_invalid_metadata(void) {
+    const char *invalid[] = {"", "<html>502 Bad Gateway</html>", "{\"slug\": \"snake\"}", "{\"slug\": \"snake\", \"name\": 3}",
+                             "[\"slug\", \"name\"]", "{\"slug\": \"snake\", \"name\": \"Snake\""};
+
+    reset();
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) CHECK(install_queue_add("python", false, invalid[i], strlen(invalid[i])) == 0);
+    CHECK(!install_queue_busy());
+    CHECK(g_connects == 0);
+}
+
+static void test_cancel(void) {
+    reset();
+    uint32_t running = add("tetris");
+    uint32_t queued  = add("breakout");
+    uint32_t last    = add("invaders");
+    CHECK(wait_state(running, INSTALL_JOB_DOWNLOADING));
+
+    // A queued job is cancelled right away, a running one once the installation stopped
+    CHECK(install_queue_cancel(queued));
+    CHECK(state(queued) == INSTALL_JOB_CANCELLED);
+    CHECK(install_queue_cancel(running));
+    CHECK(wait_state(running, INSTALL_JOB_CANCELLED));
+    CHECK(install_queue_cancel(running) == false);
+    CHECK(install_queue_cancel(0) == false);
+
+    // The next job still runs, the cancelled one never starts
+    CHECK(wait_state(last, INSTALL_JOB_DOWNLOADING));
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(last, INSTALL_JOB_DONE));
+    CHECK(g_installs == 2);
+    CHECK(!strcmp(g_installed[0], "tetris") && !strcmp(g_installed[1], "invaders"));
+    CHECK(wait_idle(false));
+}
+
+static void test_order_and_slots(void) {
+    uint32_t ids[INSTALL_QUEUE_SIZE];
+    char     slug[16];
+
+    reset();
+    for (int i = 0; i < INSTALL_QUEUE_SIZE; i++) {
+        snprintf(slug, sizeof(slug), "app%d", i);
+        ids[i] = add(slug);
+        CHECK(ids[i] != 0);
+    }
+
+    // No slot while every job is unfinished
+    CHECK(add("extra") == 0);
+
+    // Oldest first
+    for (int i = 0; i < INSTALL_QUEUE_SIZE; i++) {
+        CHECK(wait_state(ids[i], INSTALL_JOB_DOWNLOADING));
+        xSemaphoreGive(g_install_go);
+        CHECK(wait_state(ids[i], INSTALL_JOB_DONE));
+        snprintf(slug, sizeof(slug), "app%d", i);
+        CHECK(!strcmp(g_installed[i], slug));
+    }
+    CHECK(wait_idle(false));
+
+    // The oldest finished job makes room for a new one
+    uint32_t id = add("extra");
+    CHECK(id > ids[INSTALL_QUEUE_SIZE - 1]);
+    CHECK(state(ids[0]) == -1);
+    CHECK(state(ids[1]) == INSTALL_JOB_DONE);
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(id, INSTALL_JOB_DONE));
+    CHECK(wait_idle(false));
+}
+
+static void test_no_network(void) {
+    reset();
+    g_wifi_available = false;
+
+    uint32_t first  = add("snake");
+    uint32_t second = add("pong");
+    CHECK(wait_state(first, INSTALL_JOB_FAILED));
+    CHECK(wait_state(second, INSTALL_JOB_FAILED));
+    CHECK(g_installs == 0);
+    CHECK(wait_idle(false));
+}
+
+static void test_shared_network(void) {
+    reset();
+
+    // A menu holding the network keeps WiFi up after the queue is done
+    CHECK(install_queue_take_network());
+    CHECK(g_connects == 1);
+    uint32_t id = add("snake");
+    CHECK(wait_state(id, INSTALL_JOB_DOWNLOADING));
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(id, INSTALL_JOB_DONE));
+    CHECK(wait_idle(true));
+    CHECK(g_connects == 1);
+
+    // The queue keeps it up after the menu is done with it
+    id = add("pong");
+    CHECK(wait_state(id, INSTALL_JOB_DOWNLOADING));
+    install_queue_release_network();
+    CHECK(g_wifi_up);
+    xSemaphoreGive(g_install_go);
+    CHECK(wait_state(id, INSTALL_JOB_DONE));
+    CHECK(wait_idle(false));
+    CHECK(g_connects == 1);
+
+    // Jobs queued and the network taken while the queue shuts down never find WiFi disabled under them
+    g_install_wait = false;
+    for (int i = 0; i < 200; i++) {
+        id = add("tetris");
+        CHECK(wait_state(id, INSTALL_JOB_DONE));
+        bool taken = install_queue_take_network();
+        CHECK(taken && g_wifi_up);
+        if (taken) install_queue_release_network();
+    }
+    CHECK(wait_idle(false));
+    CHECK(!g_download_without_wifi);
+}
+
+int main(void) {
+    g_install_go = xSemaphoreCreateCounting(64, 0);
+    install_queue_init();
+
+    RUN(test_job_states);
+    RUN(test_invalid_metadata);
+    RUN(test_cancel);
+    RUN(test_order_and_slots);
+    RUN(test_no_network);
+    RUN(test_shared_network);
+
+    return TEST_RESULT();
+}
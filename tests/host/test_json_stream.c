@@ -0,0 +1,112 @@
+/*
+ * test_json_stream.c
+ *
+ * Streaming JSON parser: values as they are handed to the callback, with
+ * the document fed in blocks of any size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_stream.h"
+#include "test.h"
+
+// Last string value seen for the member "text"
+struct capture {
+    char  *text;
+    size_t strings;
+};
+
+static bool capture_cb(void *ctx, json_stream_event_t event, const char *key, const char *value, size_t depth) {
+    struct capture *c = ctx;
+
+    if (event != JSON_STREAM_STRING) return true;
+    c->strings++;
+    if (key && !strcmp(key, "text")) {
+        free(c->text);
+        c->text = strdup(value);
+    }
+    return true;
+}
+
+// Feeds the document in blocks of `block` bytes
+static bool parse(const char *doc, size_t block, struct capture *c) {
+    json_stream_t stream;
+    bool          ok  = true;
+    size_t        len = strlen(doc);
+
+    json_stream_init(&stream, capture_cb, c);
+    for (size_t pos = 0; ok && (pos < len); pos += block) ok = json_stream_feed(&stream, doc + pos, (len - pos < block) ? len - pos : block);
+    ok = ok && json_stream_finish(&stream);
+    json_stream_free(&stream);
+
+    return ok;
+}
+
+static char *make_doc(size_t text_len) {
+    char *doc = malloc(text_len + 64);
+
+    strcpy(doc, "{\"name\": \"x\", \"text\": \"");
+    size_t pos = strlen(doc);
+    for (size_t i = 0; i < text_len; i++) doc[pos++] = 'a' + (i % 26);
+    strcpy(doc + pos, "\", \"end\": true}");
+
+    return doc;
+}
+
+static void test_long_strings(void) {
+    size_t lens[] = {0, 1, JSON_STREAM_VALUE_INITIAL - 1, JSON_STREAM_VALUE_INITIAL, 2000, JSON_STREAM_VALUE_MAX - 1};
+    size_t blocks[] = {1, 7, 256, 1 << 20};
+
+    // Delivered whole, however the document is split up
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        char *doc = make_doc(lens[l]);
+        for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+            struct capture c = {0};
+            CHECK(parse(doc, blocks[b], &c));
+            CHECK(c.text && (strlen(c.text) == lens[l]));
+            CHECK(c.text && (!lens[l] || (c.text[lens[l] - 1] == 'a' + ((lens[l] - 1) % 26))));
+            free(c.text);
+        }
+        free(doc);
+    }
+}
+
+static void test_truncated_beyond_max(void) {
+    char          *doc = make_doc(JSON_STREAM_VALUE_MAX + 100);
+    struct capture c   = {0};
+
+    CHECK(parse(doc, 4096, &c));
+    CHECK(c.text && (strlen(c.text) == JSON_STREAM_VALUE_MAX - 1));
+    CHECK(c.strings == 2);
+
+    free(c.text);
+    free(doc);
+}
+
+static void test_escapes_across_blocks(void) {
+    struct capture c = {0};
+
+    CHECK(parse("{\"text\": \"a\\\"b\\u00e9\\ud83d\\ude00\\n\"}", 1, &c));
+    CHECK(c.text && !strcmp(c.text, "a\"b\xc3\xa9\xf0\x9f\x98\x80\n"));
+    free(c.text);
+}
+
+static void test_errors(void) {
+    struct capture c = {0};
+
+    CHECK(!parse("{\"text\": \"unterminated}", 3, &c));
+    CHECK(!parse("[1, 2", 1, &c));
+    CHECK(!parse("{\"a\" 1}", 1, &c));
+    CHECK(!parse("", 1, &c));
+    free(c.text);
+}
+
+int main(void) {
+    RUN(test_long_strings);
+    RUN(test_truncated_beyond_max);
+    RUN(test_escapes_across_blocks);
+    RUN(test_errors);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+"""Wrap an iCE40 bitstream in the compressed container understood by the
+firmware's bitstream loader (see main/include/fpga_loader.h)."""
+
+import argparse
+import struct
+import zlib
+
+MAGIC = b"ICEZ"
+
+# A small window keeps the inflate dictionary on the badge small, bitstreams
+# are mostly runs of zeroes so this costs next to nothing in ratio.
+WINDOW_BITS = 12
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("input", help="raw bitstream")
+    parser.add_argument("output", help="compressed bitstream")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        raw = f.read()
+
+    z = zlib.compressobj(9, zlib.DEFLATED, WINDOW_BITS)
+    data = z.compress(raw) + z.flush()
+
+    with open(args.output, "wb") as f:
+        f.write(MAGIC + struct.pack("<I", len(raw)) + data)
+
+    print("{}: {} -> {} bytes".format(args.output, len(raw), len(data) + 8))
+
+
+if __name__ == "__main__":
+    main()